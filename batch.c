@@ -0,0 +1,49 @@
+#include "batch.h"
+#include "rcon_host.h"
+#include "console.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t total_console = 0;
+static uint64_t total_pipelined = 0;
+static uint64_t total_commands = 0;
+
+int batch_exec(const char *const *commands, const size_t count, const struct timespec *deadline)
+{
+	int r = 0;
+	for(size_t i = 0; i < count; i ++)
+		if(strchr(commands[i], '\n') != NULL) return 64;
+	const bool console = console_available();
+	if(console)
+	{
+		for(size_t i = 0; i < count && !r; i ++)
+			r = console_send(commands[i]);
+	}
+	else
+	{
+		r = rcon_host_exec_batch(commands, count, deadline, NULL, NULL);
+	}
+	if(r) return r;
+	pthread_mutex_lock(&batch_mutex);
+	if(console) total_console ++;
+	else total_pipelined ++;
+	total_commands += count;
+	pthread_mutex_unlock(&batch_mutex);
+	return 0;
+}
+
+void batch_dump(int out)
+{
+	pthread_mutex_lock(&batch_mutex);
+	const uint64_t console = total_console, pipelined = total_pipelined, commands = total_commands;
+	pthread_mutex_unlock(&batch_mutex);
+	dprintf(out, _("Batches written to the console:\t%" PRIu64 "\nBatches pipelined:\t%" PRIu64 "\nCommands:\t%" PRIu64 "\n"),
+			console, pipelined, commands);
+}
@@ -0,0 +1,14 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* Run the commands on the console if there is one, or else pipelined over the rcon connection of the
+ * calling thread before deadline (see rcon_host_deadline).
+ * Returns 64 if a command contains a newline. */
+int batch_exec(const char *const *commands, const size_t count, const struct timespec *deadline);
+
+void batch_dump(int out);
+
+#endif // _BATCH_H
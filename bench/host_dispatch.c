@@ -0,0 +1,183 @@
+/*
+ * Event dispatch throughput: the same chat events go to a serialized plugin in process, copied and
+ * queued on the thread pool like mcin does, and to a plugin host, pushed on the shared memory ring
+ * and handled by a forked consumer. The run reports both throughputs and their ratio.
+ */
+
+#include "../host_ring.h"
+#include "../plugin_queue.h"
+#include "../thpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sysexits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct event {
+	char *player;
+	char *message;
+};
+
+static int events = 1000000;
+static int message_size = 32;
+static uint64_t checksum = 0;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n events] [-s message size] [-t threads]\n", argv0);
+}
+
+/* The handler: reads the whole event, as a plugin would. */
+static uint64_t handle(const char *player, const char *message)
+{
+	uint64_t sum = 0;
+	for(const char *c = player; *c; c ++) sum += *c;
+	for(const char *c = message; *c; c ++) sum += *c;
+	return sum;
+}
+
+static void inproc_call(void *arg)
+{
+	struct event *event = arg;
+	/* One at a time: the queue runs the jobs of the plugin serially. */
+	checksum += handle(event->player, event->message);
+	free(event->player);
+	free(event->message);
+	free(event);
+}
+
+static int run_inproc(const char *player, const char *message, int threads, double *elapsed)
+{
+	threadpool thpool = thpool_init(threads);
+	struct plugin_queue *queue = plugin_queue_new("bench", false);
+	if(thpool == NULL || queue == NULL) return EX_OSERR;
+	const uint64_t start = now_ns();
+	for(int i = 0; i < events; i ++)
+	{
+		struct event *event = malloc(sizeof(struct event));
+		if(event == NULL) return EX_OSERR;
+		event->player = strdup(player);
+		event->message = strdup(message);
+		if(event->player == NULL || event->message == NULL) return EX_OSERR;
+		plugin_queue_push(queue, thpool, &inproc_call, event);
+	}
+	plugin_queue_wait(queue);
+	*elapsed = (now_ns() - start) / 1e9;
+	plugin_queue_free(queue);
+	thpool_destroy(thpool);
+	return 0;
+}
+
+static int run_host(const char *player, const char *message, double *elapsed, uint64_t *full)
+{
+	int fd;
+	struct host_shm *shm;
+	int r = host_shm_create(&fd, &shm);
+	if(r) return r;
+	const pid_t pid = fork();
+	if(pid == -1) return errno;
+	if(pid == 0)
+	{
+		struct host_record *record = malloc(sizeof(struct host_record));
+		if(record == NULL) _exit(EX_OSERR);
+		uint64_t sum = 0;
+		while((r = host_ring_pop(shm, record, 1000)) != ESHUTDOWN)
+		{
+			if(r) continue;
+			sum += handle(record->args[0], record->args[1]);
+		}
+		_exit(sum == checksum ? 0 : EX_SOFTWARE);
+	}
+	const char *const args[HOST_RECORD_ARGS] = { player, message, NULL, NULL, NULL };
+	const uint64_t start = now_ns();
+	for(int i = 0; i < events; i ++)
+	{
+		/* The core drops the event instead. Wait here so both runs handle every event. */
+		while(host_ring_push(shm, 5, args) == ENOSPC)
+		{
+			++ *full;
+			sched_yield();
+		}
+	}
+	host_ring_stop(shm);
+	int status;
+	waitpid(pid, &status, 0);
+	*elapsed = (now_ns() - start) / 1e9;
+	host_shm_unmap(shm);
+	close(fd);
+	if(!WIFEXITED(status) || WEXITSTATUS(status)) return EX_SOFTWARE;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int threads = 4;
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:t:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n': events = atoi(optarg); break;
+			case 's': message_size = atoi(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return EX_USAGE;
+		}
+	}
+	if(events <= 0 || message_size <= 0 || message_size > HOST_RECORD_MAX / 2 || threads <= 0)
+	{
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+	char *message = malloc(message_size + 1);
+	if(message == NULL) return EX_OSERR;
+	memset(message, 'x', message_size);
+	message[message_size] = '\0';
+	const char *player = "Steve";
+	/* What the consumer must add up to. */
+	for(int i = 0; i < events; i ++)
+		checksum += handle(player, message);
+
+	double host_elapsed = 0, inproc_elapsed = 0;
+	uint64_t full = 0;
+	/* Forks first, while this is the only thread. */
+	int r = run_host(player, message, &host_elapsed, &full);
+	if(r)
+	{
+		fprintf(stderr, "Host run failed: %d.\n", r);
+		goto cleanup;
+	}
+	const uint64_t expected = checksum;
+	checksum = 0;
+	r = run_inproc(player, message, threads, &inproc_elapsed);
+	if(r || checksum != expected)
+	{
+		fprintf(stderr, "In-process run failed: %d.\n", r);
+		if(!r) r = EX_SOFTWARE;
+		goto cleanup;
+	}
+	printf("Events:\t%d of %d bytes\n", events, message_size);
+	printf("In process (%d threads):\t%.3f s\t%.0f events/s\n", threads, inproc_elapsed, events / inproc_elapsed);
+	printf("Plugin host:\t%.3f s\t%.0f events/s\t%" PRIu64 " waits on a full ring\n", host_elapsed, events / host_elapsed, full);
+	printf("Host / in process:\t%.2f\n", inproc_elapsed / host_elapsed);
+cleanup:
+	free(message);
+	return r;
+}
@@ -0,0 +1,211 @@
+/*
+ * Minimal rcon server for testing and benchmarking extmc without a Minecraft server.
+ * Replies with the command text (or -r bytes of padding), split into packets like the
+ * vanilla server does, and answers unknown packet types with "Unknown request".
+ */
+
+#include "../rcon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const char *password = "password";
+static bool reject_auth = false;
+static int latency_ms = 0;
+static int jitter_ms = 0;
+static int chunk_size = 4096;
+static int reply_size = -1;
+static const char *online = NULL;
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-P password] [-f] [-l latency ms] [-j jitter ms] [-s chunk size] [-r reply size] [-L player,...]\n"
+			"  -f  Reject every authentication attempt.\n"
+			"  -r  Reply with this many bytes instead of echoing the command.\n"
+			"  -L  Answer 'list' like a vanilla server with these players online.\n",
+			argv0);
+}
+
+static void delay()
+{
+	int ms = latency_ms;
+	if(jitter_ms > 0) ms += rand() % (jitter_ms + 1);
+	if(ms <= 0) return;
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+static int reply(int fd, int id, const char *body, int len)
+{
+	struct rc_packet pkt;
+	char chunk[RCON_DATA_BUFFSIZE + 1];
+	int sent = 0;
+	do
+	{
+		int size = len - sent;
+		if(size > chunk_size) size = chunk_size;
+		memcpy(chunk, &body[sent], size);
+		chunk[size] = '\0';
+		int r = rcon_build_packet(&pkt, id, RCON_RESPONSEVALUE, chunk);
+		if(!r) r = rcon_send_packet(fd, &pkt);
+		if(r) return r;
+		sent += size;
+	}
+	while(sent < len);
+	return 0;
+}
+
+static int reply_list(int fd, int id)
+{
+	char list[RCON_DATA_BUFFSIZE];
+	int count = online[0] == '\0' ? 0 : 1;
+	for(const char *c = online; *c; c ++)
+		if(*c == ',') count ++;
+	int len = snprintf(list, sizeof(list), "There are %d of a max of 20 players online: ", count);
+	for(const char *c = online; *c && len < (int)sizeof(list) - 2; c ++)
+	{
+		list[len ++] = *c;
+		if(*c == ',') list[len ++] = ' ';
+	}
+	list[len] = '\0';
+	return reply(fd, id, list, len);
+}
+
+static void *client_main(void *arg)
+{
+	const int fd = (int)(intptr_t)arg;
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct rc_packet pkt;
+	char *padding = NULL;
+	if(reply_size >= 0)
+	{
+		padding = malloc(reply_size + 1);
+		memset(padding, 'x', reply_size);
+		padding[reply_size] = '\0';
+	}
+	bool authed = false;
+	while(!rcon_recv_packet(&pkt, fd))
+	{
+		int r = 0;
+		const int id = pkt.id;
+		switch(pkt.cmd)
+		{
+			case RCON_AUTHENTICATE:
+				authed = !reject_auth && !strcmp(pkt.data, password);
+				r = rcon_build_packet(&pkt, authed ? id : -1, RCON_AUTH_RESPONSE, "");
+				if(!r) r = rcon_send_packet(fd, &pkt);
+				break;
+			case RCON_EXEC_COMMAND:
+				if(!authed)
+				{
+					r = 1;
+					break;
+				}
+				delay();
+				if(online != NULL && !strcmp(pkt.data, "list"))
+					r = reply_list(fd, id);
+				else if(padding != NULL)
+					r = reply(fd, id, padding, reply_size);
+				else
+					r = reply(fd, id, pkt.data, strlen(pkt.data));
+				break;
+			default:
+			{
+				char msg[64];
+				snprintf(msg, sizeof(msg), "Unknown request %x", pkt.cmd);
+				r = reply(fd, id, msg, strlen(msg));
+				break;
+			}
+		}
+		if(r) break;
+	}
+	free(padding);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *port = "25575";
+	int opt;
+	while((opt = getopt(argc, argv, "p:P:fl:j:s:r:L:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p': port = optarg; break;
+			case 'P': password = optarg; break;
+			case 'f': reject_auth = true; break;
+			case 'l': latency_ms = atoi(optarg); break;
+			case 'j': jitter_ms = atoi(optarg); break;
+			case 's': chunk_size = atoi(optarg); break;
+			case 'r': reply_size = atoi(optarg); break;
+			case 'L': online = optarg; break;
+			default:
+				usage(argv[0]);
+				return EX_USAGE;
+		}
+	}
+	if(chunk_size <= 0 || chunk_size > RCON_DATA_BUFFSIZE)
+	{
+		fprintf(stderr, "Chunk size must be between 1 and %d.\n", RCON_DATA_BUFFSIZE);
+		return EX_USAGE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	struct addrinfo hints, *info;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int r = getaddrinfo(NULL, port, &hints, &info);
+	if(r)
+	{
+		fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(r));
+		return EX_USAGE;
+	}
+	const int sd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	const int one = 1;
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(sd == -1 || bind(sd, info->ai_addr, info->ai_addrlen) || listen(sd, 128))
+	{
+		fprintf(stderr, "Cannot listen on %s: %s\n", port, strerror(errno));
+		freeaddrinfo(info);
+		return EX_OSERR;
+	}
+	freeaddrinfo(info);
+	printf("Listening on %s.\n", port);
+	fflush(stdout);
+	while(true)
+	{
+		const int fd = accept(sd, NULL, NULL);
+		if(fd == -1)
+		{
+			if(errno == EINTR) continue;
+			fprintf(stderr, "accept(): %s\n", strerror(errno));
+			break;
+		}
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, &client_main, (void *)(intptr_t)fd))
+		{
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(sd);
+	return EX_OSERR;
+}
@@ -0,0 +1,298 @@
+/*
+ * End-to-end load driver for the rcon host: many workers issue commands through
+ * rcon_host_send / rcon_host_recv (or rcon_host_exec with -e) against a server,
+ * usually mock_rcon, and the run reports throughput and latency percentiles.
+ * With -b, commands go in batches like rcon_batch sends them. With -m, the run starts its own mock_rcon.
+ */
+
+#include "../rcon_host.h"
+#include "../rcon.h"
+#include "../config.h"
+#include "../batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct worker {
+	pthread_t thread;
+	int index;
+	uint64_t *samples;
+	int done;
+	int failed;
+};
+
+static const char *command = "list";
+static int commands = 1000;
+static bool use_exec = false;
+static int exec_timeout = 5000;
+static int batch = 0;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-P password] [-t threads] [-n commands per thread] [-c command] [-e] [-T timeout ms] [-b batch size] [-m latency ms]\n"
+			"  -e  Use rcon_host_exec, which reassembles split replies, instead of send / recv.\n"
+			"  -b  Send batches without waiting for each reply. Latency is per batch.\n"
+			"  -m  Start mock_rcon from the directory of this program on the port, answering each command\n"
+			"      after this latency, and run against it instead of host.\n",
+			argv0);
+}
+
+/* Start mock_rcon and wait until it listens. */
+static pid_t start_mock(const char *argv0, const char *port, const char *password, const char *latency)
+{
+	char path[4096];
+	const char *slash = strrchr(argv0, '/');
+	snprintf(path, sizeof(path), "%.*smock_rcon", slash == NULL ? 0 : (int)(slash - argv0 + 1), argv0);
+	int fds[2];
+	if(pipe(fds)) return -1;
+	const pid_t pid = fork();
+	if(pid == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if(pid == 0)
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(path, path, "-p", port, "-P", password, "-l", latency, (char *)NULL);
+		fprintf(stderr, "Cannot run %s.\n", path);
+		_exit(EX_OSERR);
+	}
+	close(fds[1]);
+	/* It prints a line once it listens, and nothing if it cannot. */
+	char line[128];
+	const ssize_t len = read(fds[0], line, sizeof(line));
+	close(fds[0]);
+	if(len <= 0)
+	{
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+static void *batch_main(void *arg)
+{
+	struct worker *w = arg;
+	const char **cmds = malloc(sizeof(char *) * batch);
+	if(cmds == NULL)
+	{
+		w->failed = commands;
+		return NULL;
+	}
+	for(int i = 0; i < batch; i ++)
+		cmds[i] = command;
+	for(int i = 0; i < commands; i += batch)
+	{
+		const int count = commands - i < batch ? commands - i : batch;
+		const uint64_t start = now_ns();
+		struct timespec deadline;
+		rcon_host_deadline(&deadline, exec_timeout);
+		if(batch_exec(cmds, count, &deadline))
+		{
+			w->failed += count;
+			continue;
+		}
+		w->samples[w->done ++] = now_ns() - start;
+	}
+	free(cmds);
+	rcon_host_release();
+	return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	char out[RCON_DATA_BUFFSIZE];
+	for(int i = 0; i < commands; i ++)
+	{
+		int r = 0;
+		const uint64_t start = now_ns();
+		if(use_exec)
+		{
+			size_t len = 0;
+			struct timespec deadline;
+			rcon_host_deadline(&deadline, exec_timeout);
+			r = rcon_host_exec(command, &deadline, out, sizeof(out), &len);
+		}
+		else
+		{
+			const int id = (w->index << 16) | (i & 0xffff);
+			int recv_id = 0;
+			r = rcon_host_send(id, command);
+			if(!r) r = rcon_host_recv(&recv_id, out);
+			if(!r && recv_id != id) r = EX_PROTOCOL;
+		}
+		if(r)
+		{
+			w->failed ++;
+			continue;
+		}
+		w->samples[w->done ++] = now_ns() - start;
+	}
+	rcon_host_release();
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, int n, double p)
+{
+	if(n == 0) return 0;
+	int i = (int)(p * n);
+	if(i >= n) i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int r = 0;
+	const char *host = "127.0.0.1";
+	const char *port = "25575";
+	const char *password = "password";
+	const char *mock_latency = NULL;
+	pid_t mock = -1;
+	int threads = 8;
+	int opt;
+	while((opt = getopt(argc, argv, "h:p:P:t:n:c:eT:b:m:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'h': host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'P': password = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'n': commands = atoi(optarg); break;
+			case 'c': command = optarg; break;
+			case 'e': use_exec = true; break;
+			case 'T': exec_timeout = atoi(optarg); break;
+			case 'b': batch = atoi(optarg); break;
+			case 'm': mock_latency = optarg; break;
+			default:
+				usage(argv[0]);
+				return EX_USAGE;
+		}
+	}
+	if(threads <= 0 || commands <= 0 || exec_timeout <= 0 || batch < 0)
+	{
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if(mock_latency != NULL)
+	{
+		host = "127.0.0.1";
+		mock = start_mock(argv[0], port, password, mock_latency);
+		if(mock == -1)
+		{
+			fprintf(stderr, "Cannot start mock_rcon on %s.\n", port);
+			return EX_OSERR;
+		}
+	}
+
+	r = config_init();
+	if(r) goto mock_cleanup;
+	struct config *cfg = config_dup();
+	if(cfg == NULL)
+	{
+		r = EX_OSERR;
+		goto config_cleanup;
+	}
+	cfg->rcon_pool_size = threads;
+	r = config_set_rcon(cfg, host, port, password);
+	if(r)
+	{
+		config_release(cfg);
+		goto config_cleanup;
+	}
+	config_publish(cfg);
+	r = rcon_host_init(threads);
+	if(r) goto config_cleanup;
+
+	struct worker *workers = calloc(threads, sizeof(struct worker));
+	uint64_t *samples = malloc(sizeof(uint64_t) * threads * commands);
+	if(workers == NULL || samples == NULL)
+	{
+		r = EX_OSERR;
+		goto cleanup;
+	}
+	const uint64_t start = now_ns();
+	int started = 0;
+	for(; started < threads; started ++)
+	{
+		workers[started].index = started;
+		workers[started].samples = &samples[(size_t)started * commands];
+		if(pthread_create(&workers[started].thread, NULL, batch > 0 ? &batch_main : &worker_main, &workers[started]))
+		{
+			fprintf(stderr, "Cannot start worker %d.\n", started);
+			r = EX_OSERR;
+			break;
+		}
+	}
+	int done = 0, failed = 0, ok = 0;
+	for(int i = 0; i < started; i ++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		ok += batch > 0 ? commands - workers[i].failed : workers[i].done;
+		/* Compact the samples so they can be sorted at once. */
+		memmove(&samples[done], workers[i].samples, sizeof(uint64_t) * workers[i].done);
+		done += workers[i].done;
+		failed += workers[i].failed;
+	}
+	const double elapsed = (now_ns() - start) / 1e9;
+	qsort(samples, done, sizeof(uint64_t), &cmp_u64);
+	if(batch > 0)
+		printf("Mode:\tbatches of %d\n", batch);
+	else
+		printf("Mode:\t%s\n", use_exec ? "exec" : "send/recv");
+	if(mock != -1)
+		printf("Server:\tmock_rcon, %s ms per command\n", mock_latency);
+	printf("Threads:\t%d\n", started);
+	printf("Commands:\t%d ok, %d failed\n", ok, failed);
+	printf("Elapsed:\t%.3f s\n", elapsed);
+	printf("Throughput:\t%.0f cmd/s\n", elapsed > 0 ? ok / elapsed : 0);
+	printf("Latency (us%s):\tp50 %.1f\tp99 %.1f\tp999 %.1f\tmax %.1f\n",
+			batch > 0 ? ", per batch" : "",
+			percentile_us(samples, done, 0.5),
+			percentile_us(samples, done, 0.99),
+			percentile_us(samples, done, 0.999),
+			done == 0 ? 0 : samples[done - 1] / 1000.0);
+	if(!r && failed) r = EX_UNAVAILABLE;
+cleanup:
+	free(samples);
+	free(workers);
+	rcon_host_free();
+config_cleanup:
+	config_free();
+mock_cleanup:
+	if(mock != -1)
+	{
+		kill(mock, SIGTERM);
+		waitpid(mock, NULL, 0);
+	}
+	return r;
+}
@@ -0,0 +1,148 @@
+#include "config.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct config *current = NULL;
+static uint64_t generation = 0;
+
+static void config_destroy(struct config *cfg)
+{
+	DEBUGF("config.c#config_destroy: Reclaiming generation %" PRIu64 ".\n", cfg->generation);
+	free(cfg->rcon_host);
+	free(cfg->rcon_port);
+	free(cfg->rcon_password);
+	free(cfg);
+}
+
+int config_init()
+{
+	struct config *cfg = calloc(1, sizeof(struct config));
+	if(cfg == NULL)
+	{
+		const int r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		return r;
+	}
+	cfg->rcon_connect_timeout = 3000;
+	cfg->thpool_threads = 1;
+	cfg->rcon_pool_size = 2;
+	cfg->session_sync_interval = 60000;
+	config_publish(cfg);
+	return 0;
+}
+
+void config_free()
+{
+	pthread_mutex_lock(&config_mutex);
+	struct config *cfg = current;
+	current = NULL;
+	pthread_mutex_unlock(&config_mutex);
+	if(cfg != NULL) config_release(cfg);
+}
+
+static int config_strdup(char **out, const char *str)
+{
+	free(*out);
+	*out = NULL;
+	if(str == NULL) return 0;
+	*out = strdup(str);
+	if(*out == NULL) return errno;
+	return 0;
+}
+
+int config_set_rcon(struct config *cfg, const char *host, const char *port, const char *password)
+{
+	int r = 0;
+	if(host == NULL)
+	{
+		port = NULL;
+		password = NULL;
+	}
+	r = config_strdup(&cfg->rcon_host, host);
+	if(!r) r = config_strdup(&cfg->rcon_port, port);
+	if(!r) r = config_strdup(&cfg->rcon_password, password);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		config_strdup(&cfg->rcon_host, NULL);
+		config_strdup(&cfg->rcon_port, NULL);
+		config_strdup(&cfg->rcon_password, NULL);
+	}
+	return r;
+}
+
+struct config *config_dup()
+{
+	struct config *base = config_acquire();
+	struct config *cfg = malloc(sizeof(struct config));
+	if(cfg == NULL)
+	{
+		config_release(base);
+		return NULL;
+	}
+	memcpy(cfg, base, sizeof(struct config));
+	cfg->rcon_host = NULL;
+	cfg->rcon_port = NULL;
+	cfg->rcon_password = NULL;
+	/* The caller's reference, so an unpublished copy can be dropped with config_release(). */
+	cfg->refs = 1;
+	const int r = config_set_rcon(cfg, base->rcon_host, base->rcon_port, base->rcon_password);
+	config_release(base);
+	if(r)
+	{
+		free(cfg);
+		return NULL;
+	}
+	return cfg;
+}
+
+static bool str_equals(const char *a, const char *b)
+{
+	if(a == NULL || b == NULL) return a == b;
+	return !strcmp(a, b);
+}
+
+void config_publish(struct config *cfg)
+{
+	pthread_mutex_lock(&config_mutex);
+	struct config *old = current;
+	cfg->generation = ++ generation;
+	if(old == NULL ||
+			!str_equals(old->rcon_host, cfg->rcon_host) ||
+			!str_equals(old->rcon_port, cfg->rcon_port) ||
+			!str_equals(old->rcon_password, cfg->rcon_password))
+		cfg->rcon_generation = cfg->generation;
+	else
+		cfg->rcon_generation = old->rcon_generation;
+	/* The published pointer holds one reference. */
+	cfg->refs = 1;
+	current = cfg;
+	DEBUGF("config.c#config_publish: Generation %" PRIu64 " (rcon %" PRIu64 ").\n", cfg->generation, cfg->rcon_generation);
+	pthread_mutex_unlock(&config_mutex);
+	if(old != NULL) config_release(old);
+}
+
+struct config *config_acquire()
+{
+	pthread_mutex_lock(&config_mutex);
+	struct config *cfg = current;
+	cfg->refs ++;
+	pthread_mutex_unlock(&config_mutex);
+	return cfg;
+}
+
+void config_release(struct config *cfg)
+{
+	pthread_mutex_lock(&config_mutex);
+	const int refs = -- cfg->refs;
+	pthread_mutex_unlock(&config_mutex);
+	if(refs == 0) config_destroy(cfg);
+}
@@ -0,0 +1,48 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include "rcon_sched.h"
+
+#include <stdint.h>
+
+/*
+ * Runtime configuration. A published config is immutable: to change a setting,
+ * copy the current one with config_dup(), modify the copy and config_publish() it.
+ * Readers hold a reference with config_acquire() / config_release(), so a
+ * snapshot is only freed after its last reader left.
+ */
+struct config {
+	/* Bumped on every publish. */
+	uint64_t generation;
+	/* Generation at which the rcon target last changed. Connections compare this. */
+	uint64_t rcon_generation;
+	/* NULL when rcon is disabled. */
+	char *rcon_host;
+	char *rcon_port;
+	char *rcon_password;
+	/* Milliseconds. */
+	int rcon_connect_timeout;
+	/* Read at startup only. */
+	int thpool_threads;
+	int rcon_pool_size;
+	struct rcon_sched_limits limits;
+	/* Milliseconds between 'list' reconciliations of the session tracker. 0 disables them. */
+	int session_sync_interval;
+	int refs;
+};
+
+int config_init();
+void config_free();
+
+/* Copy the current configuration for modification. Drop it with config_release() if not published. */
+struct config *config_dup();
+/* Takes ownership of cfg. */
+void config_publish(struct config *cfg);
+
+struct config *config_acquire();
+void config_release(struct config *cfg);
+
+/* Set the rcon target of an unpublished config. A NULL host disables rcon. */
+int config_set_rcon(struct config *cfg, const char *host, const char *port, const char *password);
+
+#endif // _CONFIG_H
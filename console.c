@@ -0,0 +1,235 @@
+#include "console.h"
+#include "plugin/plugin.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+static pthread_mutex_t console_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pid_t server_pid = -1;
+/* Standard input of the server. */
+static int console_fd = -1;
+static int output_fd = STDIN_FILENO;
+
+static uint64_t total_commands = 0;
+static uint64_t total_bytes = 0;
+static uint64_t total_failed = 0;
+
+static int64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Runs in the forked child: only async-signal-safe calls. */
+static void child_exec(char *const *argv, int in, int out)
+{
+	/* The daemon blocks SIGINT and SIGTERM, which would be inherited. */
+	sigset_t set;
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+	if(dup2(in, STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1) _exit(127);
+	/* Do not leak the control socket or rcon connections. */
+	long max = sysconf(_SC_OPEN_MAX);
+	if(max < 0 || max > 65536) max = 65536;
+	for(int fd = 3; fd < max; fd ++) close(fd);
+	execvp(argv[0], argv);
+	static const char msg[] = "extmc: Cannot run the server.\n";
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	_exit(127);
+}
+
+int console_spawn(char *const *argv)
+{
+	int r = 0;
+	int in[2] = { -1, -1 };
+	int out[2] = { -1, -1 };
+	if(pipe(in) || pipe(out))
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot create pipe: %d.\n"), r);
+		goto cleanup;
+	}
+	const pid_t pid = fork();
+	if(pid == -1)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot fork: %d.\n"), r);
+		goto cleanup;
+	}
+	if(pid == 0) child_exec(argv, in[0], out[1]);
+	close(in[0]);
+	close(out[1]);
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_lock(&console_mutex);
+	server_pid = pid;
+	console_fd = in[1];
+	output_fd = out[0];
+	pthread_mutex_unlock(&console_mutex);
+	printf(_("Started %s as process %d.\n"), argv[0], (int)pid);
+	return 0;
+cleanup:
+	for(int i = 0; i < 2; i ++)
+	{
+		if(in[i] != -1) close(in[i]);
+		if(out[i] != -1) close(out[i]);
+	}
+	return r;
+}
+
+/* Wait for the server until deadline, reading its output so it cannot block on a full pipe. */
+static bool drain_until_exit(int *status, int64_t deadline)
+{
+	char buf[4096];
+	bool eof = false;
+	while(true)
+	{
+		if(waitpid(server_pid, status, WNOHANG) == server_pid) return true;
+		const int64_t left = deadline - now_ms();
+		if(left <= 0) return false;
+		if(eof)
+		{
+			const struct timespec poll_interval = { 0, 100 * 1000000L };
+			nanosleep(&poll_interval, NULL);
+			continue;
+		}
+		struct pollfd pfd = { output_fd, POLLIN, 0 };
+		if(poll(&pfd, 1, left < 100 ? (int)left : 100) <= 0) continue;
+		/* Not parsed any more: extmc is exiting. */
+		if(read(output_fd, buf, sizeof(buf)) <= 0) eof = true;
+	}
+}
+
+int console_free()
+{
+	if(server_pid == -1) return 0;
+	pthread_mutex_lock(&console_mutex);
+	if(console_fd != -1)
+	{
+		static const char stop[] = "stop\n";
+		/* Fails if the server is already gone. */
+		write(console_fd, stop, sizeof(stop) - 1);
+		close(console_fd);
+		console_fd = -1;
+	}
+	pthread_mutex_unlock(&console_mutex);
+	int status = 0;
+	if(!drain_until_exit(&status, now_ms() + CONSOLE_STOP_TIMEOUT))
+	{
+		fprintf(stderr, _("The server did not stop in time. Terminating it.\n"));
+		kill(server_pid, SIGTERM);
+		if(!drain_until_exit(&status, now_ms() + 10000))
+		{
+			kill(server_pid, SIGKILL);
+			waitpid(server_pid, &status, 0);
+		}
+	}
+	server_pid = -1;
+	close(output_fd);
+	output_fd = STDIN_FILENO;
+	if(WIFEXITED(status))
+	{
+		printf(_("The server exited with %d.\n"), WEXITSTATUS(status));
+		return WEXITSTATUS(status);
+	}
+	printf(_("The server was killed by signal %d.\n"), WTERMSIG(status));
+	return 128 + WTERMSIG(status);
+}
+
+int console_output_fd()
+{
+	return output_fd;
+}
+
+bool console_available()
+{
+	pthread_mutex_lock(&console_mutex);
+	const bool available = console_fd != -1;
+	pthread_mutex_unlock(&console_mutex);
+	return available;
+}
+
+int console_send(const char *command)
+{
+	int r = 0;
+	if(strchr(command, '\n') != NULL) return 64;
+	const size_t len = strlen(command);
+	struct iovec iov[2] = {
+		{ (void *)command, len },
+		{ "\n", 1 }
+	};
+	pthread_mutex_lock(&console_mutex);
+	if(console_fd == -1)
+	{
+		r = EPG_RCON_DISABLED;
+		goto cleanup;
+	}
+	size_t left = len + 1;
+	int iov_start = 0;
+	while(left > 0)
+	{
+		const ssize_t num_written = writev(console_fd, &iov[iov_start], 2 - iov_start);
+		if(num_written == -1)
+		{
+			if(errno == EINTR) continue;
+			r = errno == EPIPE ? EX_UNAVAILABLE : errno;
+			total_failed ++;
+			goto cleanup;
+		}
+		left -= num_written;
+		/* Partial write: skip what was written. */
+		size_t done = num_written;
+		while(iov_start < 2 && done >= iov[iov_start].iov_len)
+		{
+			done -= iov[iov_start].iov_len;
+			iov_start ++;
+		}
+		if(iov_start < 2)
+		{
+			iov[iov_start].iov_base = (char *)iov[iov_start].iov_base + done;
+			iov[iov_start].iov_len -= done;
+		}
+	}
+	total_commands ++;
+	total_bytes += len + 1;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&console_mutex);
+	return r;
+}
+
+void console_dump(int out)
+{
+	pthread_mutex_lock(&console_mutex);
+	const pid_t pid = server_pid;
+	const bool available = console_fd != -1;
+	const uint64_t commands = total_commands, bytes = total_bytes, failed = total_failed;
+	pthread_mutex_unlock(&console_mutex);
+	if(pid == -1)
+	{
+		dprintf(out, _("No console: the server was not started by extmc.\n"));
+		return;
+	}
+	dprintf(out, _("Server process:\t%d\nConsole:\t%s\nCommands:\t%" PRIu64 "\nBytes:\t%" PRIu64 "\nFailed:\t%" PRIu64 "\n"),
+			(int)pid,
+			available ? _("open") : _("closed"),
+			commands,
+			bytes,
+			failed);
+}
@@ -0,0 +1,31 @@
+#ifndef _CONSOLE_H
+#define _CONSOLE_H
+
+#include <stdbool.h>
+
+/* How long the server gets to stop before it is terminated. */
+#define CONSOLE_STOP_TIMEOUT	60000
+
+/*
+ * Supervisor mode: extmc starts the server itself, reads its output from a pipe
+ * and writes commands straight to its standard input. Without a server started
+ * this way, the output is read from extmc's standard input and there is no console.
+ */
+
+/* Start the server with argv (NULL terminated, looked up in PATH). */
+int console_spawn(char *const *argv);
+/* Stop the server with 'stop', waiting up to CONSOLE_STOP_TIMEOUT, and reap it.
+ * Returns the exit status of the server, or 0 if none was started. */
+int console_free();
+
+/* Where to read the server output from. */
+int console_output_fd();
+bool console_available();
+
+/* Write a command to the server console. Unlike rcon there is no reply and no length limit.
+ * Returns EPG_RCON_DISABLED without a console, 64 if the command contains a newline. */
+int console_send(const char *command);
+
+void console_dump(int out);
+
+#endif // _CONSOLE_H
@@ -0,0 +1,42 @@
+#include "hist.h"
+
+#include <string.h>
+
+void hist_reset(struct hist *hist)
+{
+	memset(hist, 0, sizeof(struct hist));
+}
+
+void hist_add(struct hist *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i = 0;
+	while(us > 1 && i < HIST_BUCKETS - 1)
+	{
+		us >>= 1;
+		i ++;
+	}
+	hist->buckets[i] ++;
+	hist->count ++;
+	hist->sum_ns += ns;
+	if(ns > hist->max_ns) hist->max_ns = ns;
+}
+
+uint64_t hist_percentile_us(const struct hist *hist, double p)
+{
+	if(hist->count == 0) return 0;
+	uint64_t rank = (uint64_t)(p * hist->count);
+	if(rank == 0) rank = 1;
+	const uint64_t max_us = hist->max_ns / 1000;
+	uint64_t seen = 0;
+	for(int i = 0; i < HIST_BUCKETS - 1; i ++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= rank)
+		{
+			const uint64_t bound = 1ULL << (i + 1);
+			return bound < max_us ? bound : max_us;
+		}
+	}
+	return max_us;
+}
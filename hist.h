@@ -0,0 +1,22 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/* Bucket i counts samples below 2^(i+1) microseconds, the last one everything above. */
+#define HIST_BUCKETS	32
+
+/* Log2 latency histogram. Not synchronized; the owner provides locking. */
+struct hist {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+
+void hist_reset(struct hist *hist);
+void hist_add(struct hist *hist, uint64_t ns);
+/* Upper bound of the bucket holding the p-quantile (0 < p <= 1), capped at the maximum, in microseconds. */
+uint64_t hist_percentile_us(const struct hist *hist, double p);
+
+#endif // _HIST_H
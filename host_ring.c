@@ -0,0 +1,265 @@
+#ifdef __linux__
+/* memfd_create(2) and syscall(2) for futex(2). */
+#define _GNU_SOURCE
+#endif
+
+#include "host_ring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define HOST_RECORD_PAD		0xffff
+/* Times the consumer yields before it sleeps on an empty ring. */
+#define HOST_RING_SPINS		64
+
+#define MAIL_IDLE	0
+#define MAIL_REQUEST	1
+#define MAIL_REPLY	2
+
+struct host_shm {
+	/* Written by the core only. */
+	uint64_t head;
+	char head_pad[56];
+	/* Written by the host only. */
+	uint64_t tail;
+	char tail_pad[56];
+	/* Bumped on every push and on stop. The futex the host sleeps on, when waiting is set. */
+	uint32_t seq;
+	uint32_t waiting;
+	uint32_t stop;
+	/* MAIL_*, the futex both sides of the mailbox sleep on. */
+	uint32_t mail_state;
+	uint32_t mail_kind;
+	int32_t mail_status;
+	uint32_t mail_len;
+	char mail[HOST_MAIL_SIZE];
+	char ring[HOST_RING_SIZE];
+};
+
+/* Padded to 8 bytes, followed by the arguments present as NULL terminated strings. */
+struct host_record_header {
+	uint32_t len;
+	uint16_t kind;
+	/* Bit i is set if argument i is present. */
+	uint16_t args;
+};
+
+static void futex_wait(uint32_t *addr, uint32_t val, int timeout_ms)
+{
+	const struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int host_shm_create(int *fd, struct host_shm **shm)
+{
+	*fd = memfd_create("extmc-host", MFD_CLOEXEC);
+	if(*fd == -1) return errno;
+	if(ftruncate(*fd, sizeof(struct host_shm)) == -1)
+	{
+		const int r = errno;
+		close(*fd);
+		*fd = -1;
+		return r;
+	}
+	const int r = host_shm_map(*fd, shm);
+	if(r)
+	{
+		close(*fd);
+		*fd = -1;
+	}
+	return r;
+}
+
+int host_shm_map(int fd, struct host_shm **shm)
+{
+	void *addr = mmap(NULL, sizeof(struct host_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) return errno;
+	*shm = addr;
+	return 0;
+}
+
+void host_shm_unmap(struct host_shm *shm)
+{
+	munmap(shm, sizeof(struct host_shm));
+}
+
+int host_ring_push(struct host_shm *shm, uint32_t kind, const char *const *args)
+{
+	size_t lens[HOST_RECORD_ARGS];
+	size_t need = sizeof(struct host_record_header);
+	uint16_t present = 0;
+	for(int i = 0; i < HOST_RECORD_ARGS; i ++)
+	{
+		if(args[i] == NULL) continue;
+		lens[i] = strlen(args[i]) + 1;
+		need += lens[i];
+		present |= 1u << i;
+	}
+	need = (need + 7) & ~(size_t)7;
+	if(need > HOST_RECORD_MAX) return EMSGSIZE;
+	uint64_t head = shm->head;
+	const uint64_t tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+	size_t offset = head & (HOST_RING_SIZE - 1);
+	/* Records do not wrap: the end of the ring is skipped when the record does not fit there. */
+	const size_t pad = HOST_RING_SIZE - offset < need ? HOST_RING_SIZE - offset : 0;
+	if(head + pad + need - tail > HOST_RING_SIZE) return ENOSPC;
+	if(pad)
+	{
+		struct host_record_header *header = (struct host_record_header *)&shm->ring[offset];
+		header->len = pad;
+		header->kind = HOST_RECORD_PAD;
+		head += pad;
+		offset = 0;
+	}
+	struct host_record_header *header = (struct host_record_header *)&shm->ring[offset];
+	header->len = need;
+	header->kind = kind;
+	header->args = present;
+	char *pos = (char *)&header[1];
+	for(int i = 0; i < HOST_RECORD_ARGS; i ++)
+	{
+		if(args[i] == NULL) continue;
+		memcpy(pos, args[i], lens[i]);
+		pos += lens[i];
+	}
+	__atomic_store_n(&shm->head, head + need, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shm->seq, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&shm->waiting, __ATOMIC_SEQ_CST)) futex_wake(&shm->seq);
+	return 0;
+}
+
+int host_ring_pop(struct host_shm *shm, struct host_record *out, int timeout_ms)
+{
+	uint64_t tail = shm->tail;
+	bool waited = false;
+	int spins = 0;
+	while(true)
+	{
+		/* Stop is set after the last push: seen first, the head is final. */
+		const uint32_t stop = __atomic_load_n(&shm->stop, __ATOMIC_ACQUIRE);
+		const uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+		if(head != tail)
+		{
+			const struct host_record_header *header = (const struct host_record_header *)&shm->ring[tail & (HOST_RING_SIZE - 1)];
+			const uint32_t len = header->len;
+			if(header->kind == HOST_RECORD_PAD)
+			{
+				tail += len;
+				__atomic_store_n(&shm->tail, tail, __ATOMIC_RELEASE);
+				continue;
+			}
+			out->kind = header->kind;
+			const uint16_t present = header->args;
+			memcpy(out->data, &header[1], len - sizeof(struct host_record_header));
+			__atomic_store_n(&shm->tail, tail + len, __ATOMIC_RELEASE);
+			char *pos = out->data;
+			for(int i = 0; i < HOST_RECORD_ARGS; i ++)
+			{
+				if(!(present & (1u << i)))
+				{
+					out->args[i] = NULL;
+					continue;
+				}
+				out->args[i] = pos;
+				pos += strlen(pos) + 1;
+			}
+			return 0;
+		}
+		if(stop) return ESHUTDOWN;
+		if(waited) return ETIMEDOUT;
+		/* A burst of events usually has more coming: sleeping between them costs both sides a syscall. */
+		if(spins < HOST_RING_SPINS)
+		{
+			++ spins;
+			sched_yield();
+			continue;
+		}
+		/* Check again once the producer is bound to see waiting, then sleep unless seq moved. */
+		__atomic_store_n(&shm->waiting, 1, __ATOMIC_SEQ_CST);
+		const uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&shm->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&shm->stop, __ATOMIC_SEQ_CST))
+		{
+			futex_wait(&shm->seq, seq, timeout_ms);
+			waited = true;
+		}
+		__atomic_store_n(&shm->waiting, 0, __ATOMIC_SEQ_CST);
+	}
+}
+
+void host_ring_stop(struct host_shm *shm)
+{
+	__atomic_store_n(&shm->stop, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&shm->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&shm->seq);
+}
+
+size_t host_ring_used(const struct host_shm *shm)
+{
+	return __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+}
+
+int host_mail_call(struct host_shm *shm, uint32_t kind, const void *data, size_t len, int timeout_ms,
+		bool (*alive)(), int *status, const char **reply, size_t *reply_len)
+{
+	if(len > HOST_MAIL_SIZE) return EMSGSIZE;
+	shm->mail_kind = kind;
+	shm->mail_len = len;
+	memcpy(shm->mail, data, len);
+	__atomic_store_n(&shm->mail_state, MAIL_REQUEST, __ATOMIC_RELEASE);
+	futex_wake(&shm->mail_state);
+	while(__atomic_load_n(&shm->mail_state, __ATOMIC_ACQUIRE) != MAIL_REPLY)
+	{
+		if(!alive()) return ETIMEDOUT;
+		futex_wait(&shm->mail_state, MAIL_REQUEST, timeout_ms);
+	}
+	*status = shm->mail_status;
+	*reply = shm->mail;
+	*reply_len = shm->mail_len;
+	__atomic_store_n(&shm->mail_state, MAIL_IDLE, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int host_mail_wait(struct host_shm *shm, int timeout_ms, uint32_t *kind, char *buf, size_t *len)
+{
+	uint32_t state = __atomic_load_n(&shm->mail_state, __ATOMIC_ACQUIRE);
+	if(state != MAIL_REQUEST)
+	{
+		futex_wait(&shm->mail_state, state, timeout_ms);
+		if(__atomic_load_n(&shm->mail_state, __ATOMIC_ACQUIRE) != MAIL_REQUEST) return ETIMEDOUT;
+	}
+	/* The host may write anything there, at any time: read the length once and copy before parsing. */
+	const uint32_t mail_len = __atomic_load_n(&shm->mail_len, __ATOMIC_RELAXED);
+	if(mail_len > HOST_MAIL_SIZE) return EPROTO;
+	*kind = __atomic_load_n(&shm->mail_kind, __ATOMIC_RELAXED);
+	memcpy(buf, shm->mail, mail_len);
+	buf[mail_len] = '\0';
+	*len = mail_len;
+	return 0;
+}
+
+void host_mail_reply(struct host_shm *shm, int status, const void *data, size_t len)
+{
+	if(len > HOST_MAIL_SIZE - 1) len = HOST_MAIL_SIZE - 1;
+	shm->mail_status = status;
+	shm->mail_len = len;
+	if(len > 0) memmove(shm->mail, data, len);
+	shm->mail[len] = '\0';
+	__atomic_store_n(&shm->mail_state, MAIL_REPLY, __ATOMIC_RELEASE);
+	futex_wake(&shm->mail_state);
+}
+
+void host_mail_reset(struct host_shm *shm)
+{
+	__atomic_store_n(&shm->mail_state, MAIL_IDLE, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+#ifndef _HOST_RING_H
+#define _HOST_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Bytes of events on their way to a plugin host. A power of two. */
+#define HOST_RING_SIZE		(1 << 20)
+/* Largest event. */
+#define HOST_RECORD_MAX		8192
+/* Arguments of an event, as in struct plugin_call_job_args. */
+#define HOST_RECORD_ARGS	5
+/* Largest request of a plugin host, or reply to it. */
+#define HOST_MAIL_SIZE		(64 * 1024)
+
+/*
+ * Memory shared by the core and a plugin host process, from a memfd. A ring with one producer and one
+ * consumer carries events to the host, and a mailbox carries the requests of the host, one at a time,
+ * and their replies. Neither side takes a lock: a side sleeps on a futex only when it has nothing to do.
+ */
+struct host_shm;
+
+/* An event copied off the ring. */
+struct host_record {
+	uint32_t kind;
+	/* NULL if absent, otherwise in data. */
+	char *args[HOST_RECORD_ARGS];
+	char data[HOST_RECORD_MAX];
+};
+
+int host_shm_create(int *fd, struct host_shm **shm);
+int host_shm_map(int fd, struct host_shm **shm);
+void host_shm_unmap(struct host_shm *shm);
+
+/* Producer. ENOSPC if the ring is full, EMSGSIZE if the event is larger than HOST_RECORD_MAX. */
+int host_ring_push(struct host_shm *shm, uint32_t kind, const char *const *args);
+/* Consumer. 0 with the next event in out, ETIMEDOUT after timeout_ms, or ESHUTDOWN once stopped and
+ * empty. The event leaves the ring before it is handled. */
+int host_ring_pop(struct host_shm *shm, struct host_record *out, int timeout_ms);
+/* The consumer gets what is in the ring, then ESHUTDOWN. */
+void host_ring_stop(struct host_shm *shm);
+size_t host_ring_used(const struct host_shm *shm);
+
+/* Host side. Send a request and wait for its reply, which stays in *reply until the next request.
+ * Waits in steps of timeout_ms and gives up with ETIMEDOUT when alive() returns false. */
+int host_mail_call(struct host_shm *shm, uint32_t kind, const void *data, size_t len, int timeout_ms,
+		bool (*alive)(), int *status, const char **reply, size_t *reply_len);
+/* Core side. Wait at most timeout_ms for a request and copy it to buf, of HOST_MAIL_SIZE + 1 bytes, NULL
+ * terminated. 0, ETIMEDOUT, or EPROTO if the host wrote a length out of bounds: nothing was copied. */
+int host_mail_wait(struct host_shm *shm, int timeout_ms, uint32_t *kind, char *buf, size_t *len);
+/* Replies longer than HOST_MAIL_SIZE - 1 bytes are truncated. The reply is NULL terminated. */
+void host_mail_reply(struct host_shm *shm, int status, const void *data, size_t len);
+/* Drop a request left by a host that exited. */
+void host_mail_reset(struct host_shm *shm);
+
+#endif // _HOST_RING_H
@@ -0,0 +1,80 @@
+#include "linebuf.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+int linebuf_init(struct linebuf *lb, int fd, size_t cap)
+{
+	lb->fd = fd;
+	/* One more byte to terminate a full buffer. */
+	lb->buf = malloc(cap + 1);
+	if(lb->buf == NULL) return errno;
+	lb->cap = cap;
+	lb->start = 0;
+	lb->end = 0;
+	lb->pt = NULL;
+	return 0;
+}
+
+void linebuf_free(struct linebuf *lb)
+{
+	free(lb->buf);
+	lb->buf = NULL;
+}
+
+int linebuf_next(struct linebuf *lb, char **line, size_t *len)
+{
+	while(true)
+	{
+		char *begin = &lb->buf[lb->start];
+		const size_t avail = lb->end - lb->start;
+		char *newline = memchr(begin, '\n', avail);
+		if(newline != NULL)
+		{
+			/* Terminated in place. */
+			*newline = '\0';
+			*line = begin;
+			*len = (size_t)(newline - begin);
+			lb->start += *len + 1;
+			return 0;
+		}
+		/* A full buffer without a newline is returned as is. */
+		if(lb->start == 0 && avail == lb->cap)
+		{
+			lb->buf[lb->cap] = '\0';
+			*line = lb->buf;
+			*len = avail;
+			lb->start = lb->end = 0;
+			return 0;
+		}
+		/* Keep the partial line and refill after it. */
+		if(lb->start > 0)
+		{
+			memmove(lb->buf, begin, avail);
+			lb->start = 0;
+			lb->end = avail;
+		}
+		const ssize_t num_read = lb->pt != NULL ?
+			passthrough_read(lb->pt, lb->fd, &lb->buf[lb->end], lb->cap - lb->end) :
+			read(lb->fd, &lb->buf[lb->end], lb->cap - lb->end);
+		if(num_read == -1)
+		{
+			if(errno == EINTR) continue;
+			return errno;
+		}
+		if(num_read == 0)
+		{
+			if(avail == 0) return -1;
+			/* Last line without a newline. */
+			lb->buf[avail] = '\0';
+			*line = lb->buf;
+			*len = avail;
+			lb->start = lb->end = 0;
+			return 0;
+		}
+		lb->end += num_read;
+	}
+}
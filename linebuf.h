@@ -0,0 +1,34 @@
+#ifndef _LINEBUF_H
+#define _LINEBUF_H
+
+#include "passthrough.h"
+
+#include <stddef.h>
+
+/* Bytes read from the server output at once. */
+#define LINEBUF_SIZE	65536
+
+/*
+ * Splits what is read from a file descriptor into lines, reading large chunks
+ * instead of a line at a time. Not synchronized.
+ */
+struct linebuf {
+	int fd;
+	char *buf;
+	size_t cap;
+	/* Unconsumed bytes are buf[start, end). */
+	size_t start;
+	size_t end;
+	/* Optional. Sees every chunk before it is split. */
+	struct passthrough *pt;
+};
+
+int linebuf_init(struct linebuf *lb, int fd, size_t cap);
+void linebuf_free(struct linebuf *lb);
+
+/* Return the next line without its newline, which is replaced by NULL in place, so the line is
+ * not copied. It stays valid until the next call. Lines longer than the buffer are returned in
+ * pieces. Returns -1 at the end of input, or errno. */
+int linebuf_next(struct linebuf *lb, char **line, size_t *len);
+
+#endif // _LINEBUF_H
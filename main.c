@@ -4,7 +4,20 @@
 #include "mcin.h"
 #include "common.h"
 #include "rcon_host.h"
+#include "rcon_sched.h"
+#include "config.h"
+#include "session.h"
+#include "rcon_queue.h"
+#include "scoreboard.h"
+#include "batch.h"
+#include "console.h"
+#include "linebuf.h"
+#include "passthrough.h"
 #include "threads_util.h"
+#include "timer.h"
+#include "rcon_async.h"
+#include "plugin_profile.h"
+#include "plugin_host.h"
 
 #include <limits.h>
 #include <stdlib.h>
@@ -15,10 +28,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <semaphore.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <time.h>
 #include <inttypes.h>
 #include <limits.h>
 
@@ -26,11 +42,22 @@
 #define CONTROL_SOCKET_PATH "/run/extmc.ctl"
 #endif
 
+/* Largest control request, including an rcon script. */
+#define CTL_REQUEST_MAX		(4 * 1024 * 1024)
+/* A client has this long to send its whole request: one that never shuts down its side would hold the
+ * control socket for everyone. */
+#define CTL_REQUEST_TIMEOUT	5000
+/* Per command of 'extmcctl rcon'. */
+#define CTL_RCON_TIMEOUT	10000
+
 static pthread_mutex_t process_mutex = PTHREAD_MUTEX_INITIALIZER;
 static threadpool thpool = NULL;
 static bool received_sigterm = false;
 static sem_t exit_sem;
 static int ctl_fd = -1;
+static struct linebuf input;
+static struct passthrough passthrough;
+static bool passthrough_setup = false;
 
 static void exclusive_section_enter()
 {
@@ -42,6 +69,91 @@ static void exclusive_section_leave()
 	pthread_mutex_unlock(&process_mutex);
 }
 
+static int parse_rate(const char *str, double *out)
+{
+	char *endptr;
+	errno = 0;
+	const double num = strtod(str, &endptr);
+	if(strcmp(endptr, "") || errno == ERANGE || num < 0)
+		return 64;
+	*out = num;
+	return 0;
+}
+
+static int parse_timeout(const char *str, int *out)
+{
+	char *endptr;
+	errno = 0;
+	const uintmax_t num = strtoumax(str, &endptr, 10);
+	if(strcmp(endptr, "") || (num == UINTMAX_MAX && errno == ERANGE) || num > INT_MAX || num <= 0)
+		return 64;
+	*out = (int)num;
+	return 0;
+}
+
+static int parse_env_int(const char *name, int *out)
+{
+	const char *value = getenv(name);
+	if(value == NULL) return 0;
+	if(parse_timeout(value, out))
+	{
+		fprintf(stderr, _("Invalid %s value.\n"), name);
+		return 64;
+	}
+	return 0;
+}
+
+static int load_env_config(struct config *cfg)
+{
+	int r = 0;
+	r = parse_env_int("THPOOL_THREADS", &cfg->thpool_threads);
+	if(r) return r;
+	// One connection per worker. The other threads making calls own theirs (rcon_host_own).
+	cfg->rcon_pool_size = cfg->thpool_threads;
+	r = parse_env_int("RCON_POOL_SIZE", &cfg->rcon_pool_size);
+	if(r) return r;
+	r = parse_env_int("RCON_CONNECT_TIMEOUT", &cfg->rcon_connect_timeout);
+	if(r) return r;
+	// 0 turns reconciliation off.
+	const char *env_sync = getenv("SESSION_SYNC_INTERVAL");
+	if(env_sync != NULL && !strcmp(env_sync, "0"))
+		cfg->session_sync_interval = 0;
+	else
+		r = parse_env_int("SESSION_SYNC_INTERVAL", &cfg->session_sync_interval);
+	if(r) return r;
+
+	const char *limit_env_names[4] = { "RCON_RATE", "RCON_BURST", "RCON_PLUGIN_RATE", "RCON_PLUGIN_BURST" };
+	double *limit_env_values[4] = { &cfg->limits.rate, &cfg->limits.burst, &cfg->limits.plugin_rate, &cfg->limits.plugin_burst };
+	for(int i = 0; i < 4; i ++)
+	{
+		const char *value = getenv(limit_env_names[i]);
+		if(value == NULL) continue;
+		if(parse_rate(value, limit_env_values[i]))
+		{
+			fprintf(stderr, _("Invalid %s value.\n"), limit_env_names[i]);
+			return 64;
+		}
+	}
+
+	const char *env_host = getenv("RCON_HOST");
+	const char *env_port = getenv("RCON_PORT");
+	const char *env_password = getenv("RCON_PASSWORD");
+	if(env_host == NULL && env_port == NULL && env_password == NULL)
+		return 0;
+	if(env_host == NULL || env_port == NULL || env_password == NULL)
+	{
+		fprintf(stderr, _("Cannot load rcon settings: RCON_HOST, RCON_PORT and RCON_PASSWORD must all present.\n"));
+		return 64;
+	}
+	r = config_set_rcon(cfg, env_host, env_port, env_password);
+	if(r) return r;
+	DEBUGF("main.c#load_env_config: Loaded rcon arguments from environment variables:\nHost:\t%s\nPort:\t%s\nPassword:\t%s\n",
+			cfg->rcon_host,
+			cfg->rcon_port,
+			cfg->rcon_password);
+	return 0;
+}
+
 static int autoload(const char *config_path)
 {
 	FILE *file = fopen(config_path, "r");
@@ -93,10 +205,13 @@ static int autoload(const char *config_path)
 		if(current_path == NULL) break;
 		// Remove \n
 		current_path[strlen(current_path) - 1] = '\0';
-		if(strlen(current_path) > 0)
+		// -i <path> loads the plugin isolated.
+		const bool isolated = !strncmp(current_path, "-i ", 3);
+		const char *path = isolated ? &current_path[3] : current_path;
+		if(strlen(path) > 0)
 		{
-			if(!plugin_registry_load(2, current_path))
-				printf(_("Autoload: loaded %s.\n"), current_path);
+			if(!plugin_registry_load(2, path, isolated))
+				printf(_("Autoload: loaded %s.\n"), path);
 		}
 		free(current_path);
 	}
@@ -140,21 +255,28 @@ static void *main_loop(void *arg)
 {
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	thread_set_name("main-loop");
-	char buffer[501];
 	while(true)
 	{
-		if(fgets(buffer, 500, stdin) == NULL)
+		char *line;
+		size_t len;
+		const int r = linebuf_next(&input, &line, &len);
+		if(r == -1)
 		{
 			printf(_("Received EOF. Exiting.\n"));
 			goto cleanup;
 		}
+		if(r)
+		{
+			fprintf(stderr, _("Cannot read the server output: %d.\n"), r);
+			goto cleanup;
+		}
 		exclusive_section_enter();
 		if(received_sigterm)
 		{
 			exclusive_section_leave();
 			goto cleanup;
 		}
-		mcin_match(buffer, thpool);
+		mcin_match(line, thpool);
 		exclusive_section_leave();
 	}
 	goto cleanup;
@@ -164,7 +286,100 @@ cleanup:
 	return NULL;
 }
 
-static int main_handle_cmd(const int out, int argc, char **argv)
+struct ctl_reply_args {
+	int out;
+	const char **commands;
+};
+
+static void ctl_rcon_reply(size_t index, const char *data, size_t len, void *arg)
+{
+	const struct ctl_reply_args *args = arg;
+	dprintf(args->out, "> %s\n%s%s", args->commands[index], data, len > 0 && data[len - 1] == '\n' ? "" : "\n");
+}
+
+/* Run one command, or each line of the script with -f. Lines starting with '#' are skipped. */
+static int ctl_rcon(const int out, int argc, char **argv, char *input)
+{
+	int r = 0;
+	const char **commands = NULL;
+	char *command = NULL;
+	if(argc == 2 && !strcmp(argv[1], "-f"))
+	{
+		// No script, like an aborted client.
+		if(input == NULL) input = "";
+		size_t count = 0;
+		for(char *c = input; *c; c ++)
+			if(*c == '\n') count ++;
+		commands = calloc(count + 1, sizeof(char *));
+		if(commands == NULL)
+		{
+			r = errno;
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			goto cleanup;
+		}
+		count = 0;
+		char *saveptr = NULL;
+		for(char *line = strtok_r(input, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+		{
+			if(line[0] == '#') continue;
+			commands[count ++] = line;
+		}
+		/* Scripts wait their turn under the rate limit: the timeout starts once they were scheduled. */
+		for(size_t i = 0; i < count && !r; i ++)
+			r = rcon_sched_acquire(NULL, RCON_SCHED_LANE_HIGH, NULL);
+		struct ctl_reply_args args = { out, commands };
+		struct timespec deadline;
+		rcon_host_deadline(&deadline, CTL_RCON_TIMEOUT + (int)count * 10);
+		if(!r) r = rcon_host_exec_batch(commands, count, &deadline, &ctl_rcon_reply, &args);
+	}
+	else if(argc > 1 && strcmp(argv[1], "-f"))
+	{
+		// The arguments were split at spaces.
+		size_t len = 0;
+		for(int i = 1; i < argc; i ++)
+			len += strlen(argv[i]) + 1;
+		command = malloc(len);
+		if(command == NULL)
+		{
+			r = errno;
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			goto cleanup;
+		}
+		command[0] = '\0';
+		for(int i = 1; i < argc; i ++)
+		{
+			if(i > 1) strcat(command, " ");
+			strcat(command, argv[i]);
+		}
+		const char *data;
+		size_t data_len;
+		struct timespec deadline;
+		rcon_host_deadline(&deadline, CTL_RCON_TIMEOUT);
+		r = rcon_sched_acquire(NULL, RCON_SCHED_LANE_HIGH, &deadline);
+		if(!r) r = rcon_host_exec_view(command, &deadline, &data, &data_len);
+		if(!r) dprintf(out, "%s%s", data, data_len > 0 && data[data_len - 1] == '\n' ? "" : "\n");
+	}
+	else
+	{
+		dprintf(out, _("Usage: rcon <command>...\n"));
+		dprintf(out, _("Usage: rcon -f <file>\n"));
+		return 64;
+	}
+	if(r == EPG_RCON_DISABLED)
+		dprintf(out, _("rcon is disabled.\n"));
+	else if(r == EPG_RCON_TIMEOUT)
+		dprintf(out, _("The server did not answer in time.\n"));
+	else if(r)
+		dprintf(out, _("rcon failed: %d.\n"), r);
+	goto cleanup;
+cleanup:
+	rcon_host_release();
+	free(command);
+	free(commands);
+	return r;
+}
+
+static int main_handle_cmd(const int out, int argc, char **argv, char *input)
 {
 	if(argc <= 0)
 	{
@@ -187,15 +402,16 @@ static int main_handle_cmd(const int out, int argc, char **argv)
 	}
 	if(!strcmp(argv[0], "load"))
 	{
-		if(argc != 2)
+		const bool isolated = argc == 3 && !strcmp(argv[1], "-i");
+		if(argc != 2 && !isolated)
 		{
-			dprintf(out, _("load expects one argument: load <path/to/lib.so>\n"));
+			dprintf(out, _("load expects one argument: load [-i] <path/to/lib.so>\n"));
 			return 64;
 		}
 		dprintf(out, _("Waiting until the processing is done.\n"));
 		exclusive_section_enter();
 		thpool_wait(thpool);
-		int r = plugin_registry_load(out, argv[1]);
+		int r = plugin_registry_load(out, argv[argc - 1], isolated);
 		exclusive_section_leave();
 		return r;
 	}
@@ -224,25 +440,61 @@ static int main_handle_cmd(const int out, int argc, char **argv)
 		exclusive_section_leave();
 		return r;
 	}
+	if(!strcmp(argv[0], "reload"))
+	{
+		if(argc != 2 && argc != 3)
+		{
+			dprintf(out, _("reload expects one or two arguments: reload <ID> [path/to/lib.so]\n"));
+			return 64;
+		}
+		struct plugin *next;
+		struct plugin *prev;
+		int r = plugin_registry_reload_prepare(out, argv[1], argc == 3 ? argv[2] : NULL, &next);
+		if(r) return r;
+		/* The other plugins keep receiving events: only the swap waits for the dispatch. */
+		exclusive_section_enter();
+		r = plugin_registry_reload_swap(next, &prev);
+		exclusive_section_leave();
+		if(r)
+		{
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			plugin_registry_reload_abort(out, next);
+			return r;
+		}
+		plugin_registry_reload_retire(out, prev);
+		return 0;
+	}
 	if(!strcmp(argv[0], "rcon-get"))
 	{
 		int r = 0;
-		struct rcon_host_connarg *connarg = rcon_host_getconnarg();
-		if(connarg == NULL)
+		struct config *cfg = config_acquire();
+		if(cfg->rcon_host == NULL)
 		{
 			dprintf(out, _("Rcon is disabled.\n"));
 		}
 		else
 		{
-			dprintf(out, _("Host:\t%s\nPort:\t%s\n"), connarg->host, connarg->port);
+			dprintf(out, _("Host:\t%s\nPort:\t%s\nConnect timeout:\t%d ms\n"), cfg->rcon_host, cfg->rcon_port, cfg->rcon_connect_timeout);
 		}
+		dprintf(out, _("Generation:\t%" PRIu64 "\n"), cfg->generation);
+		config_release(cfg);
+		int connected, busy, size, owned;
+		rcon_host_pool_stat(&connected, &busy, &size, &owned);
+		dprintf(out, _("Pool:\t%d connected, %d busy, %d total\n"), connected, busy, size);
+		dprintf(out, _("Thread connections:\t%d\n"), owned);
 		return r;
 	}
 	if(!strcmp(argv[0], "rcon-set"))
 	{
 		int r = 0;
 		bool disable = false;
-		if(argc != 4)
+		int connect_timeout = -1;
+		if(argc == 5 && parse_timeout(argv[4], &connect_timeout))
+		{
+			dprintf(out, _("Connect timeout must be a positive number of milliseconds.\n"));
+			return 64;
+		}
+		if(argc != 4 && argc != 5)
 		{
 			if(argc == 2 && !strcmp("disable", argv[1]))
 			{
@@ -250,74 +502,304 @@ static int main_handle_cmd(const int out, int argc, char **argv)
 			}
 			else
 			{
-				dprintf(out, _("Usage: rcon-set <host> <port> <password>\n"));
+				dprintf(out, _("Usage: rcon-set <host> <port> <password> [connect timeout (ms)]\n"));
 				dprintf(out, _("Usage: rcon-set disable\n"));
 				return 64;
 			}
 		}
-		// Always allocate a new one to make sure it is atomic.
-		struct rcon_host_connarg *newargs = NULL;
-		if(!disable)
+		// Always publish a new snapshot to make sure it is atomic.
+		struct config *cfg = config_dup();
+		if(cfg == NULL)
+		{
+			r = errno;
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			return r;
+		}
+		if(disable)
+			r = config_set_rcon(cfg, NULL, NULL, NULL);
+		else
+			r = config_set_rcon(cfg, argv[1], argv[2], argv[3]);
+		if(r)
+		{
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			config_release(cfg);
+			return r;
+		}
+		if(connect_timeout > 0) cfg->rcon_connect_timeout = connect_timeout;
+		config_publish(cfg);
+		rcon_host_reload();
+		rcon_queue_kick();
+		dprintf(out, _("Ongoing requests will not be cancelled. Existing connections will be updated when plugins make requests.\n"));
+		return r;
+	}
+	if(!strcmp(argv[0], "rcon-sched"))
+	{
+		if(argc == 1)
+		{
+			rcon_sched_dump(out);
+			return 0;
+		}
+		if(!strcmp(argv[1], "set") && (argc == 4 || argc == 6))
 		{
-			newargs = malloc(sizeof(struct rcon_host_connarg));
-			if(newargs == NULL)
+			struct config *cfg = config_dup();
+			if(cfg == NULL)
 			{
-				r = errno;
+				const int r = errno;
 				dprintf(out, _("Cannot allocate memory: %d.\n"), r);
 				return r;
 			}
-			newargs->host = NULL;
-			newargs->port = NULL;
-			newargs->password = NULL;
-			int size = 0;
-			size = strlen(argv[1]) + 1;
-			newargs->host = calloc(size, sizeof(char));
-			if(newargs->host == NULL)
+			struct rcon_sched_limits *limits = &cfg->limits;
+			if(parse_rate(argv[2], &limits->rate) || parse_rate(argv[3], &limits->burst) ||
+					(argc == 6 && (parse_rate(argv[4], &limits->plugin_rate) || parse_rate(argv[5], &limits->plugin_burst))))
 			{
-				r = errno;
-				dprintf(out, _("Cannot allocate memory: %d\n"), r);
-				rcon_host_connarg_free(newargs);
-				return r;
+				dprintf(out, _("Rates and bursts must be non-negative numbers.\n"));
+				config_release(cfg);
+				return 64;
 			}
-			memcpy(newargs->host, argv[1], size);
-
-			size = strlen(argv[2]) + 1;
-			newargs->port = calloc(size, sizeof(char));
-			if(newargs->port == NULL)
+			config_publish(cfg);
+			rcon_sched_limits_changed();
+			return 0;
+		}
+		dprintf(out, _("Usage: rcon-sched\n"));
+		dprintf(out, _("Usage: rcon-sched set <rate> <burst> [<plugin rate> <plugin burst>]\n"));
+		return 64;
+	}
+	if(!strcmp(argv[0], "players"))
+	{
+		if(argc != 1)
+		{
+			dprintf(out, _("players expects no arguments\n"));
+			return 64;
+		}
+		session_dump(out);
+		return 0;
+	}
+	if(!strcmp(argv[0], "rcon-queue"))
+	{
+		if(argc != 1)
+		{
+			dprintf(out, _("rcon-queue expects no arguments\n"));
+			return 64;
+		}
+		rcon_queue_dump(out);
+		return 0;
+	}
+	if(!strcmp(argv[0], "scoreboard"))
+	{
+		if(argc != 1)
+		{
+			dprintf(out, _("scoreboard expects no arguments\n"));
+			return 64;
+		}
+		scoreboard_dump(out);
+		return 0;
+	}
+	if(!strcmp(argv[0], "rcon"))
+		return ctl_rcon(out, argc, argv, input);
+	if(!strcmp(argv[0], "console"))
+	{
+		if(argc == 1)
+		{
+			console_dump(out);
+			return 0;
+		}
+		// The arguments were split at spaces.
+		size_t len = 0;
+		for(int i = 1; i < argc; i ++)
+			len += strlen(argv[i]) + 1;
+		char *command = malloc(len);
+		if(command == NULL)
+		{
+			const int r = errno;
+			dprintf(out, _("Cannot allocate memory: %d.\n"), r);
+			return r;
+		}
+		command[0] = '\0';
+		for(int i = 1; i < argc; i ++)
+		{
+			if(i > 1) strcat(command, " ");
+			strcat(command, argv[i]);
+		}
+		const int r = console_send(command);
+		free(command);
+		if(r == EPG_RCON_DISABLED)
+			dprintf(out, _("No console: the server was not started by extmc.\n"));
+		else if(r)
+			dprintf(out, _("Cannot write to the console: %d.\n"), r);
+		return r;
+	}
+	if(!strcmp(argv[0], "passthrough"))
+	{
+		if(argc != 1)
+		{
+			dprintf(out, _("passthrough expects no arguments\n"));
+			return 64;
+		}
+		if(!passthrough_setup)
+		{
+			dprintf(out, _("Passthrough is off. Set EXTMC_PASSTHROUGH to - or a file.\n"));
+			return 0;
+		}
+		passthrough_dump(&passthrough, out);
+		return 0;
+	}
+	if(!strcmp(argv[0], "batch"))
+	{
+		if(argc != 1)
+		{
+			dprintf(out, _("batch expects no arguments\n"));
+			return 64;
+		}
+		batch_dump(out);
+		return 0;
+	}
+	if(!strcmp(argv[0], "rcon-stats"))
+	{
+		const bool reset = argc == 2 && !strcmp(argv[1], "reset");
+		if(argc != 1 && !reset)
+		{
+			dprintf(out, _("Usage: rcon-stats [reset]\n"));
+			return 64;
+		}
+		if(!reset) rcon_stats_dump_header(out);
+		for(int i = 0; i < plugin_size(); i ++)
+		{
+			struct plugin *plug = plugin_get_by_index(i);
+			if(reset)
+				rcon_stats_reset(plug->rcon_stats);
+			else
+				rcon_stats_dump(out, plug->id, plug->rcon_stats);
+		}
+		return 0;
+	}
+	if(!strcmp(argv[0], "stats"))
+	{
+		if(argc >= 2 && !strcmp(argv[1], "plugins"))
+		{
+			const bool reset = argc == 3 && !strcmp(argv[2], "reset");
+			if(argc != 2 && !reset)
 			{
-				r = errno;
-				dprintf(out, _("Cannot allocate memory: %d\n"), r);
-				rcon_host_connarg_free(newargs);
-				return r;
+				dprintf(out, _("Usage: stats plugins [reset]\n"));
+				return 64;
 			}
-			memcpy(newargs->port, argv[2], size);
-
-			size = strlen(argv[3]) + 1;
-			newargs->password = calloc(size, sizeof(char));
-			if(newargs->password == NULL)
+			if(!reset) plugin_profile_dump_header(out);
+			for(int i = 0; i < plugin_size(); i ++)
 			{
-				r = errno;
-				dprintf(out, _("Cannot allocate memory: %d\n"), r);
-				rcon_host_connarg_free(newargs);
-				return r;
+				struct plugin *plug = plugin_get_by_index(i);
+				if(reset)
+					plugin_profile_reset(plug->profile);
+				else
+					plugin_profile_dump(out, plug->id, plug->profile);
 			}
-			memcpy(newargs->password, argv[3], size);
+			return 0;
 		}
-
-		struct rcon_host_connarg *connarg = rcon_host_getconnarg();
-		rcon_host_setconnarg(newargs);
-		if(connarg != NULL) rcon_host_connarg_free(connarg);
-		dprintf(out, _("Ongoing requests will not be cancelled. Existing connections will be updated when plugins make requests.\n"));
-		return r;
+		if(argc == 2 && !strcmp(argv[1], "commands"))
+		{
+			exclusive_section_enter();
+			plugin_commands_dump(out);
+			exclusive_section_leave();
+			return 0;
+		}
+		if(argc == 2 && !strcmp(argv[1], "timers"))
+		{
+			timer_dump(out);
+			return 0;
+		}
+		if(argc == 2 && !strcmp(argv[1], "async"))
+		{
+			rcon_async_dump(out);
+			return 0;
+		}
+		if(argc == 2 && !strcmp(argv[1], "hosts"))
+		{
+			exclusive_section_enter();
+			plugin_host_dump_header(out);
+			for(int i = 0; i < plugin_size(); i ++)
+			{
+				struct plugin *plug = plugin_get_by_index(i);
+				if(plug->host != NULL) plugin_host_dump(out, plug->id, plug->host);
+			}
+			exclusive_section_leave();
+			return 0;
+		}
+		if(argc != 2 || strcmp(argv[1], "filters"))
+		{
+			dprintf(out, _("Usage: stats filters|commands|timers|async|hosts|plugins [reset]\n"));
+			return 64;
+		}
+		// Counted while matching the server output.
+		exclusive_section_enter();
+		dprintf(out, _("Plugin\tDelivered\tFiltered\n"));
+		for(int i = 0; i < plugin_size(); i ++)
+		{
+			const struct plugin *plug = plugin_get_by_index(i);
+			dprintf(out, "%s\t%" PRIu64 "\t%" PRIu64 "\n", plug->id, plug->delivered, plug->filtered);
+		}
+		exclusive_section_leave();
+		return 0;
 	}
 	dprintf(out, "Unexpected action: '%s'\n", argv[0]);
 	return 64;
 }
 
+/* Read a control request until EOF, for at most timeout_ms. Returns NULL with errno set. */
+static char *read_request(const int fd, const int timeout_ms)
+{
+	size_t cap = 1024, len = 0;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char *request = malloc(cap + 1);
+	if(request == NULL) return NULL;
+	while(true)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		const int ready = elapsed >= timeout_ms ? 0 : poll(&pfd, 1, timeout_ms - elapsed);
+		if(ready == -1 && errno == EINTR) continue;
+		if(ready <= 0)
+		{
+			free(request);
+			if(ready == 0) errno = ETIMEDOUT;
+			return NULL;
+		}
+		if(len == cap)
+		{
+			if(cap >= CTL_REQUEST_MAX)
+			{
+				free(request);
+				errno = EMSGSIZE;
+				return NULL;
+			}
+			cap *= 2;
+			char *request_ext = realloc(request, cap + 1);
+			if(request_ext == NULL)
+			{
+				free(request);
+				return NULL;
+			}
+			request = request_ext;
+		}
+		const ssize_t num_read = read(fd, &request[len], cap - len);
+		if(num_read == -1 && errno == EINTR) continue;
+		if(num_read == -1)
+		{
+			free(request);
+			return NULL;
+		}
+		if(num_read == 0) break;
+		len += num_read;
+	}
+	request[len] = '\0';
+	return request;
+}
+
 static void *main_ctlsocket(void *arg)
 {
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	thread_set_name("ctl-socket");
+	/* Control commands and plugins loading from here do not wait for the workers. */
+	rcon_host_own();
 	int r = 0;
 	char buf[1025];
 	while(true)
@@ -330,19 +812,29 @@ static void *main_ctlsocket(void *arg)
 			fprintf(stderr, _("Cannot accept control connection: %s\n"), buf);
 			goto cleanup;
 		}
-		const ssize_t size = read(accept_fd, buf, 1024);
-		buf[size] = '\0';
-		
+		// The client shuts its side down after the request: read until EOF.
+		char *request = read_request(accept_fd, CTL_REQUEST_TIMEOUT);
+		if(request == NULL)
+		{
+			dprintf(accept_fd, _("Cannot read the request: %d.\n%d"), errno, errno);
+			close(accept_fd);
+			continue;
+		}
+		// The first line holds the arguments, the rest is input for the command.
+		char *input = strchr(request, '\n');
+		if(input != NULL) *input ++ = '\0';
+
 		char *pch = NULL;
 		char **argv = calloc(1, sizeof(char*));
 		if(argv == NULL)
 		{
 			dprintf(accept_fd, _("Cannot allocate memory: %d.\n%d"), errno, errno);
+			free(request);
 			close(accept_fd);
 			continue;
 		}
 		int argc = 0;
-		pch = strtok(buf, " ");
+		pch = strtok(request, " ");
 		bool fail = false;
 		while(pch != NULL)
 		{
@@ -353,6 +845,7 @@ static void *main_ctlsocket(void *arg)
 			{
 				dprintf(accept_fd, _("Cannot allocate memory: %d.\n%d"), errno, errno);
 				free(argv);
+				free(request);
 				fail = true;
 				close(accept_fd);
 				break;
@@ -362,9 +855,10 @@ static void *main_ctlsocket(void *arg)
 			pch = strtok(NULL, " ");
 		}
 		if(fail) continue;
-		int resp = main_handle_cmd(accept_fd, argc, argv);
+		int resp = main_handle_cmd(accept_fd, argc, argv, input);
 		dprintf(accept_fd, "%d", resp);
 		free(argv);
+		free(request);
 		close(accept_fd);
 	}
 
@@ -486,18 +980,46 @@ static int main_daemon(int argc, char **argv)
 	DEBUG("main.c#main_daemon: main_daemon()\n");
 	bool sem_setup = false,
 	     mcin_setup = false,
+	     config_setup = false,
 	     rcon_setup = false,
+	     sched_setup = false,
+	     session_setup = false,
+	     queue_setup = false,
+	     scoreboard_setup = false,
+	     console_setup = false,
+	     input_setup = false,
 	     reg_setup = false,
 	     sock_setup = false,
 	     autoload_setup = false,
 	     sigmask_setup = false,
 	     thpool_setup = false,
+	     timer_setup = false,
+	     async_setup = false,
 	     sighandler_setup = false,
 	     loop_setup = false,
 	     socket_thread_setup = false;
 
 	int r = 0;
 
+	// extmc [autoload file]
+	// extmc run [autoload file] -- <server command>...
+	// extmc plugin-host <path> <core pid>, started by the daemon for an isolated plugin
+	if(argc > 1 && !strcmp(argv[1], "plugin-host")) return plugin_host_main(argc, argv);
+	const char *autoload_path = argc > 1 ? argv[1] : NULL;
+	char **server_argv = NULL;
+	if(argc > 1 && !strcmp(argv[1], "run"))
+	{
+		int i = 2;
+		autoload_path = NULL;
+		if(i < argc && strcmp(argv[i], "--")) autoload_path = argv[i ++];
+		if(i + 1 >= argc || strcmp(argv[i], "--"))
+		{
+			fprintf(stderr, _("Usage: extmc run [autoload file] -- <server command>...\n"));
+			return 64;
+		}
+		server_argv = &argv[i + 1];
+	}
+
 	DEBUG("main.c#main_daemon: Setup semaphore...\n");
 	r = setup_sem();
 	if(r) goto cleanup;
@@ -508,43 +1030,61 @@ static int main_daemon(int argc, char **argv)
 	if(r) goto cleanup;
 	else mcin_setup = true;
 
+	// Block signals before any thread is created so they are inherited.
+	DEBUG("main.c#main_daemon: Setup signal masks...\n");
+	sigset_t set;
+	r = setup_sigmask(&set);
+	if(r) goto cleanup;
+	else sigmask_setup = true;
+
+	DEBUG("main.c#main_daemon: Setup configuration...\n");
+	r = config_init();
+	if(r) goto cleanup;
+	else config_setup = true;
+
+	DEBUG("main.c#main_daemon: Loading configuration from environment variables.\n");
+	struct config *cfg = config_dup();
+	if(cfg == NULL)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	r = load_env_config(cfg);
+	if(r)
+	{
+		config_release(cfg);
+		goto cleanup;
+	}
+	const int thpool_threads = cfg->thpool_threads;
+	const int rcon_pool_size = cfg->rcon_pool_size;
+	config_publish(cfg);
+	DEBUGF("main.c#main_daemon: Using '%d' threads.\n", thpool_threads);
+
 	DEBUG("main.c#main_daemon: Setup rcon host...\n");
-	r = rcon_host_init();
+	r = rcon_host_init(rcon_pool_size);
 	if(r) goto cleanup;
 	else rcon_setup = true;
 	
-	DEBUG("main.c#main_daemon: Loading pre-defined rcon arguments from environment variables.\n");
-	const char *connarg_env_host = getenv("RCON_HOST");
-	const char *connarg_env_port = getenv("RCON_PORT");
-	const char *connarg_env_password = getenv("RCON_PASSWORD");
-	if(!(connarg_env_host == NULL && connarg_env_port == NULL && connarg_env_password == NULL))
-	{
-		if(connarg_env_host != NULL && connarg_env_port != NULL && connarg_env_password != NULL)
-		{
-			struct rcon_host_connarg *connarg = malloc(sizeof(struct rcon_host_connarg));
-			int size = 0;
-			size = strlen(connarg_env_host) + 1;
-			connarg->host = calloc(size, sizeof(char));
-			memcpy(connarg->host, connarg_env_host, size);
-			size = strlen(connarg_env_port) + 1;
-			connarg->port = calloc(size, sizeof(char));
-			memcpy(connarg->port, connarg_env_port, size);
-			size = strlen(connarg_env_password) + 1;
-			connarg->password = calloc(size, sizeof(char));
-			memcpy(connarg->password, connarg_env_password, size);
-			rcon_host_setconnarg(connarg);
-			DEBUGF("main.c#main_daemon: Loaded rcon arguments from environment variables:\nHost:\t%s\nPort:\t%s\nPassword:\t%s\n",
-					connarg->host,
-					connarg->port,
-					connarg->password);
-		}
-		else
-		{
-			fprintf(stderr, _("Cannot load rcon settings: RCON_HOST, RCON_PORT and RCON_PASSWORD must all present.\n"));
-			r = 64;
-			goto cleanup;
-		}
-	}
+	DEBUG("main.c#main_daemon: Setup rcon scheduler...\n");
+	r = rcon_sched_init();
+	if(r) goto cleanup;
+	else sched_setup = true;
+
+	DEBUG("main.c#main_daemon: Setup session tracker...\n");
+	r = session_init();
+	if(r) goto cleanup;
+	else session_setup = true;
+
+	DEBUG("main.c#main_daemon: Setup rcon queue...\n");
+	r = rcon_queue_init(getenv("RCON_QUEUE_PATH"));
+	if(r) goto cleanup;
+	else queue_setup = true;
+
+	DEBUG("main.c#main_daemon: Setup scoreboard...\n");
+	r = scoreboard_init();
+	if(r) goto cleanup;
+	else scoreboard_setup = true;
 
 	DEBUG("main.c#main_daemon: Setup plugin registry...\n");
 	r = plugin_registry_init();
@@ -556,34 +1096,24 @@ static int main_daemon(int argc, char **argv)
 	if(r) goto cleanup;
 	else sock_setup = true;
 
-	DEBUG("main.c#main_daemon: Setup signal masks...\n");
-	sigset_t set;
-	r = setup_sigmask(&set);
-	if(r) goto cleanup;
-	else sigmask_setup = true;
-
 	DEBUG("main.c#main_daemon: Setup thread pool...\n");
-	int thpool_threads = 1;
-	if(getenv("THPOOL_THREADS") != NULL)
-	{
-		char *endptr;
-		uintmax_t num = strtoumax(getenv("THPOOL_THREADS"), &endptr, 10);
-		if(strcmp(endptr, "") || (num == UINTMAX_MAX && errno == ERANGE) || num > INT_MAX || num <= 0)
-		{
-			fprintf(stderr, _("Invalid THPOOL_THREADS value.\n"));
-			r = 64;
-			goto cleanup;
-		}
-		thpool_threads = (int)num;
-	}
-	DEBUGF("main.c#main_daemon: Using '%d' threads.\n", thpool_threads);
 	thpool = thpool_init(thpool_threads);
 	thpool_setup = true;
 
-	if(argc > 1)
+	DEBUG("main.c#main_daemon: Setup timers...\n");
+	r = timer_init(thpool);
+	if(r) goto cleanup;
+	else timer_setup = true;
+
+	DEBUG("main.c#main_daemon: Setup async rcon...\n");
+	r = rcon_async_init(thpool);
+	if(r) goto cleanup;
+	else async_setup = true;
+
+	if(autoload_path != NULL)
 	{
 		DEBUG("main.c#main_daemon: Autoloading plugins at startup...\n");
-		r = autoload(argv[1]);
+		r = autoload(autoload_path);
 		if(r) goto cleanup;
 		else autoload_setup = true;
 	}
@@ -594,6 +1124,33 @@ static int main_daemon(int argc, char **argv)
 	if(r) goto cleanup;
 	else sighandler_setup = true;
 
+	if(server_argv != NULL)
+	{
+		DEBUG("main.c#main_daemon: Starting the server...\n");
+		r = console_spawn(server_argv);
+		if(r) goto cleanup;
+		else console_setup = true;
+	}
+
+	DEBUG("main.c#main_daemon: Setup input...\n");
+	r = linebuf_init(&input, console_output_fd(), LINEBUF_SIZE);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	else input_setup = true;
+
+	const char *passthrough_target = getenv("EXTMC_PASSTHROUGH");
+	if(passthrough_target != NULL)
+	{
+		DEBUG("main.c#main_daemon: Setup passthrough...\n");
+		r = passthrough_init(&passthrough, console_output_fd(), passthrough_target);
+		if(r) goto cleanup;
+		input.pt = &passthrough;
+		passthrough_setup = true;
+	}
+
 	DEBUG("main.c#main_daemon: Setup main loop thread...\n");
 	pthread_t thread_loop;
 	r = setup_thread(&thread_loop, &main_loop, NULL);
@@ -632,8 +1189,27 @@ cleanup:
 	}
 	DEBUG("main.c#main_daemon: Cleanup loop thread...\n");
 	if(loop_setup) destroy_thread(thread_loop);
+	DEBUG("main.c#main_daemon: Cleanup input...\n");
+	if(input_setup) linebuf_free(&input);
+	DEBUG("main.c#main_daemon: Cleanup passthrough...\n");
+	if(passthrough_setup)
+	{
+		passthrough_setup = false;
+		passthrough_free(&passthrough);
+	}
+	DEBUG("main.c#main_daemon: Stopping the server...\n");
+	if(console_setup)
+	{
+		const int status = console_free();
+		if(!r) r = status;
+	}
 	DEBUG("main.c#main_daemon: Cleanup signal handler thread...\n");
 	if(sighandler_setup) destroy_thread(thread_sighandler);
+	// Timers and async replies schedule work on the pool.
+	DEBUG("main.c#main_daemon: Cleanup timers...\n");
+	if(timer_setup) timer_free();
+	DEBUG("main.c#main_daemon: Cleanup async rcon...\n");
+	if(async_setup) rcon_async_free();
 	// Always perform thpool_wait after the main loop thread is paused or stopped.
 	DEBUG("main.c#main_daemon: Cleanup thread pool...\n");
 	if(thpool_setup)
@@ -656,17 +1232,59 @@ cleanup:
 		}
 	}
 	free(plugins);
+	DEBUG("main.c#main_daemon: Cleanup scoreboard...\n");
+	if(scoreboard_setup) scoreboard_free();
+	DEBUG("main.c#main_daemon: Cleanup rcon queue...\n");
+	if(queue_setup) rcon_queue_free();
+	DEBUG("main.c#main_daemon: Cleanup session tracker...\n");
+	if(session_setup) session_free();
 	DEBUG("main.c#main_daemon: Cleanup rcon host...\n");
-	struct rcon_host_connarg *connarg = rcon_host_getconnarg();
-	if(connarg != NULL) rcon_host_connarg_free(connarg);
 	if(rcon_setup) { rcon_host_free(); }
+	DEBUG("main.c#main_daemon: Cleanup rcon scheduler...\n");
+	if(sched_setup) rcon_sched_free();
 	DEBUG("main.c#main_daemon: Cleanup plugin registry...\n");
 	if(reg_setup) plugin_registry_free();
+	DEBUG("main.c#main_daemon: Cleanup configuration...\n");
+	if(config_setup) config_free();
 	// Make the compiler happy: we don't need to do any cleanup for these items.
 	if(sigmask_setup) {}
 	return r;
 }
 
+/* Write the content of path, or of the standard input for "-", to fd. */
+static int send_file(const int fd, const char *path)
+{
+	int r = 0;
+	const int file_fd = strcmp(path, "-") ? open(path, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+	if(file_fd == -1)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot open %s: %s.\n"), path, strerror(r));
+		return r;
+	}
+	if(write(fd, "\n", 1) != 1) r = errno;
+	char buf[4096];
+	ssize_t num_read;
+	while(!r && (num_read = read(file_fd, buf, sizeof(buf))) != 0)
+	{
+		if(num_read == -1)
+		{
+			if(errno == EINTR) continue;
+			r = errno;
+			break;
+		}
+		for(ssize_t done = 0; done < num_read && !r; )
+		{
+			const ssize_t num_written = write(fd, &buf[done], num_read - done);
+			if(num_written == -1 && errno != EINTR) r = errno;
+			if(num_written > 0) done += num_written;
+		}
+	}
+	if(r) fprintf(stderr, _("Cannot send %s: %s.\n"), path, strerror(r));
+	if(file_fd != STDIN_FILENO) close(file_fd);
+	return r;
+}
+
 static int main_ctl(int argc, char **argv)
 {
 	int r = 0;
@@ -688,33 +1306,56 @@ static int main_ctl(int argc, char **argv)
 		fprintf(stderr, "%s\n", strerror(r));
 		goto cleanup;
 	}
+	// rcon -f: the script follows the arguments line instead of its path.
+	const bool script = argc == 4 && !strcmp(argv[1], "rcon") && !strcmp(argv[2], "-f");
+	const int send_argc = script ? 3 : argc;
 	unsigned int length = 0;
-	for(int i = 1; i < argc; i ++)
+	for(int i = 1; i < send_argc; i ++)
 	{
 		length += strlen(argv[i]);
-		if(i != argc - 1) length ++;
+		if(i != send_argc - 1) length ++;
 	}
 	char *dat = calloc(length + 1, sizeof(char));
 	strcpy(dat, "");
-	for(int i = 1; i < argc; i ++)
+	for(int i = 1; i < send_argc; i ++)
 	{
 		strcat(dat, argv[i]);
-		if(i != argc - 1) strcat(dat, " ");
+		if(i != send_argc - 1) strcat(dat, " ");
 	}
 	dprintf(fd, "%s", dat);
 	free(dat);
+	if(script)
+	{
+		r = send_file(fd, argv[3]);
+		if(r) goto cleanup;
+	}
+	// The daemon reads the request until EOF.
+	shutdown(fd, SHUT_WR);
 
 	ssize_t num_read;
-	int arr_size = 1025;
-	char *buffer = calloc(1025, sizeof(char));
-	strcpy(buffer, "");
-	char buf[1025];
-	while((num_read = read(fd, buf, 1024)) > 0)
+	size_t arr_size = 1025, buffer_len = 0;
+	char *buffer = calloc(arr_size, sizeof(char));
+	bool printed = false;
+	while((num_read = read(fd, &buffer[buffer_len], arr_size - buffer_len - 1)) > 0)
 	{
-		buf[num_read] = '\0';
-		arr_size += 1024;
-		buffer = realloc(buffer, arr_size * sizeof(char));
-		strcat(buffer, buf);
+		buffer_len += num_read;
+		buffer[buffer_len] = '\0';
+		// Print complete lines as they come: rcon scripts can run for a while.
+		// The last line is the exit code.
+		char *line_end = strrchr(buffer, '\n');
+		if(line_end != NULL)
+		{
+			fwrite(buffer, 1, line_end - buffer + 1, stdout);
+			fflush(stdout);
+			printed = true;
+			buffer_len -= line_end - buffer + 1;
+			memmove(buffer, line_end + 1, buffer_len + 1);
+		}
+		if(buffer_len == arr_size - 1)
+		{
+			arr_size *= 2;
+			buffer = realloc(buffer, arr_size * sizeof(char));
+		}
 	}
 	const char *last_newline = strrchr(buffer, '\n');
 	char *endptr;
@@ -727,6 +1368,10 @@ static int main_ctl(int argc, char **argv)
 			r = (int)num;
 			buffer[0] = '\0';
 		}
+		else if(printed)
+		{
+			r = 255;
+		}
 	}
 	else
 	{
@@ -3,6 +3,12 @@
 #include "thpool.h"
 #include "plugins.h"
 #include "plugin_registry.h"
+#include "plugin_profile.h"
+#include "plugin_host.h"
+#include "rcon_host.h"
+#include "session.h"
+#include "rcon_queue.h"
+#include "scoreboard.h"
 
 #include <regex.h>
 #include <stdio.h>
@@ -44,7 +50,7 @@ static int mcin_compile_regex(const char *regex, const int flags, regex_t *reg)
 int mcin_init()
 {
 	int r = 0;
-	r = mcin_compile_regex(".*\\[([0-9][0-9]:[0-9][0-9]:[0-9][0-9])\\] \\[(.*)\\/(.*)\\]: (.*)\n", REG_EXTENDED, &reg_master);
+	r = mcin_compile_regex(".*\\[([0-9][0-9]:[0-9][0-9]:[0-9][0-9])\\] \\[(.*)\\/(.*)\\]: (.*)$", REG_EXTENDED, &reg_master);
 	if(r) return r;
 	r = mcin_compile_regex("(.*) joined the game", REG_EXTENDED, &reg_player_join);
 	if(r) return r;
@@ -159,7 +165,7 @@ static bool mcin_match_one_ex(const regex_t reg, const char *str, const int requ
 		return false;
 	}
 	if(pmatch[0].rm_so == -1) return false;
-	arg->id = 0;
+	arg->plugin = 0;
 	arg->arg1 = NULL;
 	arg->arg2 = NULL;
 	arg->arg3 = NULL;
@@ -229,10 +235,11 @@ static bool mcin_match_one(const regex_t reg, const char *str, const int require
 	return mcin_match_one_ex(reg, str, required_args, required_args, arg);
 }
 
-static struct plugin_call_job_args *args_copy(const struct plugin_call_job_args *orig, int index)
+static struct plugin_call_job_args *args_copy(const struct plugin_call_job_args *orig, const plugin_ref plugin, const uint64_t queued_ns)
 {
 	struct plugin_call_job_args *args = malloc(sizeof(struct plugin_call_job_args));
-	args->id = index; // Index to ID resolution will happen in plugcall_*.
+	args->plugin = plugin; // Resolved in plugcall_*, which skips unloaded plugins.
+	args->queued_ns = queued_ns;
 	if(orig->arg1 == NULL) args->arg1 = NULL;
 	else
 	{
@@ -267,10 +274,35 @@ static struct plugin_call_job_args *args_copy(const struct plugin_call_job_args
 	return args;
 }
 
+static void schedule(const threadpool thpool, struct plugin_queue *queue, void (*call)(void *), void *arg)
+{
+	if(queue != NULL)
+		plugin_queue_push(queue, thpool, call, arg);
+	else
+		thpool_add_work(thpool, call, arg);
+}
+
+static void dispatch(const threadpool thpool, const enum plugin_event event, const struct plugin_call_job_args *local)
+{
+	size_t count;
+	const struct plugin_subscriber *subscribers = plugin_subscribers(event, &count);
+	if(count == 0) return;
+	const uint64_t queued_ns = plugin_profile_now();
+	for(size_t i = 0; i < count; i ++)
+	{
+		if(!plugin_subscriber_match(&subscribers[i], event, local)) continue;
+		/* Straight to the ring, without a copy or a worker. */
+		if(subscribers[i].host != NULL)
+			plugin_host_post(subscribers[i].host, event, local);
+		else
+			schedule(thpool, subscribers[i].queue, subscribers[i].call, args_copy(local, subscribers[i].plugin->ref, queued_ns));
+	}
+}
+
 void mcin_match(const char *str, const threadpool thpool)
 {
 	struct plugin_call_job_args local;
-	local.id = 0;
+	local.plugin = 0;
 	local.arg1 = NULL;
 	local.arg2 = NULL;
 	local.arg3 = NULL;
@@ -302,96 +334,68 @@ void mcin_match(const char *str, const threadpool thpool)
 		if(i == 4) // Data
 			break;
 	}
-	const int size = plugin_size();
 	if(mcin_match_one(reg_player_join, temp_str, 1, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_join == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_join, args_copy(&local, i));
-		}
+		session_join(local.arg1);
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_JOIN, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_player_leave, temp_str, 2, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_leave == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_leave, args_copy(&local, i));
-		}
+		session_leave(local.arg1);
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_LEAVE, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_player_achievement, temp_str, 2, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_achievement == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_achievement, args_copy(&local, i));
-		}
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_ACHIEVEMENT, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_player_challenge, temp_str, 2, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_challenge == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_challenge, args_copy(&local, i));
-		}
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_CHALLENGE, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_player_goal, temp_str, 2, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_goal == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_goal, args_copy(&local, i));
-		}
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_GOAL, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_player_say, temp_str, 2, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_player_say == NULL) continue;
-			thpool_add_work(thpool, &plugcall_player_say, args_copy(&local, i));
-		}
+		session_chat(local.arg1);
+		struct plugin_queue *queue = NULL;
+		void *command = plugin_command_match(local.arg1, local.arg2, &queue);
+		if(command != NULL) schedule(thpool, queue, &plugcall_command, command);
+		dispatch(thpool, PLUGIN_EVENT_PLAYER_SAY, &local);
 		goto cleanup;
 	}
 	for(int i = 0; i < 64; i ++)
 		if(mcin_match_one_ex(reg_player_die[i], temp_str, 1, 2, &local))
 		{
-			for(int j = 0; j < size; j ++)
-			{
-				if(plugin_get_by_index(i)->fc_player_die == NULL) continue;
-				thpool_add_work(thpool, &plugcall_player_die, args_copy(&local, j));
-			}
+			session_death(local.arg1);
+			dispatch(thpool, PLUGIN_EVENT_PLAYER_DIE, &local);
 			goto cleanup;
 		}
 	if(mcin_match_one(reg_server_stopping, temp_str, 0, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_server_stopping == NULL) continue;
-			thpool_add_work(thpool, &plugcall_server_stopping, args_copy(&local, i));
-		}
+		rcon_host_server_stopping();
+		session_server_stopping();
+		dispatch(thpool, PLUGIN_EVENT_SERVER_STOPPING, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_server_starting, temp_str, 1, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_server_starting == NULL) continue;
-			thpool_add_work(thpool, &plugcall_server_starting, args_copy(&local, i));
-		}
+		dispatch(thpool, PLUGIN_EVENT_SERVER_STARTING, &local);
 		goto cleanup;
 	}
 	if(mcin_match_one(reg_server_started, temp_str, 1, &local))
 	{
-		for(int i = 0; i < size; i ++)
-		{
-			if(plugin_get_by_index(i)->fc_server_started == NULL) continue;
-			thpool_add_work(thpool, &plugcall_server_started, args_copy(&local, i));
-		}
+		rcon_host_server_started();
+		session_server_started();
+		rcon_queue_kick();
+		scoreboard_server_started();
+		dispatch(thpool, PLUGIN_EVENT_SERVER_STARTED, &local);
 		goto cleanup;
 	}
 	goto cleanup;
@@ -9,47 +9,349 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sysexits.h>
 #include <unistd.h>
 
-int net_connect(const char *host, const char *port, int *out)
+/* Delay before racing the next address (RFC 8305 "Connection Attempt Delay"). */
+#define NET_ATTEMPT_DELAY_MS	250
+#define NET_MAX_ADDRS		16
+
+struct net_addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_host = NULL;
+static char *cache_port = NULL;
+static struct net_addr cache_addrs[NET_MAX_ADDRS];
+static int cache_size = 0;
+/* At most one getaddrinfo() runs, on a thread of its own, so a slow resolver only costs the callers
+ * their deadline. Guarded by cache_mutex. */
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t resolve_cond;
+static bool resolving = false;
+/* Bumped when a resolve finishes. resolve_error is its getaddrinfo() error, for resolve_host:resolve_port. */
+static unsigned int resolve_seq = 0;
+static int resolve_error = 0;
+static char *resolve_host = NULL;
+static char *resolve_port = NULL;
+
+struct resolve_job {
+	char *host;
+	char *port;
+};
+
+void net_cache_invalidate()
+{
+	pthread_mutex_lock(&cache_mutex);
+	free(cache_host);
+	free(cache_port);
+	cache_host = NULL;
+	cache_port = NULL;
+	cache_size = 0;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+static void resolve_init()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&resolve_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void *resolve_main(void *arg)
 {
-	int sd;
+	struct resolve_job *job = arg;
+	struct net_addr addrs[NET_MAX_ADDRS];
 	struct addrinfo hints;
 	struct addrinfo *server_info, *p;
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
-	int ret = getaddrinfo(host, port, &hints, &server_info);
-	if(ret)
+	const int r = getaddrinfo(job->host, job->port, &hints, &server_info);
+	int n = 0;
+	if(!r)
 	{
-		fprintf(stderr, _("Cannot resolve host %s: %s.\n"), host, strerror(ret));
-		return EX_IOERR;
+		/* Interleave address families, keeping the resolver's preference (RFC 8305 section 4). */
+		const int first_family = server_info->ai_family;
+		struct addrinfo *next_first = server_info, *next_other = server_info;
+		bool want_first = true;
+		while(n < NET_MAX_ADDRS)
+		{
+			struct addrinfo **cursor = want_first ? &next_first : &next_other;
+			while(*cursor != NULL && (((*cursor)->ai_family == first_family) != want_first))
+				*cursor = (*cursor)->ai_next;
+			if(*cursor == NULL)
+			{
+				if((want_first ? next_other : next_first) == NULL) break;
+				want_first = !want_first;
+				continue;
+			}
+			p = *cursor;
+			*cursor = p->ai_next;
+			addrs[n].family = p->ai_family;
+			addrs[n].socktype = p->ai_socktype;
+			addrs[n].protocol = p->ai_protocol;
+			addrs[n].addrlen = p->ai_addrlen;
+			memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+			n ++;
+			want_first = !want_first;
+		}
+		freeaddrinfo(server_info);
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	if(!r)
+	{
+		free(cache_host);
+		free(cache_port);
+		/* Handed over to the cache. */
+		cache_host = job->host;
+		cache_port = job->port;
+		memcpy(cache_addrs, addrs, n * sizeof(struct net_addr));
+		cache_size = n;
+		job->host = NULL;
+		job->port = NULL;
+	}
+	resolving = false;
+	resolve_error = r;
+	resolve_seq ++;
+	pthread_cond_broadcast(&resolve_cond);
+	pthread_mutex_unlock(&cache_mutex);
+	free(job->host);
+	free(job->port);
+	free(job);
+	return NULL;
+}
+
+/* Start resolving host:port. Called with cache_mutex held and no resolve running. */
+static int resolve_start(const char *host, const char *port)
+{
+	int r = 0;
+	struct resolve_job *job = calloc(1, sizeof(struct resolve_job));
+	char *current_host = strdup(host);
+	char *current_port = strdup(port);
+	if(job == NULL || current_host == NULL || current_port == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	job->host = strdup(host);
+	job->port = strdup(port);
+	if(job->host == NULL || job->port == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	r = pthread_create(&thread, &attr, &resolve_main, job);
+	pthread_attr_destroy(&attr);
+	if(r) goto cleanup;
+	job = NULL;
+	free(resolve_host);
+	free(resolve_port);
+	resolve_host = current_host;
+	resolve_port = current_port;
+	current_host = NULL;
+	current_port = NULL;
+	resolving = true;
+	goto cleanup;
+cleanup:
+	if(job != NULL)
+	{
+		free(job->host);
+		free(job->port);
+		free(job);
+	}
+	free(current_host);
+	free(current_port);
+	return r;
+}
+
+/* Resolve host:port from the cache, or wait for the resolver until deadline. */
+static int net_resolve(const char *host, const char *port, const struct timespec *deadline, struct net_addr *out, int *size)
+{
+	int r = 0;
+	pthread_once(&resolve_once, &resolve_init);
+	pthread_mutex_lock(&cache_mutex);
+	while(true)
+	{
+		if(cache_host != NULL && !strcmp(cache_host, host) && !strcmp(cache_port, port))
+		{
+			memcpy(out, cache_addrs, cache_size * sizeof(struct net_addr));
+			*size = cache_size;
+			goto cleanup;
+		}
+		/* Another host may be resolving after a configuration change: wait for it, then resolve ours. */
+		if(!resolving)
+		{
+			r = resolve_start(host, port);
+			if(r)
+			{
+				fprintf(stderr, _("Cannot resolve host %s: %s.\n"), host, strerror(r));
+				r = EX_NOHOST;
+				goto cleanup;
+			}
+		}
+		const unsigned int seq = resolve_seq;
+		while(resolve_seq == seq)
+		{
+			if(pthread_cond_timedwait(&resolve_cond, &cache_mutex, deadline) == ETIMEDOUT)
+			{
+				/* The resolve goes on and fills the cache for a later attempt. */
+				fprintf(stderr, _("Cannot resolve host %s in time.\n"), host);
+				r = EX_NOHOST;
+				goto cleanup;
+			}
+		}
+		if(resolve_error && !strcmp(resolve_host, host) && !strcmp(resolve_port, port))
+		{
+			fprintf(stderr, _("Cannot resolve host %s: %s.\n"), host, gai_strerror(resolve_error));
+			r = EX_NOHOST;
+			goto cleanup;
+		}
+	}
+cleanup:
+	pthread_mutex_unlock(&cache_mutex);
+	return r;
+}
+
+static int net_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int net_start_attempt(const struct net_addr *addr)
+{
+	int sd = socket(addr->family, addr->socktype, addr->protocol);
+	if(sd == -1) return -1;
+	const int flags = fcntl(sd, F_GETFL);
+	if(flags == -1 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		close(sd);
+		return -1;
+	}
+	if(connect(sd, (const struct sockaddr *)&addr->addr, addr->addrlen) == -1 && errno != EINPROGRESS)
+	{
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+int net_connect(const char *host, const char *port, const int timeout_ms, int *out)
+{
+	int r = 0;
+	struct net_addr addrs[NET_MAX_ADDRS];
+	int size = 0;
+	/* The deadline covers resolving as well. */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct timespec deadline = start;
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec ++;
+		deadline.tv_nsec -= 1000000000L;
 	}
-	for (p = server_info; p != NULL; p = p->ai_next)
+	r = net_resolve(host, port, &deadline, addrs, &size);
+	if(r) return r;
+
+	struct pollfd fds[NET_MAX_ADDRS];
+	int inflight = 0;
+	int next = 0;
+	int last_error = ECONNREFUSED;
+	int sd = -1;
+	int last_start = -NET_ATTEMPT_DELAY_MS;
+	while(sd == -1)
 	{
-		sd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sd == -1) continue;
-		ret = connect(sd, p->ai_addr, p->ai_addrlen);
-		if(ret == -1)
+		int elapsed = net_elapsed_ms(&start);
+		if(elapsed >= timeout_ms)
+		{
+			last_error = ETIMEDOUT;
+			break;
+		}
+		/* Start the next attempt if none is running or the previous one is taking long. */
+		while(next < size && (inflight == 0 || elapsed - last_start >= NET_ATTEMPT_DELAY_MS))
+		{
+			const int fd = net_start_attempt(&addrs[next ++]);
+			if(fd == -1)
+			{
+				last_error = errno;
+				continue;
+			}
+			fds[inflight].fd = fd;
+			fds[inflight].events = POLLOUT;
+			fds[inflight].revents = 0;
+			inflight ++;
+			last_start = elapsed;
+		}
+		if(inflight == 0) break;
+		int wait = timeout_ms - elapsed;
+		if(next < size && NET_ATTEMPT_DELAY_MS - (elapsed - last_start) < wait)
+			wait = NET_ATTEMPT_DELAY_MS - (elapsed - last_start);
+		const int ready = poll(fds, inflight, wait);
+		if(ready == -1)
+		{
+			if(errno == EINTR) continue;
+			last_error = errno;
+			break;
+		}
+		for(int i = 0; i < inflight && sd == -1; i ++)
 		{
-			close(sd);
-			continue;
+			if(fds[i].revents == 0) continue;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+			if(err == 0)
+			{
+				sd = fds[i].fd;
+				fds[i] = fds[-- inflight];
+				break;
+			}
+			last_error = err;
+			close(fds[i].fd);
+			fds[i --] = fds[-- inflight];
 		}
-		break;
 	}
-	if(p == NULL)
+	for(int i = 0; i < inflight; i ++)
+		close(fds[i].fd);
+	if(sd == -1)
 	{
-		fprintf(stderr, _("Cannot connect to %s:%s : %s.\n"), host, port, strerror(errno));
-		freeaddrinfo(server_info);
+		fprintf(stderr, _("Cannot connect to %s:%s : %s.\n"), host, port, strerror(last_error));
+		/* The server may have moved. */
+		net_cache_invalidate();
+		return EX_UNAVAILABLE;
+	}
+	const int flags = fcntl(sd, F_GETFL);
+	if(flags == -1 || fcntl(sd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+	{
+		fprintf(stderr, _("fcntl(): %s.\n"), strerror(errno));
+		close(sd);
 		return EX_IOERR;
 	}
-	freeaddrinfo(server_info);
 	*out = sd;
 	return 0;
 }
@@ -6,6 +6,10 @@
 #ifndef _NET_H
 #define _NET_H
 
-int net_connect(const char *host, const char *port, int *out);
+/* Race the resolved addresses and give up after timeout_ms, which includes resolving the host.
+ * Returns EX_NOHOST if the host cannot be resolved in time and EX_UNAVAILABLE if no address accepts. */
+int net_connect(const char *host, const char *port, const int timeout_ms, int *out);
+/* Forget the resolved addresses. */
+void net_cache_invalidate();
 
 #endif // _NET_H
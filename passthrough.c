@@ -0,0 +1,172 @@
+#ifdef __linux__
+/* tee(2) and splice(2). */
+#define _GNU_SOURCE
+#endif
+
+#include "passthrough.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static void account(struct passthrough *pt, uint64_t bytes, uint64_t dropped)
+{
+	pthread_mutex_lock(&pt->mutex);
+	pt->bytes += bytes;
+	pt->dropped += dropped;
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+int passthrough_init(struct passthrough *pt, int in_fd, const char *target)
+{
+	int r = 0;
+	pt->mode = PASSTHROUGH_BUFFERED;
+	pt->fd = STDOUT_FILENO;
+	pt->close_fd = false;
+	pt->mid[0] = pt->mid[1] = -1;
+	pt->bytes = 0;
+	pt->dropped = 0;
+	r = pthread_mutex_init(&pt->mutex, NULL);
+	if(r) return r;
+	if(strcmp(target, "-"))
+	{
+		/* Not O_APPEND, which splice(2) refuses. extmc is the only writer. */
+		pt->fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if(pt->fd == -1 || lseek(pt->fd, 0, SEEK_END) == -1)
+		{
+			r = errno;
+			fprintf(stderr, _("Cannot open %s: %d.\n"), target, r);
+			goto cleanup;
+		}
+		pt->close_fd = true;
+	}
+#ifdef __linux__
+	struct stat in_st, out_st;
+	if(!fstat(in_fd, &in_st) && !fstat(pt->fd, &out_st) && S_ISFIFO(in_st.st_mode))
+	{
+		if(S_ISFIFO(out_st.st_mode))
+			pt->mode = PASSTHROUGH_TEE;
+		else if(S_ISREG(out_st.st_mode) && !pipe(pt->mid))
+			pt->mode = PASSTHROUGH_SPLICE;
+	}
+#endif
+	DEBUGF("passthrough.c#passthrough_init: Mode %d.\n", pt->mode);
+	goto cleanup;
+cleanup:
+	if(r) passthrough_free(pt);
+	return r;
+}
+
+void passthrough_free(struct passthrough *pt)
+{
+	if(pt->close_fd) close(pt->fd);
+	pt->close_fd = false;
+	for(int i = 0; i < 2; i ++)
+	{
+		if(pt->mid[i] != -1) close(pt->mid[i]);
+		pt->mid[i] = -1;
+	}
+	pthread_mutex_destroy(&pt->mutex);
+}
+
+/* Write what was read unless the target is not ready. */
+static void write_through(struct passthrough *pt, const char *buf, size_t len)
+{
+	struct pollfd pfd = { pt->fd, POLLOUT, 0 };
+	if(poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))
+	{
+		account(pt, 0, len);
+		return;
+	}
+	ssize_t num_written = write(pt->fd, buf, len);
+	if(num_written < 0) num_written = 0;
+	account(pt, num_written, len - num_written);
+}
+
+#ifdef __linux__
+/* Move len bytes from the spare pipe into the file. Returns false if the rest had to be discarded. */
+static bool splice_out(struct passthrough *pt, size_t len, char *scratch, size_t scratch_len)
+{
+	while(len > 0)
+	{
+		const ssize_t n = splice(pt->mid[0], NULL, pt->fd, NULL, len, SPLICE_F_MOVE);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) break;
+		len -= n;
+	}
+	if(len == 0) return true;
+	/* The spare pipe must be empty for the next chunk. */
+	while(len > 0)
+	{
+		const ssize_t n = read(pt->mid[0], scratch, len < scratch_len ? len : scratch_len);
+		if(n <= 0) break;
+		len -= n;
+	}
+	return false;
+}
+#endif
+
+ssize_t passthrough_read(struct passthrough *pt, int in_fd, void *buf, size_t len)
+{
+#ifdef __linux__
+	if(pt->mode != PASSTHROUGH_BUFFERED)
+	{
+		struct pollfd pfd = { in_fd, POLLIN, 0 };
+		while(poll(&pfd, 1, -1) == -1)
+			if(errno != EINTR) return -1;
+		const int out = pt->mode == PASSTHROUGH_TEE ? pt->fd : pt->mid[1];
+		/* Duplicates the pipe content without consuming it, and never waits for the target. */
+		const ssize_t n = tee(in_fd, out, len, SPLICE_F_NONBLOCK);
+		if(n > 0)
+		{
+			bool passed = true;
+			if(pt->mode == PASSTHROUGH_SPLICE)
+				passed = splice_out(pt, n, buf, len);
+			account(pt, passed ? n : 0, passed ? 0 : n);
+			/* Consume exactly what was passed through: at least n bytes are in the pipe. */
+			size_t done = 0;
+			while(done < (size_t)n)
+			{
+				const ssize_t num_read = read(in_fd, (char *)buf + done, n - done);
+				if(num_read == -1 && errno == EINTR) continue;
+				if(num_read <= 0) return done > 0 ? (ssize_t)done : num_read;
+				done += num_read;
+			}
+			return n;
+		}
+		if(n == -1 && errno != EAGAIN)
+		{
+			fprintf(stderr, _("Cannot pass the output through with tee: %d. Copying it instead.\n"), errno);
+			pt->mode = PASSTHROUGH_BUFFERED;
+		}
+		else
+		{
+			/* End of input, or the target is full: this chunk is not passed through. */
+			const ssize_t num_read = read(in_fd, buf, len);
+			if(num_read > 0) account(pt, 0, num_read);
+			return num_read;
+		}
+	}
+#endif
+	const ssize_t num_read = read(in_fd, buf, len);
+	if(num_read > 0) write_through(pt, buf, num_read);
+	return num_read;
+}
+
+void passthrough_dump(struct passthrough *pt, int out)
+{
+	static const char *modes[] = { "tee", "splice", "buffered" };
+	pthread_mutex_lock(&pt->mutex);
+	const uint64_t bytes = pt->bytes, dropped = pt->dropped;
+	pthread_mutex_unlock(&pt->mutex);
+	dprintf(out, _("Mode:\t%s\nPassed through:\t%" PRIu64 " bytes\nDropped (target not ready):\t%" PRIu64 " bytes\n"),
+			modes[pt->mode],
+			bytes,
+			dropped);
+}
@@ -0,0 +1,42 @@
+#ifndef _PASSTHROUGH_H
+#define _PASSTHROUGH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+enum passthrough_mode {
+	/* Pipe to pipe with tee(2): nothing is copied through extmc. */
+	PASSTHROUGH_TEE,
+	/* Pipe to file with tee(2) into a spare pipe, then splice(2). */
+	PASSTHROUGH_SPLICE,
+	/* write(2) of what was read, e.g. to a terminal or when the input is not a pipe. */
+	PASSTHROUGH_BUFFERED
+};
+
+/*
+ * Copies the raw server output to stdout or a file while it is parsed.
+ * A target that cannot keep up loses data instead of slowing the server down.
+ */
+struct passthrough {
+	enum passthrough_mode mode;
+	int fd;
+	bool close_fd;
+	/* Spare pipe for PASSTHROUGH_SPLICE. */
+	int mid[2];
+	pthread_mutex_t mutex;
+	uint64_t bytes;
+	uint64_t dropped;
+};
+
+/* target is "-" for stdout or a file to append to. */
+int passthrough_init(struct passthrough *pt, int in_fd, const char *target);
+void passthrough_free(struct passthrough *pt);
+
+/* Like read(2), and also passes what was read through. */
+ssize_t passthrough_read(struct passthrough *pt, int in_fd, void *buf, size_t len);
+
+void passthrough_dump(struct passthrough *pt, int out);
+
+#endif // _PASSTHROUGH_H
@@ -7,28 +7,197 @@
 
 #include "common.h"
 #include <stdint.h>
+#include <stddef.h>
 
 /* When the administrator disabled rcon. The plugin must have a way to avoid using rcon since it is non-recoverable. */
 #define EPG_RCON_DISABLED	-1
+/* When the server did not answer in time. The connection is dropped and a new one is used for the next command. */
+#define EPG_RCON_TIMEOUT	-2
+/* A deferred command is held until rcon is back. Not an error. */
+#define EPG_RCON_QUEUED	1
 
-/* 32-bit unsigned integer to indicate the version of the API. */
+/* rcon priority lanes. Commands in a higher lane are sent first when the core is rate limiting. */
+#define EPG_RCON_PRIO_HIGH	0
+#define EPG_RCON_PRIO_NORMAL	1
+#define EPG_RCON_PRIO_LOW	2
+
+/* 32-bit unsigned integer to indicate the version of the API: 1, or 2 to export epg_plugin. */
 extern const uint32_t epg_version;
 
-/* Plugin display name. */
+/* Plugin display name. Version 1 only. */
 extern const char *epg_name;
 
-/* NULL terminated unique ID */
+/* NULL terminated unique ID. Version 1 only. */
 extern const char *epg_id;
 
+/* Events of epg_plugin.events. */
+#define EPG_EVENT_PLAYER_JOIN	(1u << 0)
+#define EPG_EVENT_PLAYER_LEAVE	(1u << 1)
+#define EPG_EVENT_PLAYER_ACHIEVEMENT	(1u << 2)
+#define EPG_EVENT_PLAYER_CHALLENGE	(1u << 3)
+#define EPG_EVENT_PLAYER_GOAL	(1u << 4)
+#define EPG_EVENT_PLAYER_SAY	(1u << 5)
+#define EPG_EVENT_PLAYER_DIE	(1u << 6)
+#define EPG_EVENT_SERVER_STOPPING	(1u << 7)
+#define EPG_EVENT_SERVER_STARTING	(1u << 8)
+#define EPG_EVENT_SERVER_STARTED	(1u << 9)
+#define EPG_EVENT_ALL	((1u << 10) - 1)
+
+/* Filter kinds of epg_handle.filter_add. */
+/* The player is one of the values. Player events only. */
+#define EPG_FILTER_PLAYER	0
+/* The text starts with one of the values. The text is the chat message, leave reason, advancement,
+ * challenge, goal, death source, server version or startup time. */
+#define EPG_FILTER_PREFIX	1
+/* The text is one of the values. */
+#define EPG_FILTER_EXACT	2
+/* What killed the player is one of the values, "" for nothing. player_die only. */
+#define EPG_FILTER_DEATH_CAUSE	3
+
+/* Chat messages starting with this character are commands, see epg_handle.command_register. */
+#define EPG_COMMAND_PREFIX	'!'
+/* Longest command name. */
+#define EPG_COMMAND_NAME_MAX	32
+
+/* Concurrency of the event handlers of a plugin, epg_plugin.concurrency. */
+/* Handlers may run at the same time on any workers. */
+#define EPG_CONCURRENCY_REENTRANT	0
+/* One handler at a time, in event order, on any worker. Version 1 plugins are serialized. */
+#define EPG_CONCURRENCY_SERIALIZED	1
+/* One handler at a time, in event order, always on the same thread, which belongs to the plugin.
+ * load and unload still run on the threads documented for epg_load and epg_unload. */
+#define EPG_CONCURRENCY_PINNED	2
+
+/* An online player as tracked by the core. */
+struct epg_player {
+	const char *name;
+	/* Seconds since the epoch. Players found by reconciliation get the time they were found. */
+	int64_t joined;
+	/* Seconds since the epoch of the last chat message, 0 if none. */
+	int64_t last_chat;
+	/* Deaths since joining. */
+	uint32_t deaths;
+};
+
+/* Immutable snapshot of the online players, sorted by name. */
+struct epg_players {
+	size_t count;
+	const struct epg_player *players;
+};
+
 /* Current session handle. */
 struct epg_handle {
 	/* Unique ID. */
 	const char *id;
 	/* Send rcon command. */
 	int (*rcon_send)(int, char *);
+	/* Receive into a buffer of RCON_DATA_BUFFSIZE bytes. Gives up with EPG_RCON_TIMEOUT after 30 seconds. */
 	int (*rcon_recv)(int *, char *);
+	/* Set the priority lane of the following rcon commands in the current call. Defaults to EPG_RCON_PRIO_NORMAL. */
+	int (*rcon_priority)(int);
+	/* Send a command and wait for its whole reply. The call returns within timeout_ms milliseconds,
+	 * waiting for the rate limit, a free connection and connecting included.
+	 * The reply is truncated to out_cap - 1 bytes and NULL terminated. out_len receives its full length.
+	 * Returns EPG_RCON_TIMEOUT when the server does not answer in time. */
+	int (*rcon_exec)(const char *cmd, int timeout_ms, char *out, size_t out_cap, size_t *out_len);
+	/* Like rcon_exec, but lends the reply instead of copying it. data is read-only, NULL terminated
+	 * and stays valid until the next rcon call of this plugin call or rcon_release(). */
+	int (*rcon_exec_view)(const char *cmd, int timeout_ms, const char **data, size_t *len);
+	/* Like rcon_exec, but the whole reply is returned in a malloc'ed buffer which the caller frees. */
+	int (*rcon_exec_dup)(const char *cmd, int timeout_ms, char **out, size_t *len);
+	/* Like rcon_recv, but lends the packet body the same way as rcon_exec_view. */
+	int (*rcon_recv_view)(int *pkt_id, const char **data, size_t *len);
+	/* Return the rcon connection before the plugin call ends. Invalidates views. */
+	void (*rcon_release)();
+	/* Run a command whose reply does not matter and which may run later. If rcon is down, it is held
+	 * (on disk with RCON_QUEUE_PATH) and sent in order once the server is back, then EPG_RCON_QUEUED
+	 * is returned instead of failing. The command must not contain a newline. */
+	int (*rcon_defer)(const char *cmd);
+	/* Take a snapshot of the online players. It never changes, so it can be read without locking,
+	 * even after this call returns. Pass it to players_release() when done. */
+	const struct epg_players *(*players_acquire)();
+	void (*players_release)(const struct epg_players *players);
+	/* Look up a player in a snapshot. NULL if not online. */
+	const struct epg_player *(*players_find)(const struct epg_players *players, const char *name);
+	/* Declare the score of a holder in an objective. The core keeps the last applied scores and only
+	 * sends changes, batched over rcon. Scores are applied again after the server started. Returns 64
+	 * if a name is empty or contains whitespace. */
+	int (*score_set)(const char *objective, const char *holder, int value);
+	/* Declare that the holder has no score in the objective. */
+	int (*score_reset)(const char *objective, const char *holder);
+	/* Run many commands whose replies do not matter, in order. With a console, they are written to it.
+	 * Otherwise they are pipelined over rcon. Returns once all commands ran, or EPG_RCON_TIMEOUT after
+	 * timeout_ms like rcon_exec. */
+	int (*rcon_batch)(const char *const *commands, size_t count, int timeout_ms);
+	/* Write a command to the server console when extmc started the server ('extmc run').
+	 * Faster than rcon, without its length limit, but there is no reply. Returns EPG_RCON_DISABLED
+	 * without a console. rcon_defer, rcon_batch and scores use the console when there is one. */
+	int (*console_send)(const char *cmd);
+	/* Only call the handlers of events (EPG_EVENT_*) when they pass a filter, instead of for every event.
+	 * Events that do not pass are skipped by the core and never scheduled. An event passes when
+	 * it matches one value of each kind (EPG_FILTER_*) added. Only during epg_load. Returns 64 if the
+	 * kind does not apply to one of the events. */
+	int (*filter_add)(uint32_t events, int kind, const char *value);
+	/* Call handler when a player says EPG_COMMAND_PREFIX followed by name, like "!home", instead of
+	 * parsing every chat message. The core splits the message at spaces once: argv[0] is the name,
+	 * followed by the arguments, and argv[argc] is NULL. Unless max_args is -1 or 0, argument
+	 * max_args takes the rest of the message, spaces included. A command with fewer than min_args
+	 * arguments, or with any when max_args is 0, is ignored. player_say still sees the message.
+	 * The handler runs like the other handlers of the plugin. Only during epg_load.
+	 * Returns EEXIST if the command belongs to another plugin, 64 for an invalid name or arity. */
+	int (*command_register)(const char *name, int min_args, int max_args,
+			int (*handler)(struct epg_handle *handle, char *player, int argc, char **argv));
+	/* Call callback(handle, arg) after delay_ms, then every interval_ms unless it is 0, instead of
+	 * sleeping in a handler or starting a thread. Timers have a resolution of 10 ms and missed periods
+	 * are skipped. The callback runs like the other handlers of the plugin, its return value is
+	 * ignored. The timer ID is stored in id unless it is NULL. Timers are cancelled on unload. */
+	int (*timer_add)(uint32_t delay_ms, uint32_t interval_ms,
+			int (*callback)(struct epg_handle *handle, void *arg), void *arg, uint64_t *id);
+	/* A callback already running finishes. Returns ENOENT if the plugin has no such timer. */
+	int (*timer_cancel)(uint64_t id);
+	/* Send a command and return without waiting for its reply, so the worker is free for other events
+	 * meanwhile. callback(handle, status, data, len, arg) runs once the reply arrived, like the other
+	 * handlers of the plugin. status is 0, EPG_RCON_TIMEOUT or why the command could not be sent.
+	 * data is NULL terminated and valid during the callback. The commands of all plugins are
+	 * pipelined on one connection and answered in order. The callback is skipped if the plugin is
+	 * unloaded first. The rate limits apply when the command is sent, so this never waits for them.
+	 * Returns 64 for a timeout of 0 or less or a command that is too long, ENOSPC while 1024 commands
+	 * wait to be sent. */
+	int (*rcon_exec_async)(const char *cmd, int timeout_ms,
+			int (*callback)(struct epg_handle *handle, int status, const char *data, size_t len, void *arg), void *arg);
 };
 
+/* Version 2: everything the core needs in a single export, resolved with one lookup.
+ * Handlers have the same contract as the version 1 functions below. NULL if not handled. */
+struct epg_plugin {
+	/* NULL terminated unique ID. */
+	const char *id;
+	/* Display name. */
+	const char *name;
+	/* Events to call handlers for, EPG_EVENT_*. */
+	uint32_t events;
+	/* EPG_CONCURRENCY_*. */
+	uint32_t concurrency;
+	/* How long a handler is expected to run at most, in milliseconds. Slower calls are reported.
+	 * 0 if unknown. */
+	uint32_t max_latency_ms;
+	int (*load)(struct epg_handle *handle);
+	int (*unload)(struct epg_handle *handle);
+	int (*player_join)(struct epg_handle *handle, char *player);
+	int (*player_leave)(struct epg_handle *handle, char *player, char *reason);
+	int (*player_say)(struct epg_handle *handle, char *player, char *content);
+	int (*player_die)(struct epg_handle *handle, char *player, char *source);
+	int (*player_achievement)(struct epg_handle *handle, char *player, char *challenge);
+	int (*player_challenge)(struct epg_handle *handle, char *player, char *challenge);
+	int (*player_goal)(struct epg_handle *handle, char *player, char *goal);
+	int (*server_stopping)(struct epg_handle *handle);
+	int (*server_starting)(struct epg_handle *handle, char *version);
+	int (*server_started)(struct epg_handle *handle, char *took);
+};
+
+/* Version 2 only. */
+extern const struct epg_plugin epg_plugin;
+
 /* Before the plugin is loaded.
  * Return a non-zero integer to indicate an error and the plugin will be unloaded immediatedly (without calling epg_unload).
  * Thread: main thread (during autoloading) or control socket (during extmcctl operations). */
@@ -39,6 +208,26 @@ int epg_load(struct epg_handle *handle);
  * Thread: main thread (during autoloading) or control socket (during extmcctl operations). */
 int epg_unload(struct epg_handle *handle);
 
+/* Optional, both versions. When extmcctl reload replaces the plugin, after epg_load of the new version.
+ * Returns the state to hand over to the new version. It must not point into the library, which is closed
+ * after epg_unload. The handlers of the plugin may still be running.
+ * Thread: control socket. */
+void *epg_reload_save(struct epg_handle *handle);
+
+/* Optional, both versions. On the new version, after epg_reload_save of the previous one and before it
+ * receives any event. state is what it returned, NULL if it has no epg_reload_save, and belongs to the
+ * new version either way. Return a non-zero integer to keep the previous version: epg_unload is called.
+ * Thread: control socket. */
+int epg_reload_restore(struct epg_handle *handle, void *state);
+
+/*
+ * Isolated plugins (extmcctl load -i, or '-i <path>' in the autoload file) run in a process of their own,
+ * restarted with epg_load if it crashes. Their handlers run one at a time on its main thread, whatever the
+ * concurrency. Only rcon_exec, rcon_exec_view, rcon_exec_dup, rcon_defer, console_send, rcon_priority and
+ * rcon_release work there, made by the core for the plugin: the other calls of the handle return ENOTSUP,
+ * or NULL. They cannot be reloaded, and the result of epg_unload does not keep them loaded.
+ */
+
 /*
  * When a player joins the game.
  * Thread: worker */
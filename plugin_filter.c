@@ -0,0 +1,100 @@
+#include "plugin_filter.h"
+#include "strmap.h"
+#include "plugin/plugin.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct plugin_filter {
+	/* Sets of names and texts. The keys are owned. */
+	struct strmap players;
+	bool players_init;
+	struct strmap texts;
+	bool texts_init;
+	char **prefixes;
+	size_t prefix_count;
+};
+
+static int set_add(struct strmap *set, bool *set_init, const char *value)
+{
+	int r = 0;
+	if(!*set_init)
+	{
+		r = strmap_init(set, 16);
+		if(r) return r;
+		*set_init = true;
+	}
+	if(strmap_get(set, value) != NULL) return 0;
+	char *key = strdup(value);
+	if(key == NULL) return errno;
+	r = strmap_put(set, key, key);
+	if(r) free(key);
+	return r;
+}
+
+static void set_free(struct strmap *set, bool *set_init)
+{
+	if(!*set_init) return;
+	size_t iter = 0;
+	void *value;
+	while(strmap_next(set, &iter, NULL, &value))
+		free(value);
+	strmap_free(set);
+	*set_init = false;
+}
+
+int plugin_filter_add(struct plugin_filter **filter, int kind, const char *value)
+{
+	if(value == NULL) return 64;
+	if(*filter == NULL)
+	{
+		*filter = calloc(1, sizeof(struct plugin_filter));
+		if(*filter == NULL) return errno;
+	}
+	struct plugin_filter *f = *filter;
+	switch(kind)
+	{
+		case EPG_FILTER_PLAYER:
+			return set_add(&f->players, &f->players_init, value);
+		case EPG_FILTER_EXACT:
+		case EPG_FILTER_DEATH_CAUSE:
+			return set_add(&f->texts, &f->texts_init, value);
+		case EPG_FILTER_PREFIX:
+		{
+			char **prefixes_ext = realloc(f->prefixes, (f->prefix_count + 1) * sizeof(char *));
+			if(prefixes_ext == NULL) return errno;
+			f->prefixes = prefixes_ext;
+			f->prefixes[f->prefix_count] = strdup(value);
+			if(f->prefixes[f->prefix_count] == NULL) return errno;
+			f->prefix_count ++;
+			return 0;
+		}
+		default:
+			return 64;
+	}
+}
+
+void plugin_filter_free(struct plugin_filter *filter)
+{
+	if(filter == NULL) return;
+	set_free(&filter->players, &filter->players_init);
+	set_free(&filter->texts, &filter->texts_init);
+	for(size_t i = 0; i < filter->prefix_count; i ++)
+		free(filter->prefixes[i]);
+	free(filter->prefixes);
+	free(filter);
+}
+
+bool plugin_filter_match(const struct plugin_filter *filter, const char *player, const char *text)
+{
+	if(filter->players_init && (player == NULL || strmap_get(&filter->players, player) == NULL))
+		return false;
+	if(filter->texts_init && (text == NULL || strmap_get(&filter->texts, text) == NULL))
+		return false;
+	if(filter->prefix_count == 0) return true;
+	if(text == NULL) return false;
+	for(size_t i = 0; i < filter->prefix_count; i ++)
+		if(!strncmp(text, filter->prefixes[i], strlen(filter->prefixes[i]))) return true;
+	return false;
+}
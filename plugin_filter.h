@@ -0,0 +1,20 @@
+#ifndef _PLUGIN_FILTER_H
+#define _PLUGIN_FILTER_H
+
+#include <stdbool.h>
+
+/*
+ * Filter of the events of one type for one plugin, checked before scheduling the handler.
+ * An event passes if it matches one value of every kind that has values (EPG_FILTER_*).
+ * Not synchronized: built while the plugin loads, read-only afterwards.
+ */
+struct plugin_filter;
+
+/* Creates the filter if *filter is NULL. */
+int plugin_filter_add(struct plugin_filter **filter, int kind, const char *value);
+void plugin_filter_free(struct plugin_filter *filter);
+
+/* player and text are the first and second arguments of the event, text may be NULL. */
+bool plugin_filter_match(const struct plugin_filter *filter, const char *player, const char *text);
+
+#endif // _PLUGIN_FILTER_H
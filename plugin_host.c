@@ -0,0 +1,921 @@
+#include "plugin_host.h"
+#include "plugin_registry.h"
+#include "host_ring.h"
+#include "rcon_host.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* The shared memory in the host process. */
+#define HOST_SHM_FD	3
+/* How often a waiting side checks that the other one is still there. */
+#define HOST_POLL_MS	100
+
+/* Requests of a host. */
+enum host_request {
+	/* struct host_hello, then the ID and the name. Answered once the core wants epg_load to run. */
+	HOST_HELLO,
+	/* int32_t result of epg_load. */
+	HOST_LOADED,
+	/* int32_t result of epg_unload. */
+	HOST_UNLOADED,
+	/* struct host_call, then the command. The reply is the one of the server. */
+	HOST_RCON_EXEC,
+	HOST_RCON_DEFER,
+	HOST_CONSOLE_SEND
+};
+
+struct host_hello {
+	uint32_t events;
+	uint32_t concurrency;
+	uint32_t max_latency_ms;
+};
+
+struct host_call {
+	int32_t lane;
+	/* Of the call in the host, on CLOCK_MONOTONIC, which both processes share. 0 for none. */
+	int64_t deadline_ms;
+};
+
+struct plugin_host {
+	char *path;
+	/* From the hello of the first host. */
+	char *id;
+	char *name;
+	int fd;
+	struct host_shm *shm;
+	/* The request being served, copied out of shm: HOST_MAIL_SIZE + 1 bytes. */
+	char *request;
+	/* The plugin the calls of the host are made as, once it is loaded. */
+	plugin_ref ref;
+	pthread_t thread;
+	bool thread_init;
+	char thread_name[16];
+	/* Updated by the dispatch only. */
+	uint64_t posted;
+	uint64_t dropped;
+	pthread_mutex_t mutex;
+	/* Guarded by mutex. */
+	pid_t pid;
+	bool stopping;
+	uint64_t restarts;
+	uint64_t calls;
+	int64_t started_ms;
+	int restart_ms;
+};
+
+static int64_t now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Runs in the forked child: only async-signal-safe calls. */
+static void host_exec(char *const *argv, int fd)
+{
+	/* SIGINT and SIGTERM stay blocked: the core stops the host, after the events it has. */
+	if(fd == HOST_SHM_FD)
+	{
+		if(fcntl(fd, F_SETFD, 0) == -1) _exit(127);
+	}
+	else if(dup2(fd, HOST_SHM_FD) == -1)
+	{
+		_exit(127);
+	}
+	/* The server output may be the standard input of the core. */
+	const int null_fd = open("/dev/null", O_RDONLY);
+	if(null_fd == -1 || dup2(null_fd, STDIN_FILENO) == -1) _exit(127);
+	long max = sysconf(_SC_OPEN_MAX);
+	if(max < 0 || max > 65536) max = 65536;
+	for(int i = HOST_SHM_FD + 1; i < max; i ++) close(i);
+	execv("/proc/self/exe", argv);
+	static const char msg[] = "extmc: Cannot start the plugin host.\n";
+	write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	_exit(127);
+}
+
+static int host_start(struct plugin_host *host)
+{
+	char core_pid[24];
+	snprintf(core_pid, sizeof(core_pid), "%d", (int)getpid());
+	char *const argv[] = { "extmc", "plugin-host", host->path, core_pid, NULL };
+	host_mail_reset(host->shm);
+	const pid_t pid = fork();
+	if(pid == -1) return errno;
+	if(pid == 0) host_exec(argv, host->fd);
+	pthread_mutex_lock(&host->mutex);
+	host->pid = pid;
+	host->started_ms = now_ms();
+	pthread_mutex_unlock(&host->mutex);
+	return 0;
+}
+
+/* Kill the host and wait for it, unless it is gone already. */
+static void host_kill(struct plugin_host *host)
+{
+	pthread_mutex_lock(&host->mutex);
+	const pid_t pid = host->pid;
+	host->pid = -1;
+	pthread_mutex_unlock(&host->mutex);
+	if(pid == -1) return;
+	int status;
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+}
+
+static bool host_stopping(struct plugin_host *host)
+{
+	pthread_mutex_lock(&host->mutex);
+	const bool stopping = host->stopping;
+	pthread_mutex_unlock(&host->mutex);
+	return stopping;
+}
+
+/* Make a call of the host as plugin. */
+static void host_serve(struct plugin_host *host, const struct plugin *plugin, uint32_t kind, const char *data, size_t len)
+{
+	struct host_call call;
+	if(len <= sizeof(struct host_call) || data[len - 1] != '\0')
+	{
+		host_mail_reply(host->shm, 64, NULL, 0);
+		return;
+	}
+	memcpy(&call, data, sizeof(struct host_call));
+	const char *command = &data[sizeof(struct host_call)];
+	struct epg_handle handle;
+	plugcall_setup_handle(plugin, &handle);
+	int r = handle.rcon_priority(call.lane);
+	if(!r)
+	{
+		switch(kind)
+		{
+			case HOST_RCON_EXEC:
+			{
+				const char *reply = NULL;
+				size_t reply_len = 0;
+				/* The request may have waited for this thread: only the rest of the timeout is left. */
+				const int64_t left = call.deadline_ms - now_ms();
+				if(left <= 0) r = EPG_RCON_TIMEOUT;
+				else r = handle.rcon_exec_view(command, left > INT32_MAX ? INT32_MAX : (int)left, &reply, &reply_len);
+				/* Copied out before the connection is released. */
+				host_mail_reply(host->shm, r, reply, reply_len);
+				rcon_host_release();
+				goto cleanup;
+			}
+			case HOST_RCON_DEFER:
+				r = handle.rcon_defer(command);
+				break;
+			case HOST_CONSOLE_SEND:
+				r = handle.console_send(command);
+				break;
+			default:
+				r = 64;
+				break;
+		}
+	}
+	rcon_host_release();
+	host_mail_reply(host->shm, r, NULL, 0);
+	goto cleanup;
+cleanup:
+	pthread_mutex_lock(&host->mutex);
+	host->calls ++;
+	pthread_mutex_unlock(&host->mutex);
+}
+
+/*
+ * Wait for a request of kind from the host, which is left unanswered, and make its other calls as plugin
+ * meanwhile. Gives up with ETIMEDOUT after PLUGIN_HOST_TIMEOUT without a request, ECHILD if the host
+ * exited, EPROTO if it sent an invalid request, or ECANCELED if the host is stopping and check_stopping
+ * is set.
+ */
+static int host_wait_for(int stderr_fd, struct plugin_host *host, const struct plugin *plugin, uint32_t kind,
+		bool check_stopping, const char **data, size_t *len)
+{
+	int64_t deadline = now_ms() + PLUGIN_HOST_TIMEOUT;
+	while(true)
+	{
+		uint32_t request;
+		const int r = host_mail_wait(host->shm, HOST_POLL_MS, &request, host->request, len);
+		if(r == EPROTO)
+		{
+			dprintf(stderr_fd, _("The plugin host of %s sent an invalid request.\n"), host->path);
+			return EPROTO;
+		}
+		if(!r)
+		{
+			*data = host->request;
+			if(request == kind) return 0;
+			if(plugin == NULL) host_mail_reply(host->shm, 64, NULL, 0);
+			else host_serve(host, plugin, request, *data, *len);
+			deadline = now_ms() + PLUGIN_HOST_TIMEOUT;
+			continue;
+		}
+		int status;
+		if(host->pid != -1 && waitpid(host->pid, &status, WNOHANG) == host->pid)
+		{
+			pthread_mutex_lock(&host->mutex);
+			host->pid = -1;
+			pthread_mutex_unlock(&host->mutex);
+			if(WIFEXITED(status))
+				dprintf(stderr_fd, _("The plugin host of %s exited with %d.\n"), host->path, WEXITSTATUS(status));
+			else
+				dprintf(stderr_fd, _("The plugin host of %s was killed by signal %d.\n"), host->path, WTERMSIG(status));
+			return ECHILD;
+		}
+		if(check_stopping && host_stopping(host)) return ECANCELED;
+		if(now_ms() >= deadline)
+		{
+			dprintf(stderr_fd, _("The plugin host of %s did not answer in time.\n"), host->path);
+			return ETIMEDOUT;
+		}
+	}
+}
+
+/* Wait for the hello of a new host. The first one describes the plugin to out. */
+static int host_wait_hello(int stderr_fd, struct plugin_host *host, struct plugin *out, bool check_stopping)
+{
+	const char *data;
+	size_t len;
+	int r = host_wait_for(stderr_fd, host, NULL, HOST_HELLO, check_stopping, &data, &len);
+	if(r) return r;
+	struct host_hello hello;
+	const char *id = &data[sizeof(struct host_hello)];
+	const char *name = len > sizeof(struct host_hello) ? memchr(id, '\0', len - sizeof(struct host_hello)) : NULL;
+	if(name == NULL || data[len - 1] != '\0' || ++ name == &data[len])
+	{
+		dprintf(stderr_fd, _("The plugin host of %s sent an invalid hello.\n"), host->path);
+		return 64;
+	}
+	memcpy(&hello, data, sizeof(struct host_hello));
+	if(out == NULL)
+	{
+		/* A restart: the library may have been replaced, but it must still be the same plugin. */
+		if(strcmp(id, host->id))
+		{
+			dprintf(stderr_fd, _("%s is plugin '%s' now, not '%s'.\n"), host->path, id, host->id);
+			return 64;
+		}
+		return 0;
+	}
+	host->id = strdup(id);
+	host->name = strdup(name);
+	if(host->id == NULL || host->name == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		return r;
+	}
+	out->id = host->id;
+	out->name = host->name;
+	out->events = hello.events & EPG_EVENT_ALL;
+	out->concurrency = hello.concurrency;
+	out->max_latency_ms = hello.max_latency_ms;
+	return 0;
+}
+
+/* Let the host waiting in its hello run epg_load, making its calls as plugin. */
+static int host_load(int stderr_fd, struct plugin_host *host, const struct plugin *plugin, bool check_stopping)
+{
+	const char *data;
+	size_t len;
+	host_mail_reply(host->shm, 0, NULL, 0);
+	int r = host_wait_for(stderr_fd, host, plugin, HOST_LOADED, check_stopping, &data, &len);
+	if(r) return r;
+	int32_t result = 64;
+	if(len == sizeof(int32_t)) memcpy(&result, data, sizeof(int32_t));
+	host_mail_reply(host->shm, 0, NULL, 0);
+	if(result) dprintf(stderr_fd, _("Cannot load plugin: it returned an error: %d.\n"), result);
+	return result;
+}
+
+/* Start the host again after it crashed, until it loads or the host is stopping. */
+static void host_restart(struct plugin_host *host, int status)
+{
+	if(WIFEXITED(status))
+		fprintf(stderr, _("The plugin host of %s exited with %d. Restarting it.\n"), host->id, WEXITSTATUS(status));
+	else
+		fprintf(stderr, _("The plugin host of %s was killed by signal %d. Restarting it.\n"), host->id, WTERMSIG(status));
+	while(true)
+	{
+		pthread_mutex_lock(&host->mutex);
+		host->pid = -1;
+		/* Back off from a plugin that crashes right away. */
+		if(now_ms() - host->started_ms < PLUGIN_HOST_STABLE_MS)
+			host->restart_ms = host->restart_ms * 2 > PLUGIN_HOST_RESTART_MAX_MS ? PLUGIN_HOST_RESTART_MAX_MS : host->restart_ms * 2;
+		else
+			host->restart_ms = PLUGIN_HOST_RESTART_MS;
+		const int64_t restart_at = now_ms() + host->restart_ms;
+		pthread_mutex_unlock(&host->mutex);
+		while(now_ms() < restart_at)
+		{
+			if(host_stopping(host)) return;
+			const struct timespec poll_interval = { 0, HOST_POLL_MS * 1000000L };
+			nanosleep(&poll_interval, NULL);
+		}
+		int r = host_start(host);
+		if(r)
+		{
+			fprintf(stderr, _("Cannot fork: %d.\n"), r);
+			continue;
+		}
+		r = host_wait_hello(2, host, NULL, true);
+		if(!r)
+		{
+			struct plugin *plugin = plugin_acquire(host->ref);
+			if(plugin == NULL) return;
+			r = host_load(2, host, plugin, true);
+			plugin_release(plugin);
+		}
+		if(!r) break;
+		host_kill(host);
+		if(r == ECANCELED) return;
+	}
+	pthread_mutex_lock(&host->mutex);
+	host->restarts ++;
+	pthread_mutex_unlock(&host->mutex);
+	printf(_("Restarted the plugin host of %s.\n"), host->id);
+}
+
+/* Make the calls of a loaded host and restart it when it crashes. */
+static void *host_main(void *arg)
+{
+	struct plugin_host *host = arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	thread_set_name(host->thread_name);
+	rcon_host_own();
+	while(!host_stopping(host))
+	{
+		uint32_t kind;
+		size_t len;
+		const int r = host_mail_wait(host->shm, HOST_POLL_MS, &kind, host->request, &len);
+		if(!r)
+		{
+			struct plugin *plugin = plugin_acquire(host->ref);
+			if(plugin == NULL)
+			{
+				host_mail_reply(host->shm, EPG_RCON_DISABLED, NULL, 0);
+				continue;
+			}
+			host_serve(host, plugin, kind, host->request, len);
+			plugin_release(plugin);
+			continue;
+		}
+		int status;
+		if(r == EPROTO && host->pid != -1)
+		{
+			/* It wrote over its own mapping: treated as a crash. */
+			fprintf(stderr, _("The plugin host of %s sent an invalid request.\n"), host->id);
+			kill(host->pid, SIGKILL);
+			waitpid(host->pid, &status, 0);
+			host_restart(host, status);
+			continue;
+		}
+		if(host->pid != -1 && waitpid(host->pid, &status, WNOHANG) == host->pid)
+			host_restart(host, status);
+	}
+	return NULL;
+}
+
+int plugin_host_spawn(int stderr_fd, const char *path, struct plugin *out)
+{
+	int r = 0;
+	struct plugin_host *host = calloc(1, sizeof(struct plugin_host));
+	if(host == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		return r;
+	}
+	host->fd = -1;
+	host->pid = -1;
+	host->restart_ms = PLUGIN_HOST_RESTART_MS;
+	pthread_mutex_init(&host->mutex, NULL);
+	out->host = host;
+	host->path = strdup(path);
+	host->request = malloc(HOST_MAIL_SIZE + 1);
+	if(host->path == NULL || host->request == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	r = host_shm_create(&host->fd, &host->shm);
+	if(r)
+	{
+		dprintf(stderr_fd, _("Cannot create the shared memory of the plugin host: %s.\n"), strerror(r));
+		host->shm = NULL;
+		goto cleanup;
+	}
+	r = host_start(host);
+	if(r)
+	{
+		dprintf(stderr_fd, _("Cannot fork: %d.\n"), r);
+		goto cleanup;
+	}
+	r = host_wait_hello(stderr_fd, host, out, false);
+	if(r) goto cleanup;
+	snprintf(host->thread_name, sizeof(host->thread_name), "host-%s", host->id);
+	goto cleanup;
+cleanup:
+	return r;
+}
+
+int plugin_host_load(int stderr_fd, const struct plugin *plugin)
+{
+	struct plugin_host *host = plugin->host;
+	int r = host_load(stderr_fd, host, plugin, false);
+	if(r) return r;
+	host->ref = plugin->ref;
+	r = pthread_create(&host->thread, NULL, &host_main, host);
+	if(r)
+	{
+		dprintf(stderr_fd, _("Cannot setup thread: %d\n"), r);
+		return r;
+	}
+	host->thread_init = true;
+	return 0;
+}
+
+int plugin_host_unload(int stderr_fd, const struct plugin *plugin)
+{
+	struct plugin_host *host = plugin->host;
+	pthread_mutex_lock(&host->mutex);
+	host->stopping = true;
+	pthread_mutex_unlock(&host->mutex);
+	if(host->thread_init)
+	{
+		pthread_join(host->thread, NULL);
+		host->thread_init = false;
+	}
+	/* Restarting may have given up. */
+	if(host->pid == -1) return 0;
+	host_ring_stop(host->shm);
+	const char *data;
+	size_t len;
+	/* The host handles what is in the ring first. */
+	const int r = host_wait_for(stderr_fd, host, plugin, HOST_UNLOADED, false, &data, &len);
+	if(r)
+	{
+		host_kill(host);
+		return 0;
+	}
+	int32_t result = 0;
+	if(len == sizeof(int32_t)) memcpy(&result, data, sizeof(int32_t));
+	host_mail_reply(host->shm, 0, NULL, 0);
+	/* Its process is gone either way. */
+	if(result) dprintf(stderr_fd, _("The plugin returned an error on unload: %d.\n"), result);
+	const int64_t deadline = now_ms() + PLUGIN_HOST_TIMEOUT;
+	int status;
+	while(waitpid(host->pid, &status, WNOHANG) != host->pid)
+	{
+		if(now_ms() >= deadline)
+		{
+			host_kill(host);
+			return 0;
+		}
+		const struct timespec poll_interval = { 0, 10 * 1000000L };
+		nanosleep(&poll_interval, NULL);
+	}
+	pthread_mutex_lock(&host->mutex);
+	host->pid = -1;
+	pthread_mutex_unlock(&host->mutex);
+	return 0;
+}
+
+void plugin_host_free(struct plugin_host *host)
+{
+	if(host == NULL) return;
+	pthread_mutex_lock(&host->mutex);
+	host->stopping = true;
+	pthread_mutex_unlock(&host->mutex);
+	if(host->thread_init) pthread_join(host->thread, NULL);
+	host_kill(host);
+	if(host->shm != NULL) host_shm_unmap(host->shm);
+	if(host->fd != -1) close(host->fd);
+	pthread_mutex_destroy(&host->mutex);
+	free(host->path);
+	free(host->request);
+	free(host->id);
+	free(host->name);
+	free(host);
+}
+
+void plugin_host_post(struct plugin_host *host, enum plugin_event event, const struct plugin_call_job_args *args)
+{
+	const char *const argv[HOST_RECORD_ARGS] = { args->arg1, args->arg2, args->arg3, args->arg4, args->arg5 };
+	if(host_ring_push(host->shm, event, argv))
+	{
+		DEBUGF("plugin_host.c#plugin_host_post: The ring of %s is full, dropping the event.\n", host->id);
+		host->dropped ++;
+		return;
+	}
+	host->posted ++;
+}
+
+void plugin_host_dump_header(int out)
+{
+	dprintf(out, _("Plugin\tProcess\tRestarts\tPosted\tDropped\tQueued (bytes)\tCalls\n"));
+}
+
+void plugin_host_dump(int out, const char *id, struct plugin_host *host)
+{
+	pthread_mutex_lock(&host->mutex);
+	const pid_t pid = host->pid;
+	const uint64_t restarts = host->restarts;
+	const uint64_t calls = host->calls;
+	pthread_mutex_unlock(&host->mutex);
+	dprintf(out, "%s\t%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%zu\t%" PRIu64 "\n", id, (int)pid, restarts, host->posted, host->dropped, host_ring_used(host->shm), calls);
+}
+
+/* The host process. It handles one plugin, on its main thread. */
+
+static struct host_shm *shm = NULL;
+static pid_t core_pid;
+/* One request at a time, whichever thread of the plugin makes it. */
+static pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Of the current handler. The plugin calls from its own threads at the normal priority. */
+static int lane = EPG_RCON_PRIO_NORMAL;
+static pthread_key_t key_reply;
+
+struct reply_buffer {
+	char *data;
+	size_t cap;
+};
+
+static void reply_buffer_free(void *arg)
+{
+	struct reply_buffer *buffer = arg;
+	free(buffer->data);
+	free(buffer);
+}
+
+static bool core_alive()
+{
+	return getppid() == core_pid;
+}
+
+/* Make a request and copy the reply to a buffer of the calling thread, valid until its next request. */
+static int host_request(uint32_t kind, const void *data, size_t len, int *status, const char **reply, size_t *reply_len)
+{
+	struct reply_buffer *buffer = pthread_getspecific(key_reply);
+	if(buffer == NULL)
+	{
+		buffer = calloc(1, sizeof(struct reply_buffer));
+		if(buffer == NULL) return errno;
+		pthread_setspecific(key_reply, buffer);
+	}
+	pthread_mutex_lock(&request_mutex);
+	const char *shared;
+	size_t shared_len;
+	int r = host_mail_call(shm, kind, data, len, HOST_POLL_MS * 10, &core_alive, status, &shared, &shared_len);
+	if(!r && buffer->cap < shared_len + 1)
+	{
+		char *data_ext = realloc(buffer->data, shared_len + 1);
+		if(data_ext == NULL) r = errno;
+		else
+		{
+			buffer->data = data_ext;
+			buffer->cap = shared_len + 1;
+		}
+	}
+	if(!r)
+	{
+		memcpy(buffer->data, shared, shared_len + 1);
+		*reply = buffer->data;
+		*reply_len = shared_len;
+	}
+	pthread_mutex_unlock(&request_mutex);
+	return r;
+}
+
+/* A call of the plugin the core makes for it. */
+static int host_command(uint32_t kind, const char *command, int timeout_ms, const char **reply, size_t *reply_len)
+{
+	const size_t command_len = strlen(command) + 1;
+	if(command_len > HOST_MAIL_SIZE - sizeof(struct host_call)) return 64;
+	char *data = malloc(sizeof(struct host_call) + command_len);
+	if(data == NULL) return errno;
+	const struct host_call call = { lane, timeout_ms > 0 ? now_ms() + timeout_ms : 0 };
+	memcpy(data, &call, sizeof(struct host_call));
+	memcpy(&data[sizeof(struct host_call)], command, command_len);
+	int status = 0;
+	const int r = host_request(kind, data, sizeof(struct host_call) + command_len, &status, reply, reply_len);
+	free(data);
+	if(r) return EPG_RCON_DISABLED;
+	return status;
+}
+
+static int host_rcon_exec_view(const char *command, int timeout_ms, const char **data, size_t *len)
+{
+	*data = "";
+	*len = 0;
+	if(timeout_ms <= 0) return 64;
+	const char *reply;
+	size_t reply_len;
+	const int r = host_command(HOST_RCON_EXEC, command, timeout_ms, &reply, &reply_len);
+	if(r) return r;
+	*data = reply;
+	*len = reply_len;
+	return 0;
+}
+
+static int host_rcon_exec(const char *command, int timeout_ms, char *out, size_t out_cap, size_t *out_len)
+{
+	const char *data;
+	size_t len;
+	const int r = host_rcon_exec_view(command, timeout_ms, &data, &len);
+	if(out_cap > 0)
+	{
+		const size_t copy = len < out_cap - 1 ? len : out_cap - 1;
+		memcpy(out, data, copy);
+		out[copy] = '\0';
+	}
+	if(out_len != NULL) *out_len = len;
+	return r;
+}
+
+static int host_rcon_exec_dup(const char *command, int timeout_ms, char **out, size_t *out_len)
+{
+	const char *data;
+	size_t len;
+	*out = NULL;
+	int r = host_rcon_exec_view(command, timeout_ms, &data, &len);
+	if(r) goto cleanup;
+	*out = malloc(len + 1);
+	if(*out == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	memcpy(*out, data, len + 1);
+	goto cleanup;
+cleanup:
+	if(out_len != NULL) *out_len = r ? 0 : len;
+	return r;
+}
+
+static int host_rcon_defer(const char *command)
+{
+	const char *reply;
+	size_t reply_len;
+	return host_command(HOST_RCON_DEFER, command, 0, &reply, &reply_len);
+}
+
+static int host_console_send(const char *command)
+{
+	const char *reply;
+	size_t reply_len;
+	return host_command(HOST_CONSOLE_SEND, command, 0, &reply, &reply_len);
+}
+
+static int host_rcon_priority(int priority)
+{
+	if(priority < EPG_RCON_PRIO_HIGH || priority > EPG_RCON_PRIO_LOW)
+		return 64;
+	lane = priority;
+	return 0;
+}
+
+static void host_rcon_release()
+{
+}
+
+/* What the core cannot do for an isolated plugin. */
+static int host_rcon_send(int pkt_id, char *command)
+{
+	return ENOTSUP;
+}
+
+static int host_rcon_recv(int *pkt_id, char *out)
+{
+	return ENOTSUP;
+}
+
+static int host_rcon_recv_view(int *pkt_id, const char **data, size_t *len)
+{
+	return ENOTSUP;
+}
+
+static const struct epg_players *host_players_acquire()
+{
+	return NULL;
+}
+
+static void host_players_release(const struct epg_players *players)
+{
+}
+
+static const struct epg_player *host_players_find(const struct epg_players *players, const char *name)
+{
+	return NULL;
+}
+
+static int host_score_set(const char *objective, const char *holder, int value)
+{
+	return ENOTSUP;
+}
+
+static int host_score_reset(const char *objective, const char *holder)
+{
+	return ENOTSUP;
+}
+
+static int host_rcon_batch(const char *const *commands, size_t count, int timeout_ms)
+{
+	return ENOTSUP;
+}
+
+static int host_filter_add(uint32_t events, int kind, const char *value)
+{
+	return ENOTSUP;
+}
+
+static int host_command_register(const char *name, int min_args, int max_args,
+		int (*handler)(struct epg_handle *, char *, int, char **))
+{
+	return ENOTSUP;
+}
+
+static int host_timer_add(uint32_t delay_ms, uint32_t interval_ms,
+		int (*callback)(struct epg_handle *, void *), void *arg, uint64_t *id)
+{
+	return ENOTSUP;
+}
+
+static int host_timer_cancel(uint64_t id)
+{
+	return ENOTSUP;
+}
+
+static int host_rcon_exec_async(const char *command, int timeout_ms,
+		int (*callback)(struct epg_handle *, int, const char *, size_t, void *), void *arg)
+{
+	return ENOTSUP;
+}
+
+static void host_setup_handle(const struct plugin *plugin, struct epg_handle *handle)
+{
+	lane = EPG_RCON_PRIO_NORMAL;
+	handle->id = plugin->id;
+	handle->rcon_send = &host_rcon_send;
+	handle->rcon_recv = &host_rcon_recv;
+	handle->rcon_priority = &host_rcon_priority;
+	handle->rcon_exec = &host_rcon_exec;
+	handle->rcon_exec_view = &host_rcon_exec_view;
+	handle->rcon_exec_dup = &host_rcon_exec_dup;
+	handle->rcon_recv_view = &host_rcon_recv_view;
+	handle->rcon_release = &host_rcon_release;
+	handle->rcon_defer = &host_rcon_defer;
+	handle->players_acquire = &host_players_acquire;
+	handle->players_release = &host_players_release;
+	handle->players_find = &host_players_find;
+	handle->score_set = &host_score_set;
+	handle->score_reset = &host_score_reset;
+	handle->rcon_batch = &host_rcon_batch;
+	handle->console_send = &host_console_send;
+	handle->filter_add = &host_filter_add;
+	handle->command_register = &host_command_register;
+	handle->timer_add = &host_timer_add;
+	handle->timer_cancel = &host_timer_cancel;
+	handle->rcon_exec_async = &host_rcon_exec_async;
+}
+
+/* The events the plugin has handlers for. */
+static uint32_t host_events(const struct plugin *plugin)
+{
+	uint32_t events = 0;
+	if(plugin->fc_player_join != NULL) events |= EPG_EVENT_PLAYER_JOIN;
+	if(plugin->fc_player_leave != NULL) events |= EPG_EVENT_PLAYER_LEAVE;
+	if(plugin->fc_player_achievement != NULL) events |= EPG_EVENT_PLAYER_ACHIEVEMENT;
+	if(plugin->fc_player_challenge != NULL) events |= EPG_EVENT_PLAYER_CHALLENGE;
+	if(plugin->fc_player_goal != NULL) events |= EPG_EVENT_PLAYER_GOAL;
+	if(plugin->fc_player_say != NULL) events |= EPG_EVENT_PLAYER_SAY;
+	if(plugin->fc_player_die != NULL) events |= EPG_EVENT_PLAYER_DIE;
+	if(plugin->fc_server_stopping != NULL) events |= EPG_EVENT_SERVER_STOPPING;
+	if(plugin->fc_server_starting != NULL) events |= EPG_EVENT_SERVER_STARTING;
+	if(plugin->fc_server_started != NULL) events |= EPG_EVENT_SERVER_STARTED;
+	return events & plugin->events;
+}
+
+static void host_handle(const struct plugin *plugin, struct epg_handle *handle, struct host_record *record)
+{
+	char **args = record->args;
+	if(record->kind >= PLUGIN_EVENT_COUNT || !(host_events(plugin) & (1u << record->kind))) return;
+	host_setup_handle(plugin, handle);
+	switch(record->kind)
+	{
+		case PLUGIN_EVENT_PLAYER_JOIN: plugin->fc_player_join(handle, args[0]); break;
+		case PLUGIN_EVENT_PLAYER_LEAVE: plugin->fc_player_leave(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_PLAYER_ACHIEVEMENT: plugin->fc_player_achievement(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_PLAYER_CHALLENGE: plugin->fc_player_challenge(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_PLAYER_GOAL: plugin->fc_player_goal(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_PLAYER_SAY: plugin->fc_player_say(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_PLAYER_DIE: plugin->fc_player_die(handle, args[0], args[1]); break;
+		case PLUGIN_EVENT_SERVER_STOPPING: plugin->fc_server_stopping(handle); break;
+		case PLUGIN_EVENT_SERVER_STARTING: plugin->fc_server_starting(handle, args[0]); break;
+		case PLUGIN_EVENT_SERVER_STARTED: plugin->fc_server_started(handle, args[0]); break;
+	}
+}
+
+/* Report a result of epg_load or epg_unload. */
+static int host_result(uint32_t kind, int32_t result)
+{
+	int status;
+	const char *reply;
+	size_t reply_len;
+	const int r = host_request(kind, &result, sizeof(int32_t), &status, &reply, &reply_len);
+	return r ? r : status;
+}
+
+int plugin_host_main(int argc, char **argv)
+{
+	int r = 0;
+	struct plugin plugin;
+	bool plugin_setup = false;
+	struct host_record *record = NULL;
+	char *hello = NULL;
+	if(argc != 4)
+	{
+		fprintf(stderr, _("Usage: extmc plugin-host <path/to/lib.so> <core pid>\n"));
+		return 64;
+	}
+	core_pid = (pid_t)atoi(argv[3]);
+	pthread_key_create(&key_reply, &reply_buffer_free);
+	r = host_shm_map(HOST_SHM_FD, &shm);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot map the shared memory of the plugin host: %s.\n"), strerror(r));
+		goto cleanup;
+	}
+	r = plugin_load_meta(STDERR_FILENO, argv[2], &plugin);
+	if(r) goto cleanup;
+	plugin_setup = true;
+	record = malloc(sizeof(struct host_record));
+	const size_t id_len = strlen(plugin.id) + 1;
+	const size_t name_len = strlen(plugin.name) + 1;
+	hello = malloc(sizeof(struct host_hello) + id_len + name_len);
+	if(record == NULL || hello == NULL)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	const struct host_hello desc = { host_events(&plugin), plugin.concurrency, plugin.max_latency_ms };
+	memcpy(hello, &desc, sizeof(struct host_hello));
+	memcpy(&hello[sizeof(struct host_hello)], plugin.id, id_len);
+	memcpy(&hello[sizeof(struct host_hello) + id_len], plugin.name, name_len);
+	int status;
+	const char *reply;
+	size_t reply_len;
+	r = host_request(HOST_HELLO, hello, sizeof(struct host_hello) + id_len + name_len, &status, &reply, &reply_len);
+	if(!r) r = status;
+	if(r) goto cleanup;
+	struct epg_handle handle;
+	int32_t result = 0;
+	if(plugin.fc_load != NULL)
+	{
+		host_setup_handle(&plugin, &handle);
+		result = plugin.fc_load(&handle);
+	}
+	r = host_result(HOST_LOADED, result);
+	if(!r) r = result;
+	if(r) goto cleanup;
+	while(true)
+	{
+		r = host_ring_pop(shm, record, HOST_POLL_MS * 10);
+		if(r == ESHUTDOWN) break;
+		if(r == ETIMEDOUT)
+		{
+			/* Nobody to unload for. */
+			if(!core_alive()) goto cleanup;
+			continue;
+		}
+		host_handle(&plugin, &handle, record);
+	}
+	result = 0;
+	if(plugin.fc_unload != NULL)
+	{
+		host_setup_handle(&plugin, &handle);
+		result = plugin.fc_unload(&handle);
+	}
+	r = host_result(HOST_UNLOADED, result);
+	goto cleanup;
+cleanup:
+	free(hello);
+	free(record);
+	if(plugin_setup) plugin_unload_meta(STDERR_FILENO, &plugin);
+	return r;
+}
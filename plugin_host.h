@@ -0,0 +1,44 @@
+#ifndef _PLUGIN_HOST_H
+#define _PLUGIN_HOST_H
+
+#include "plugins.h"
+
+#include <stdint.h>
+
+/* How long a plugin host may take to open the library and to run epg_load or epg_unload. */
+#define PLUGIN_HOST_TIMEOUT	10000
+/* A crashed host is restarted after this, doubled on every crash within PLUGIN_HOST_STABLE_MS
+ * of its start, up to PLUGIN_HOST_RESTART_MAX_MS. */
+#define PLUGIN_HOST_RESTART_MS	500
+#define PLUGIN_HOST_RESTART_MAX_MS	30000
+#define PLUGIN_HOST_STABLE_MS	10000
+
+/*
+ * Isolated plugins run in a host process of their own, a copy of extmc started with 'plugin-host', so
+ * that a crash takes down nothing else. Events go to the host through a shared memory ring, without
+ * a worker, and the host sends the rcon calls of the plugin back to the core. The core restarts a host
+ * that crashed. Events sent meanwhile wait in the ring, but the one being handled is lost.
+ */
+struct plugin_host;
+
+/* Start a host for the library at path. It opens the library and describes the plugin: id, name,
+ * events, concurrency and max_latency_ms of out are set, and out->host. epg_load waits for
+ * plugin_host_load. */
+int plugin_host_spawn(int stderr_fd, const char *path, struct plugin *out);
+/* Run epg_load in the host and start serving its calls with the reference of plugin. */
+int plugin_host_load(int stderr_fd, const struct plugin *plugin);
+/* Let the host handle the events it has, run epg_unload and exit. */
+int plugin_host_unload(int stderr_fd, const struct plugin *plugin);
+/* Kill the host if it is still running. */
+void plugin_host_free(struct plugin_host *host);
+
+/* Hand an event to the host. From the dispatch only. Dropped and counted if the ring is full. */
+void plugin_host_post(struct plugin_host *host, enum plugin_event event, const struct plugin_call_job_args *args);
+
+void plugin_host_dump_header(int out);
+void plugin_host_dump(int out, const char *id, struct plugin_host *host);
+
+/* Entry point of the host process: extmc plugin-host <path> <core pid>, with the shared memory as fd 3. */
+int plugin_host_main(int argc, char **argv);
+
+#endif // _PLUGIN_HOST_H
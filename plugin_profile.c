@@ -0,0 +1,115 @@
+#include "plugin_profile.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const call_names[PLUGIN_CALL_COUNT] = {
+	[PLUGIN_EVENT_PLAYER_JOIN] = "player_join",
+	[PLUGIN_EVENT_PLAYER_LEAVE] = "player_leave",
+	[PLUGIN_EVENT_PLAYER_ACHIEVEMENT] = "player_achievement",
+	[PLUGIN_EVENT_PLAYER_CHALLENGE] = "player_challenge",
+	[PLUGIN_EVENT_PLAYER_GOAL] = "player_goal",
+	[PLUGIN_EVENT_PLAYER_SAY] = "player_say",
+	[PLUGIN_EVENT_PLAYER_DIE] = "player_die",
+	[PLUGIN_EVENT_SERVER_STOPPING] = "server_stopping",
+	[PLUGIN_EVENT_SERVER_STARTING] = "server_starting",
+	[PLUGIN_EVENT_SERVER_STARTED] = "server_started",
+	[PLUGIN_CALL_COMMAND] = "command",
+	[PLUGIN_CALL_TIMER] = "timer",
+	[PLUGIN_CALL_RCON_ASYNC] = "rcon_async",
+	[PLUGIN_CALL_LOAD] = "load",
+	[PLUGIN_CALL_UNLOAD] = "unload"
+};
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct plugin_profile *plugin_profile_new()
+{
+	struct plugin_profile *profile = calloc(1, sizeof(struct plugin_profile));
+	if(profile == NULL) return NULL;
+	if(pthread_mutex_init(&profile->mutex, NULL))
+	{
+		free(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+void plugin_profile_free(struct plugin_profile *profile)
+{
+	if(profile == NULL) return;
+	pthread_mutex_destroy(&profile->mutex);
+	free(profile);
+}
+
+void plugin_profile_reset(struct plugin_profile *profile)
+{
+	pthread_mutex_lock(&profile->mutex);
+	memset(profile->calls, 0, sizeof(profile->calls));
+	pthread_mutex_unlock(&profile->mutex);
+}
+
+uint64_t plugin_profile_now()
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+void plugin_profile_start(struct plugin_profile_clock *clock)
+{
+	clock->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	clock->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+uint64_t plugin_profile_end(struct plugin_profile *profile, int call, const struct plugin_profile_clock *clock, uint64_t queued_ns)
+{
+	const uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - clock->cpu_ns;
+	const uint64_t wall = clock_ns(CLOCK_MONOTONIC) - clock->wall_ns;
+	struct plugin_call_profile *p = &profile->calls[call];
+	pthread_mutex_lock(&profile->mutex);
+	p->calls ++;
+	p->cpu_ns += cpu;
+	if(queued_ns != 0) hist_add(&p->wait, clock->wall_ns > queued_ns ? clock->wall_ns - queued_ns : 0);
+	hist_add(&p->wall, wall);
+	hist_add(&p->cpu, cpu);
+	pthread_mutex_unlock(&profile->mutex);
+	return wall;
+}
+
+void plugin_profile_dump_header(int out)
+{
+	dprintf(out, _("Plugin\tCall\tCalls\tCPU (ms)\tCPU p99 (us)\tWall p50 (us)\tWall p99 (us)\tWall max (us)\tWait p50 (us)\tWait p99 (us)\tWait max (us)\n"));
+}
+
+void plugin_profile_dump(int out, const char *id, struct plugin_profile *profile)
+{
+	struct plugin_call_profile calls[PLUGIN_CALL_COUNT];
+	pthread_mutex_lock(&profile->mutex);
+	memcpy(calls, profile->calls, sizeof(calls));
+	pthread_mutex_unlock(&profile->mutex);
+	for(int i = 0; i < PLUGIN_CALL_COUNT; i ++)
+	{
+		const struct plugin_call_profile *p = &calls[i];
+		if(p->calls == 0) continue;
+		dprintf(out, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+				id,
+				call_names[i],
+				p->calls,
+				p->cpu_ns / 1000000,
+				hist_percentile_us(&p->cpu, 0.99),
+				hist_percentile_us(&p->wall, 0.5),
+				hist_percentile_us(&p->wall, 0.99),
+				p->wall.max_ns / 1000,
+				hist_percentile_us(&p->wait, 0.5),
+				hist_percentile_us(&p->wait, 0.99),
+				p->wait.max_ns / 1000);
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef _PLUGIN_PROFILE_H
+#define _PLUGIN_PROFILE_H
+
+#include "plugins.h"
+#include "hist.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Calls of a plugin other than event handlers, after the PLUGIN_EVENT_* ones. */
+enum plugin_call {
+	PLUGIN_CALL_COMMAND = PLUGIN_EVENT_COUNT,
+	PLUGIN_CALL_TIMER,
+	PLUGIN_CALL_RCON_ASYNC,
+	PLUGIN_CALL_LOAD,
+	PLUGIN_CALL_UNLOAD,
+	PLUGIN_CALL_COUNT
+};
+
+struct plugin_call_profile {
+	uint64_t calls;
+	uint64_t cpu_ns;
+	/* Scheduled to started. */
+	struct hist wait;
+	struct hist wall;
+	struct hist cpu;
+};
+
+/* Where the time of one plugin goes, per event and call. */
+struct plugin_profile {
+	pthread_mutex_t mutex;
+	struct plugin_call_profile calls[PLUGIN_CALL_COUNT];
+};
+
+/* Clocks at the start of a call. */
+struct plugin_profile_clock {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+};
+
+struct plugin_profile *plugin_profile_new();
+void plugin_profile_free(struct plugin_profile *profile);
+void plugin_profile_reset(struct plugin_profile *profile);
+
+/* CLOCK_MONOTONIC in nanoseconds, to stamp work when it is scheduled. */
+uint64_t plugin_profile_now();
+void plugin_profile_start(struct plugin_profile_clock *clock);
+/* Account a call that started at clock. queued_ns is when it was scheduled, 0 if it was not.
+ * Returns its wall time. */
+uint64_t plugin_profile_end(struct plugin_profile *profile, int call, const struct plugin_profile_clock *clock, uint64_t queued_ns);
+
+void plugin_profile_dump_header(int out);
+void plugin_profile_dump(int out, const char *id, struct plugin_profile *profile);
+
+#endif // _PLUGIN_PROFILE_H
@@ -0,0 +1,181 @@
+#include "plugin_queue.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+struct plugin_job {
+	void (*call)(void *);
+	void *arg;
+	struct plugin_job *next;
+};
+
+struct plugin_queue {
+	pthread_mutex_t mutex;
+	/* Work for the pinned thread. */
+	pthread_cond_t work_cond;
+	/* The queue became idle. */
+	pthread_cond_t idle_cond;
+	struct plugin_job *head;
+	struct plugin_job *tail;
+	size_t length;
+	/* A job is running, or a drain is scheduled on the pool. */
+	bool running;
+	bool pinned;
+	/* Where drains run. */
+	threadpool thpool;
+	bool quit;
+	bool thread_init;
+	pthread_t thread;
+	char thread_name[16];
+};
+
+/* Caller holds the mutex. */
+static struct plugin_job *pop(struct plugin_queue *queue)
+{
+	struct plugin_job *job = queue->head;
+	if(job == NULL) return NULL;
+	queue->head = job->next;
+	if(queue->head == NULL) queue->tail = NULL;
+	queue->length --;
+	return job;
+}
+
+static void *pinned_main(void *arg)
+{
+	struct plugin_queue *queue = arg;
+	thread_set_name(queue->thread_name);
+	pthread_mutex_lock(&queue->mutex);
+	while(true)
+	{
+		struct plugin_job *job = pop(queue);
+		if(job == NULL)
+		{
+			queue->running = false;
+			pthread_cond_broadcast(&queue->idle_cond);
+			if(queue->quit) break;
+			pthread_cond_wait(&queue->work_cond, &queue->mutex);
+			continue;
+		}
+		queue->running = true;
+		pthread_mutex_unlock(&queue->mutex);
+		job->call(job->arg);
+		free(job);
+		pthread_mutex_lock(&queue->mutex);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return NULL;
+}
+
+struct plugin_queue *plugin_queue_new(const char *id, bool pinned)
+{
+	int r = 0;
+	struct plugin_queue *queue = calloc(1, sizeof(struct plugin_queue));
+	if(queue == NULL) return NULL;
+	queue->pinned = pinned;
+	snprintf(queue->thread_name, sizeof(queue->thread_name), "plugin-%s", id);
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->work_cond, NULL);
+	pthread_cond_init(&queue->idle_cond, NULL);
+	if(!pinned) return queue;
+	r = pthread_create(&queue->thread, NULL, &pinned_main, queue);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		plugin_queue_free(queue);
+		errno = r;
+		return NULL;
+	}
+	queue->thread_init = true;
+	return queue;
+}
+
+void plugin_queue_free(struct plugin_queue *queue)
+{
+	if(queue == NULL) return;
+	plugin_queue_wait(queue);
+	if(queue->thread_init)
+	{
+		pthread_mutex_lock(&queue->mutex);
+		queue->quit = true;
+		pthread_cond_signal(&queue->work_cond);
+		pthread_mutex_unlock(&queue->mutex);
+		pthread_join(queue->thread, NULL);
+	}
+	pthread_cond_destroy(&queue->idle_cond);
+	pthread_cond_destroy(&queue->work_cond);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue);
+}
+
+/* Pool job: run a batch of jobs, then give the worker back. */
+static void drain(void *arg)
+{
+	struct plugin_queue *queue = arg;
+	for(int i = 0; i < PLUGIN_QUEUE_BATCH; i ++)
+	{
+		pthread_mutex_lock(&queue->mutex);
+		struct plugin_job *job = pop(queue);
+		if(job == NULL)
+		{
+			queue->running = false;
+			pthread_cond_broadcast(&queue->idle_cond);
+			pthread_mutex_unlock(&queue->mutex);
+			return;
+		}
+		pthread_mutex_unlock(&queue->mutex);
+		job->call(job->arg);
+		free(job);
+	}
+	/* Still running: only this drain schedules the next one. */
+	DEBUGF("plugin_queue.c#drain: %s yields its worker.\n", queue->thread_name);
+	thpool_add_work(queue->thpool, &drain, queue);
+}
+
+int plugin_queue_push(struct plugin_queue *queue, threadpool thpool, void (*call)(void *), void *arg)
+{
+	struct plugin_job *job = malloc(sizeof(struct plugin_job));
+	if(job == NULL) return errno;
+	job->call = call;
+	job->arg = arg;
+	job->next = NULL;
+	pthread_mutex_lock(&queue->mutex);
+	if(queue->tail == NULL) queue->head = job;
+	else queue->tail->next = job;
+	queue->tail = job;
+	queue->length ++;
+	bool schedule = false;
+	if(queue->pinned)
+	{
+		pthread_cond_signal(&queue->work_cond);
+	}
+	else if(!queue->running)
+	{
+		queue->running = true;
+		queue->thpool = thpool;
+		schedule = true;
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	if(schedule) thpool_add_work(thpool, &drain, queue);
+	return 0;
+}
+
+void plugin_queue_wait(struct plugin_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while(queue->head != NULL || queue->running)
+		pthread_cond_wait(&queue->idle_cond, &queue->mutex);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+size_t plugin_queue_length(struct plugin_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	const size_t length = queue->length;
+	pthread_mutex_unlock(&queue->mutex);
+	return length;
+}
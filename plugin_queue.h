@@ -0,0 +1,28 @@
+#ifndef _PLUGIN_QUEUE_H
+#define _PLUGIN_QUEUE_H
+
+#include "thpool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Jobs of a serialized plugin run on a worker before it moves on to another plugin. */
+#define PLUGIN_QUEUE_BATCH	16
+
+/*
+ * Runs the jobs of one plugin one at a time, in order.
+ * Without pinned, they run on the thread pool, using at most one worker. With pinned, they run on
+ * a thread owned by the queue.
+ */
+struct plugin_queue;
+
+struct plugin_queue *plugin_queue_new(const char *id, bool pinned);
+/* Runs the remaining jobs first. */
+void plugin_queue_free(struct plugin_queue *queue);
+
+int plugin_queue_push(struct plugin_queue *queue, threadpool thpool, void (*call)(void *), void *arg);
+/* Wait until every pushed job ran. */
+void plugin_queue_wait(struct plugin_queue *queue);
+size_t plugin_queue_length(struct plugin_queue *queue);
+
+#endif // _PLUGIN_QUEUE_H
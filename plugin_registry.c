@@ -1,6 +1,17 @@
 #include "plugins.h"
 #include "plugin_registry.h"
 #include "rcon_host.h"
+#include "rcon_sched.h"
+#include "rcon_stats.h"
+#include "session.h"
+#include "rcon_queue.h"
+#include "scoreboard.h"
+#include "batch.h"
+#include "console.h"
+#include "strmap.h"
+#include "timer.h"
+#include "rcon_async.h"
+#include "plugin_profile.h"
 #include "common.h"
 
 #include <stddef.h>
@@ -8,53 +19,97 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define PLUGIN_ID_GEN_MAX_RETRY 1
 
+struct plugin_slot {
+	/* NULL if free. */
+	struct plugin *plugin;
+	/* Bumped on unload, so that references to the previous plugin stop resolving. */
+	uint32_t generation;
+	int next_free;
+};
+
+/* Guards the slots and the running handlers for plugin_acquire. Loading, unloading and reloading are
+ * serialized by the caller. */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* When the handlers of a plugin replaced by a reload have all returned. */
+static pthread_cond_t retire_cond = PTHREAD_COND_INITIALIZER;
+static struct plugin_slot *slots = NULL;
+static int slot_cap = 0;
+static int free_slot = -1;
+/* Plugin ID to plugin. */
+static struct strmap id_index;
+static bool id_index_init = false;
+/* Chat command name to struct plugin_command. */
+static struct strmap command_index;
+static bool command_index_init = false;
+/* Loaded plugins in load order. */
+static struct plugin **plugin_arr = NULL;
 static int plugin_count = 0;
-/* TODO: May use hashing to improve search preformance */
-/* TODO: May use sorting + binary search to improve search performance */
-static const char **id_arr = NULL;
-static struct plugin *plugin_arr = NULL;
+/* Per event, with room for every plugin. */
+static struct plugin_subscriber *subscriber_arr[PLUGIN_EVENT_COUNT];
+static size_t subscriber_count[PLUGIN_EVENT_COUNT];
+static int subscriber_cap = 0;
+/* The plugin in epg_load, which may add filters. */
+static struct plugin *loading = NULL;
+/* The plugin being reloaded, whose commands the new version may register again. */
+static const struct plugin *replacing = NULL;
+/* The instance in epg_load, or loaded by a reload but not swapped in yet. Its timers and replies wait
+ * until it is reachable. Guarded by registry_mutex. */
+static uint64_t pending = 0;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t instance_seq = 0;
 static pthread_key_t key_plugin;
-
-static void arr_resize(int new_size)
-{
-	if(new_size == 0)
-	{
-		if(id_arr != NULL)
-		{
-			free(id_arr);
-			id_arr = NULL;
-		}
-		if(plugin_arr != NULL)
-		{
-			free(plugin_arr);
-			plugin_arr = NULL;
-		}
-		return;
-	}
-	if(id_arr == NULL)
-		id_arr = calloc(new_size, sizeof(char *));
-	else
-		id_arr = realloc(id_arr, new_size * sizeof(char *));
-	if(plugin_arr == NULL)
-		plugin_arr = calloc(new_size, sizeof(struct plugin));
-	else
-		plugin_arr = realloc(plugin_arr, new_size * sizeof(struct plugin));
-}
+static pthread_key_t key_lane;
+/* When the calling thread last sent a command, for the round-trip time of rcon_recv. */
+static pthread_key_t key_rcon_sent;
 
 int plugin_registry_init()
 {
+	int r = strmap_init(&id_index, 16);
+	if(r) return r;
+	id_index_init = true;
+	r = strmap_init(&command_index, 64);
+	if(r) return r;
+	command_index_init = true;
 	pthread_key_create(&key_plugin, NULL);
+	pthread_key_create(&key_lane, NULL);
+	pthread_key_create(&key_rcon_sent, &free);
 	return 0;
 }
 
 void plugin_registry_free()
 {
+	for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+	{
+		free(subscriber_arr[i]);
+		subscriber_arr[i] = NULL;
+		subscriber_count[i] = 0;
+	}
+	subscriber_cap = 0;
+	for(int i = 0; i < plugin_count; i ++)
+		free(plugin_arr[i]);
+	free(plugin_arr);
+	plugin_arr = NULL;
 	plugin_count = 0;
-	arr_resize(0);
+	free(slots);
+	slots = NULL;
+	slot_cap = 0;
+	free_slot = -1;
+	if(id_index_init) strmap_free(&id_index);
+	id_index_init = false;
+	if(command_index_init) strmap_free(&command_index);
+	command_index_init = false;
 	pthread_key_delete(key_plugin);
+	pthread_key_delete(key_lane);
+	pthread_key_delete(key_rcon_sent);
 }
 
 int plugin_size()
@@ -62,56 +117,304 @@ int plugin_size()
 	return plugin_count;
 }
 
-static int plugin_id_to_index(const char *id)
+struct plugin *plugin_get(const char *id)
 {
-	for(int i = 0; i < plugin_count; i ++)
+	return strmap_get(&id_index, id);
+}
+
+struct plugin *plugin_get_by_index(int index)
+{
+	return plugin_arr[index];
+}
+
+struct plugin *plugin_acquire(plugin_ref ref)
+{
+	const int slot = (int)(ref & 0xffffffff);
+	const uint32_t generation = (uint32_t)(ref >> 32);
+	struct plugin *plugin = NULL;
+	pthread_mutex_lock(&registry_mutex);
+	if(slot < slot_cap && slots[slot].generation == generation)
+		plugin = slots[slot].plugin;
+	if(plugin != NULL) plugin->running ++;
+	pthread_mutex_unlock(&registry_mutex);
+	return plugin;
+}
+
+/* Resolve ref for the timers and replies of instance, which are skipped once it is gone. Those due before
+ * the instance is reachable wait for it, and those of a version being replaced still get it. */
+static struct plugin *plugin_acquire_instance(plugin_ref ref, uint64_t instance)
+{
+	const int slot = (int)(ref & 0xffffffff);
+	const uint32_t generation = (uint32_t)(ref >> 32);
+	struct plugin *plugin = NULL;
+	pthread_mutex_lock(&registry_mutex);
+	while(true)
 	{
-		if(!strcmp(id_arr[i], id))
-			return i;
+		if(slot < slot_cap && slots[slot].generation == generation && slots[slot].plugin != NULL &&
+				slots[slot].plugin->instance == instance)
+			plugin = slots[slot].plugin;
+		else if(replacing != NULL && replacing->instance == instance)
+			plugin = (struct plugin *)replacing;
+		else if(pending == instance)
+		{
+			pthread_cond_wait(&pending_cond, &registry_mutex);
+			continue;
+		}
+		break;
 	}
-	return -1;
+	if(plugin != NULL) plugin->running ++;
+	pthread_mutex_unlock(&registry_mutex);
+	return plugin;
 }
 
-struct plugin *plugin_get(const char *id)
+/* Caller holds registry_mutex. 0 when the pending instance became reachable or was dropped. */
+static void pending_set(uint64_t instance)
 {
-	const int index = plugin_id_to_index(id);
-	if(index < 0)
-		return NULL;
-	return &plugin_arr[index];
+	pending = instance;
+	pthread_cond_broadcast(&pending_cond);
 }
 
-struct plugin *plugin_get_by_index(int index)
+void plugin_release(struct plugin *plugin)
+{
+	pthread_mutex_lock(&registry_mutex);
+	plugin->running --;
+	if(plugin->running == 0 && plugin == replacing) pthread_cond_broadcast(&retire_cond);
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+const struct plugin_subscriber *plugin_subscribers(enum plugin_event event, size_t *count)
+{
+	*count = subscriber_count[event];
+	return subscriber_arr[event];
+}
+
+static bool event_has_player(enum plugin_event event)
 {
-	return &plugin_arr[index];
+	return event <= PLUGIN_EVENT_PLAYER_DIE;
+}
+
+static bool event_has_text(enum plugin_event event)
+{
+	return event != PLUGIN_EVENT_PLAYER_JOIN && event != PLUGIN_EVENT_SERVER_STOPPING;
+}
+
+bool plugin_subscriber_match(const struct plugin_subscriber *subscriber, enum plugin_event event, const struct plugin_call_job_args *args)
+{
+	if(subscriber->filter == NULL)
+	{
+		subscriber->plugin->delivered ++;
+		return true;
+	}
+	const char *player = event_has_player(event) ? args->arg1 : NULL;
+	const char *text = event_has_player(event) ? args->arg2 : args->arg1;
+	if(!plugin_filter_match(subscriber->filter, player, text))
+	{
+		subscriber->plugin->filtered ++;
+		return false;
+	}
+	subscriber->plugin->delivered ++;
+	return true;
+}
+
+static bool plugin_handles(const struct plugin *plugin, enum plugin_event event)
+{
+	if(!(plugin->events & (1u << event))) return false;
+	/* The host only declares the events it has handlers for. */
+	if(plugin->host != NULL) return true;
+	switch(event)
+	{
+		case PLUGIN_EVENT_PLAYER_JOIN: return plugin->fc_player_join != NULL;
+		case PLUGIN_EVENT_PLAYER_LEAVE: return plugin->fc_player_leave != NULL;
+		case PLUGIN_EVENT_PLAYER_ACHIEVEMENT: return plugin->fc_player_achievement != NULL;
+		case PLUGIN_EVENT_PLAYER_CHALLENGE: return plugin->fc_player_challenge != NULL;
+		case PLUGIN_EVENT_PLAYER_GOAL: return plugin->fc_player_goal != NULL;
+		case PLUGIN_EVENT_PLAYER_SAY: return plugin->fc_player_say != NULL;
+		case PLUGIN_EVENT_PLAYER_DIE: return plugin->fc_player_die != NULL;
+		case PLUGIN_EVENT_SERVER_STOPPING: return plugin->fc_server_stopping != NULL;
+		case PLUGIN_EVENT_SERVER_STARTING: return plugin->fc_server_starting != NULL;
+		case PLUGIN_EVENT_SERVER_STARTED: return plugin->fc_server_started != NULL;
+		default: return false;
+	}
+}
+
+static void (*const plugcall_arr[PLUGIN_EVENT_COUNT])(void *) = {
+	[PLUGIN_EVENT_PLAYER_JOIN] = &plugcall_player_join,
+	[PLUGIN_EVENT_PLAYER_LEAVE] = &plugcall_player_leave,
+	[PLUGIN_EVENT_PLAYER_ACHIEVEMENT] = &plugcall_player_achievement,
+	[PLUGIN_EVENT_PLAYER_CHALLENGE] = &plugcall_player_challenge,
+	[PLUGIN_EVENT_PLAYER_GOAL] = &plugcall_player_goal,
+	[PLUGIN_EVENT_PLAYER_SAY] = &plugcall_player_say,
+	[PLUGIN_EVENT_PLAYER_DIE] = &plugcall_player_die,
+	[PLUGIN_EVENT_SERVER_STOPPING] = &plugcall_server_stopping,
+	[PLUGIN_EVENT_SERVER_STARTING] = &plugcall_server_starting,
+	[PLUGIN_EVENT_SERVER_STARTED] = &plugcall_server_started
+};
+
+/* Rebuild the subscriber tables from plugin_arr. Cannot fail when no plugin was added. */
+static int subscribers_rebuild()
+{
+	if(subscriber_cap < plugin_count)
+	{
+		for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+		{
+			struct plugin_subscriber *subscriber_arr_ext = realloc(subscriber_arr[i], plugin_count * sizeof(struct plugin_subscriber));
+			if(subscriber_arr_ext == NULL) return errno;
+			subscriber_arr[i] = subscriber_arr_ext;
+		}
+		subscriber_cap = plugin_count;
+	}
+	for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+	{
+		size_t count = 0;
+		for(int j = 0; j < plugin_count; j ++)
+		{
+			if(!plugin_handles(plugin_arr[j], i)) continue;
+			subscriber_arr[i][count].plugin = plugin_arr[j];
+			subscriber_arr[i][count].call = plugcall_arr[i];
+			subscriber_arr[i][count].queue = plugin_arr[j]->queue;
+			subscriber_arr[i][count].filter = plugin_arr[j]->filters[i];
+			subscriber_arr[i][count].host = plugin_arr[j]->host;
+			count ++;
+		}
+		subscriber_count[i] = count;
+	}
+	return 0;
+}
+
+/* Take a slot for plugin. Its reference resolves once registry_add makes it reachable. */
+static int registry_reserve(struct plugin *plugin)
+{
+	int r = 0;
+	pthread_mutex_lock(&registry_mutex);
+	if(free_slot == -1)
+	{
+		const int cap = slot_cap == 0 ? 16 : slot_cap * 2;
+		struct plugin_slot *slots_ext = realloc(slots, cap * sizeof(struct plugin_slot));
+		if(slots_ext == NULL)
+		{
+			r = errno;
+			goto cleanup;
+		}
+		slots = slots_ext;
+		for(int i = cap - 1; i >= slot_cap; i --)
+		{
+			slots[i].plugin = NULL;
+			slots[i].generation = 1;
+			slots[i].next_free = free_slot;
+			free_slot = i;
+		}
+		slot_cap = cap;
+	}
+	const int slot = free_slot;
+	free_slot = slots[slot].next_free;
+	plugin->ref = ((plugin_ref)slots[slot].generation << 32) | (plugin_ref)slot;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&registry_mutex);
+	return r;
+}
+
+static void registry_remove(struct plugin *plugin);
+
+/* Make plugin, which has a slot, reachable. */
+static int registry_add(struct plugin *plugin)
+{
+	int r = 0;
+	struct plugin **plugin_arr_ext = realloc(plugin_arr, (plugin_count + 1) * sizeof(struct plugin *));
+	if(plugin_arr_ext == NULL)
+	{
+		r = errno;
+		registry_remove(plugin);
+		return r;
+	}
+	plugin_arr = plugin_arr_ext;
+	pthread_mutex_lock(&registry_mutex);
+	r = strmap_put(&id_index, plugin->id, plugin);
+	if(r) goto cleanup;
+	slots[plugin->ref & 0xffffffff].plugin = plugin;
+	plugin_arr[plugin_count ++] = plugin;
+	for(struct plugin_command *command = plugin->commands; command != NULL && !r; command = command->next)
+	{
+		command->plugin = plugin;
+		r = strmap_put(&command_index, command->name, command);
+	}
+	if(!r) r = subscribers_rebuild();
+	goto cleanup;
+cleanup:
+	pending_set(0);
+	pthread_mutex_unlock(&registry_mutex);
+	if(r) registry_remove(plugin);
+	return r;
+}
+
+/* Make plugin unreachable and free its slot. */
+static void registry_remove(struct plugin *plugin)
+{
+	const int slot = (int)(plugin->ref & 0xffffffff);
+	pthread_mutex_lock(&registry_mutex);
+	if(strmap_get(&id_index, plugin->id) == plugin)
+		strmap_remove(&id_index, plugin->id);
+	for(struct plugin_command *command = plugin->commands; command != NULL; command = command->next)
+		if(strmap_get(&command_index, command->name) == command)
+			strmap_remove(&command_index, command->name);
+	if(pending == plugin->instance) pending_set(0);
+	slots[slot].plugin = NULL;
+	slots[slot].generation ++;
+	/* Never 0, so that no reference is ever 0. */
+	if(slots[slot].generation == 0) slots[slot].generation = 1;
+	slots[slot].next_free = free_slot;
+	free_slot = slot;
+	for(int i = 0; i < plugin_count; i ++)
+	{
+		if(plugin_arr[i] != plugin) continue;
+		memmove(&plugin_arr[i], &plugin_arr[i + 1], (plugin_count - 1 - i) * sizeof(struct plugin *));
+		plugin_count --;
+		break;
+	}
+	subscribers_rebuild();
+	pthread_mutex_unlock(&registry_mutex);
 }
 
 int plugin_registry_unload(int stderr_fd, const char *id)
 {
 	int r = 0;
-	const int index = plugin_id_to_index(id);
-	if(index < 0)
+	struct plugin *plug = plugin_get(id);
+	if(plug == NULL)
 	{
 		r = EPLUGINNOTFOUND;
 		goto cleanup;
 	}
-	struct plugin *plug = plugin_get_by_index(index);
+	/* No timer fires and no reply arrives past this point, handlers still queued run first. */
+	timer_cancel_owner(plug->instance);
+	rcon_async_cancel_owner(plug->instance);
+	if(plug->queue != NULL) plugin_queue_wait(plug->queue);
 	r = plugin_unload(stderr_fd, plug);
+	rcon_host_release();
 	if(r) goto cleanup;
+	/* The ID lives in the library: unindex it before closing. */
+	registry_remove(plug);
+	plugin_queue_free(plug->queue);
 	r = plugin_unload_meta(stderr_fd, plug);
-	if(r) goto cleanup;
-	memcpy(plug, &plugin_arr[index + 1], (plugin_count - 1 - index) * sizeof(struct plugin));
-	memcpy((char **)id_arr[index], &id_arr[index + 1], (plugin_count - 1 - index) * sizeof(char *));
-	arr_resize(-- plugin_count);
+	rcon_sched_bucket_free(plug->rcon_bucket);
+	rcon_stats_free(plug->rcon_stats);
+	plugin_profile_free(plug->profile);
+	free(plug);
 	goto cleanup;
 cleanup:
 	return r;
 }
 
-int plugin_registry_load(int stderr_fd, const char *path)
+/* Runs on the thread of a pinned plugin. */
+static void own_connection(void *arg)
+{
+	rcon_host_own();
+}
+
+int plugin_registry_load(int stderr_fd, const char *path, bool isolated)
 {
 	int r = 0;
 	struct plugin plugin;
-	r = plugin_load_meta(stderr_fd, path, &plugin);
+	r = isolated ? plugin_load_meta_isolated(stderr_fd, path, &plugin) : plugin_load_meta(stderr_fd, path, &plugin);
 	if(r) goto cleanup;
 	if(plugin_get(plugin.id) != NULL)
 	{
@@ -120,20 +423,344 @@ int plugin_registry_load(int stderr_fd, const char *path)
 		r = EPLUGINEXISTS;
 		goto cleanup;
 	}
+	plugin.rcon_bucket = rcon_sched_bucket_new();
+	plugin.rcon_stats = rcon_stats_new();
+	plugin.profile = plugin_profile_new();
+	if(plugin.rcon_bucket == NULL || plugin.rcon_stats == NULL || plugin.profile == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		rcon_sched_bucket_free(plugin.rcon_bucket);
+		rcon_stats_free(plugin.rcon_stats);
+		plugin_profile_free(plugin.profile);
+		plugin_unload_meta(stderr_fd, &plugin);
+		goto cleanup;
+	}
+	/* The host runs the handlers of an isolated plugin one at a time. */
+	if(plugin.concurrency != EPG_CONCURRENCY_REENTRANT && plugin.host == NULL)
+	{
+		plugin.queue = plugin_queue_new(plugin.id, plugin.concurrency == EPG_CONCURRENCY_PINNED);
+		if(plugin.queue == NULL)
+		{
+			r = errno;
+			dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+			rcon_sched_bucket_free(plugin.rcon_bucket);
+			rcon_stats_free(plugin.rcon_stats);
+			plugin_profile_free(plugin.profile);
+			plugin_unload_meta(stderr_fd, &plugin);
+			goto cleanup;
+		}
+		/* First job of its thread. */
+		if(plugin.concurrency == EPG_CONCURRENCY_PINNED)
+			plugin_queue_push(plugin.queue, NULL, &own_connection, NULL);
+	}
+	plugin.instance = ++ instance_seq;
+	r = registry_reserve(&plugin);
+	if(r)
+	{
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		plugin_queue_free(plugin.queue);
+		rcon_sched_bucket_free(plugin.rcon_bucket);
+		rcon_stats_free(plugin.rcon_stats);
+		plugin_profile_free(plugin.profile);
+		plugin_unload_meta(stderr_fd, &plugin);
+		goto cleanup;
+	}
+	pthread_mutex_lock(&registry_mutex);
+	pending_set(plugin.instance);
+	pthread_mutex_unlock(&registry_mutex);
+	loading = &plugin;
 	r = plugin_load(stderr_fd, &plugin);
+	loading = NULL;
+	rcon_host_release();
 	if(r)
 	{
+		pthread_mutex_lock(&registry_mutex);
+		pending_set(0);
+		pthread_mutex_unlock(&registry_mutex);
+		timer_cancel_owner(plugin.instance);
+		rcon_async_cancel_owner(plugin.instance);
+		registry_remove(&plugin);
+		plugin_queue_free(plugin.queue);
+		rcon_sched_bucket_free(plugin.rcon_bucket);
+		rcon_stats_free(plugin.rcon_stats);
+		plugin_profile_free(plugin.profile);
+		plugin_unload_meta(stderr_fd, &plugin);
+		goto cleanup;
+	}
+	struct plugin *plug = malloc(sizeof(struct plugin));
+	if(plug != NULL)
+	{
+		memcpy(plug, &plugin, sizeof(struct plugin));
+		r = registry_add(plug);
+	}
+	else
+	{
+		r = errno;
+		registry_remove(&plugin);
+	}
+	if(r)
+	{
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		free(plug);
+		timer_cancel_owner(plugin.instance);
+		rcon_async_cancel_owner(plugin.instance);
+		plugin_unload(stderr_fd, &plugin);
+		rcon_host_release();
+		plugin_queue_free(plugin.queue);
+		rcon_sched_bucket_free(plugin.rcon_bucket);
+		rcon_stats_free(plugin.rcon_stats);
+		plugin_profile_free(plugin.profile);
 		plugin_unload_meta(stderr_fd, &plugin);
 		goto cleanup;
 	}
-	arr_resize(++ plugin_count);
-	id_arr[plugin_count - 1] = plugin.id;
-	memcpy(&plugin_arr[plugin_count - 1], &plugin, sizeof(struct plugin));
 	goto cleanup;
 cleanup:
 	return r;
 }
 
+/* Drop next, a new version of a plugin that was not swapped in. What it shares with the running version is kept. */
+static void reload_discard(int stderr_fd, struct plugin *next)
+{
+	pthread_mutex_lock(&registry_mutex);
+	pending_set(0);
+	pthread_mutex_unlock(&registry_mutex);
+	timer_cancel_owner(next->instance);
+	rcon_async_cancel_owner(next->instance);
+	pthread_mutex_lock(&registry_mutex);
+	replacing = NULL;
+	pthread_mutex_unlock(&registry_mutex);
+	plugin_profile_free(next->profile);
+	plugin_unload_meta(stderr_fd, next);
+	free(next);
+}
+
+int plugin_registry_reload_prepare(int stderr_fd, const char *id, const char *path, struct plugin **next)
+{
+	int r = 0;
+	int fd = -1;
+	struct plugin *plug = NULL;
+	*next = NULL;
+	struct plugin *prev = plugin_get(id);
+	if(prev == NULL)
+	{
+		dprintf(stderr_fd, _("Cannot find plugin ID: %s\n"), id);
+		r = EPLUGINNOTFOUND;
+		goto cleanup;
+	}
+	if(prev->host != NULL)
+	{
+		dprintf(stderr_fd, _("Cannot reload isolated plugin '%s': unload and load it instead.\n"), id);
+		r = 64;
+		goto cleanup;
+	}
+	if(path == NULL) path = prev->path;
+	/* dlopen hands out the library already loaded from a path: open the new file under a name of its own,
+	 * which stays unique while the descriptor is open. */
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot open %s: %s.\n"), path, strerror(r));
+		goto cleanup;
+	}
+	char fd_path[32];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	plug = malloc(sizeof(struct plugin));
+	if(plug == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	r = plugin_load_meta(stderr_fd, fd_path, plug);
+	if(r)
+	{
+		free(plug);
+		plug = NULL;
+		goto cleanup;
+	}
+	char *path_dup = strdup(path);
+	if(path_dup == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	free(plug->path);
+	plug->path = path_dup;
+	plug->lib_fd = fd;
+	fd = -1;
+	/* Same file: written over in place, or not replaced at all. */
+	if(plug->handle == prev->handle)
+	{
+		dprintf(stderr_fd, _("%s is the library already loaded. Replace the file, do not write over it.\n"), path);
+		r = 64;
+		goto cleanup;
+	}
+	if(strcmp(plug->id, prev->id))
+	{
+		dprintf(stderr_fd, _("%s is plugin '%s', not '%s'.\n"), path, plug->id, prev->id);
+		r = 64;
+		goto cleanup;
+	}
+	if(plug->concurrency != prev->concurrency)
+	{
+		dprintf(stderr_fd, _("Cannot reload '%s' with another concurrency: unload and load it instead.\n"), prev->id);
+		r = 64;
+		goto cleanup;
+	}
+	/* Same reference, queue and rcon limits: queued events and commands go to whichever version is loaded. */
+	plug->ref = prev->ref;
+	plug->instance = ++ instance_seq;
+	plug->queue = prev->queue;
+	plug->rcon_bucket = prev->rcon_bucket;
+	plug->rcon_stats = prev->rcon_stats;
+	plug->profile = plugin_profile_new();
+	if(plug->profile == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	pthread_mutex_lock(&registry_mutex);
+	replacing = prev;
+	/* Its timers and replies wait for the swap, after epg_reload_restore. */
+	pending_set(plug->instance);
+	pthread_mutex_unlock(&registry_mutex);
+	loading = plug;
+	r = plugin_load(stderr_fd, plug);
+	loading = NULL;
+	rcon_host_release();
+	if(r)
+	{
+		reload_discard(stderr_fd, plug);
+		plug = NULL;
+		goto cleanup;
+	}
+	if(plug->fc_reload_restore != NULL)
+	{
+		void *state = NULL;
+		struct epg_handle hdl;
+		if(prev->fc_reload_save != NULL)
+		{
+			plugcall_setup_handle(prev, &hdl);
+			state = prev->fc_reload_save(&hdl);
+		}
+		plugcall_setup_handle(plug, &hdl);
+		r = plug->fc_reload_restore(&hdl, state);
+		rcon_host_release();
+		if(r)
+		{
+			dprintf(stderr_fd, _("Cannot reload plugin: the new version returned an error: %d.\n"), r);
+			plugin_registry_reload_abort(stderr_fd, plug);
+			plug = NULL;
+			goto cleanup;
+		}
+	}
+	*next = plug;
+	plug = NULL;
+	goto cleanup;
+cleanup:
+	if(fd != -1) close(fd);
+	if(plug != NULL)
+	{
+		plugin_profile_free(plug->profile);
+		plugin_unload_meta(stderr_fd, plug);
+		free(plug);
+	}
+	return r;
+}
+
+int plugin_registry_reload_swap(struct plugin *next, struct plugin **prev)
+{
+	int r = 0;
+	size_t command_count = 0;
+	for(const struct plugin_command *command = next->commands; command != NULL; command = command->next)
+		command_count ++;
+	pthread_mutex_lock(&registry_mutex);
+	/* Nothing fails past the reservations. */
+	r = strmap_reserve(&id_index, 1);
+	if(!r) r = strmap_reserve(&command_index, command_count);
+	if(r) goto cleanup;
+	const int slot = (int)(next->ref & 0xffffffff);
+	struct plugin *plug = slots[slot].plugin;
+	slots[slot].plugin = next;
+	for(int i = 0; i < plugin_count; i ++)
+		if(plugin_arr[i] == plug) plugin_arr[i] = next;
+	/* The ID and the command names of the previous version live in its library. */
+	strmap_put(&id_index, next->id, next);
+	for(struct plugin_command *command = plug->commands; command != NULL; command = command->next)
+		if(strmap_get(&command_index, command->name) == command)
+			strmap_remove(&command_index, command->name);
+	for(struct plugin_command *command = next->commands; command != NULL; command = command->next)
+	{
+		command->plugin = next;
+		strmap_put(&command_index, command->name, command);
+	}
+	subscribers_rebuild();
+	pending_set(0);
+	*prev = plug;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&registry_mutex);
+	return r;
+}
+
+void plugin_registry_reload_abort(int stderr_fd, struct plugin *next)
+{
+	plugin_unload(stderr_fd, next);
+	rcon_host_release();
+	reload_discard(stderr_fd, next);
+}
+
+void plugin_registry_reload_retire(int stderr_fd, struct plugin *prev)
+{
+	/* Its timers and replies would run its code with the new version's handle. */
+	timer_cancel_owner(prev->instance);
+	rcon_async_cancel_owner(prev->instance);
+	pthread_mutex_lock(&registry_mutex);
+	while(prev->running > 0)
+		pthread_cond_wait(&retire_cond, &registry_mutex);
+	replacing = NULL;
+	pthread_mutex_unlock(&registry_mutex);
+	/* Replaced either way. */
+	plugin_unload(stderr_fd, prev);
+	rcon_host_release();
+	plugin_profile_free(prev->profile);
+	plugin_unload_meta(stderr_fd, prev);
+	free(prev);
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mark_rcon_sent()
+{
+	uint64_t *sent = pthread_getspecific(key_rcon_sent);
+	if(sent == NULL)
+	{
+		sent = malloc(sizeof(uint64_t));
+		if(sent == NULL) return;
+		pthread_setspecific(key_rcon_sent, sent);
+	}
+	*sent = now_ns();
+}
+
+/* Time since the last command sent by this thread, 0 if there is none. Consumes the mark. */
+static uint64_t take_rcon_rtt()
+{
+	uint64_t *sent = pthread_getspecific(key_rcon_sent);
+	if(sent == NULL || *sent == 0) return 0;
+	const uint64_t rtt = now_ns() - *sent;
+	*sent = 0;
+	return rtt;
+}
+
 static int api_rcon_send_wrapper(int pkt_id, char *command)
 {
 	int r = 0;
@@ -142,44 +769,376 @@ static int api_rcon_send_wrapper(int pkt_id, char *command)
 			plug->id,
 			command,
 			pkt_id);
-	// TODO: The plugin identity may have future usages.
+	r = rcon_sched_acquire(plug->rcon_bucket, (int)(intptr_t)pthread_getspecific(key_lane), NULL);
+	if(r) goto cleanup;
+	mark_rcon_sent();
 	r = rcon_host_send(pkt_id, command);
 	if(r) goto cleanup;
+	rcon_stats_sent(plug->rcon_stats, strlen(command));
+	goto cleanup;
+cleanup:
+	if(r) rcon_stats_failed(plug->rcon_stats, r);
+	return r;
+}
+
+static int api_rcon_recv_view_wrapper(int *pkt_id, const char **data, size_t *len)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	r = rcon_host_recv_view(pkt_id, data, len);
+	const uint64_t rtt = take_rcon_rtt();
+	if(r) goto cleanup;
+	printf(_("[rcon#%s] <- %s (%d)\n"),
+			plug->id,
+			*data,
+			*pkt_id);
+	rcon_stats_received(plug->rcon_stats, *len, rtt);
+	goto cleanup;
 cleanup:
+	if(r) rcon_stats_failed(plug->rcon_stats, r);
 	return r;
 }
 
 static int api_rcon_recv_wrapper(int *pkt_id, char *out)
+{
+	const char *data;
+	size_t len;
+	const int r = api_rcon_recv_view_wrapper(pkt_id, &data, &len);
+	if(r) return r;
+	// The caller provides RCON_DATA_BUFFSIZE bytes.
+	if(len > RCON_DATA_BUFFSIZE - 1) len = RCON_DATA_BUFFSIZE - 1;
+	memcpy(out, data, len);
+	out[len] = '\0';
+	return 0;
+}
+
+static int api_rcon_exec_view_wrapper(const char *command, int timeout_ms, const char **data, size_t *len)
 {
 	int r = 0;
 	const struct plugin *plug = pthread_getspecific(key_plugin);
-	// TODO: The plugin identity may have future usages.
-	r = rcon_host_recv(pkt_id, out);
-	if(!r)
-		printf(_("[rcon#%s] <- %s (%d)\n"),
-				plug->id,
-				out,
-				*pkt_id);
+	*data = "";
+	*len = 0;
+	printf(_("[rcon#%s] -> '%s'\n"),
+			plug->id,
+			command);
+	if(timeout_ms <= 0)
+	{
+		r = 64;
+		goto cleanup;
+	}
+	/* timeout_ms covers the whole call, queueing for the rate limit and a connection included. */
+	struct timespec deadline;
+	rcon_host_deadline(&deadline, timeout_ms);
+	r = rcon_sched_acquire(plug->rcon_bucket, (int)(intptr_t)pthread_getspecific(key_lane), &deadline);
 	if(r) goto cleanup;
+	const uint64_t start = now_ns();
+	r = rcon_host_exec_view(command, &deadline, data, len);
+	if(r) goto cleanup;
+	rcon_stats_sent(plug->rcon_stats, strlen(command));
+	rcon_stats_received(plug->rcon_stats, *len, now_ns() - start);
+	printf(_("[rcon#%s] <- %s\n"),
+			plug->id,
+			*data);
+	goto cleanup;
 cleanup:
+	if(r) rcon_stats_failed(plug->rcon_stats, r);
 	return r;
 }
 
+static int api_rcon_exec_wrapper(const char *command, int timeout_ms, char *out, size_t out_cap, size_t *out_len)
+{
+	const char *data;
+	size_t len;
+	const int r = api_rcon_exec_view_wrapper(command, timeout_ms, &data, &len);
+	if(out_cap > 0)
+	{
+		const size_t copy = len < out_cap - 1 ? len : out_cap - 1;
+		memcpy(out, data, copy);
+		out[copy] = '\0';
+	}
+	if(out_len != NULL) *out_len = len;
+	return r;
+}
+
+static int api_rcon_exec_dup_wrapper(const char *command, int timeout_ms, char **out, size_t *out_len)
+{
+	int r = 0;
+	const char *data;
+	size_t len;
+	*out = NULL;
+	r = api_rcon_exec_view_wrapper(command, timeout_ms, &data, &len);
+	if(r) goto cleanup;
+	*out = malloc(len + 1);
+	if(*out == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	memcpy(*out, data, len + 1);
+	goto cleanup;
+cleanup:
+	if(out_len != NULL) *out_len = r ? 0 : len;
+	return r;
+}
+
+static int api_rcon_defer_wrapper(const char *command)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	if(strchr(command, '\n') != NULL)
+	{
+		r = 64;
+		goto cleanup;
+	}
+	/* Try right away unless older commands are still held. */
+	if(rcon_queue_size() == 0 && console_available())
+	{
+		r = rcon_sched_acquire(plug->rcon_bucket, (int)(intptr_t)pthread_getspecific(key_lane), NULL);
+		if(!r) r = console_send(command);
+		if(!r || !rcon_queue_retryable(r)) goto cleanup;
+	}
+	else if(rcon_queue_size() == 0)
+	{
+		const char *data;
+		size_t len;
+		r = api_rcon_exec_view_wrapper(command, RCON_QUEUE_TIMEOUT, &data, &len);
+		if(!r || !rcon_queue_retryable(r)) goto cleanup;
+	}
+	r = rcon_queue_push(plug->id, command);
+	if(r) goto cleanup;
+	printf(_("[rcon#%s] Deferred '%s'\n"),
+			plug->id,
+			command);
+	r = EPG_RCON_QUEUED;
+	goto cleanup;
+cleanup:
+	return r;
+}
+
+static int api_rcon_batch_wrapper(const char *const *commands, size_t count, int timeout_ms)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	printf(_("[rcon#%s] -> %zu command(s)\n"),
+			plug->id,
+			count);
+	if(timeout_ms <= 0)
+	{
+		r = 64;
+		goto cleanup;
+	}
+	struct timespec deadline;
+	rcon_host_deadline(&deadline, timeout_ms);
+	/* The limits count what the server runs. */
+	const int lane = (int)(intptr_t)pthread_getspecific(key_lane);
+	for(size_t i = 0; i < count && !r; i ++)
+		r = rcon_sched_acquire(plug->rcon_bucket, lane, &deadline);
+	if(r) goto cleanup;
+	r = batch_exec(commands, count, &deadline);
+	if(r) goto cleanup;
+	for(size_t i = 0; i < count; i ++)
+		rcon_stats_sent(plug->rcon_stats, strlen(commands[i]));
+	goto cleanup;
+cleanup:
+	if(r) rcon_stats_failed(plug->rcon_stats, r);
+	return r;
+}
+
+static int api_console_send_wrapper(const char *command)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	printf(_("[console#%s] -> '%s'\n"),
+			plug->id,
+			command);
+	r = rcon_sched_acquire(plug->rcon_bucket, (int)(intptr_t)pthread_getspecific(key_lane), NULL);
+	if(r) goto cleanup;
+	r = console_send(command);
+	goto cleanup;
+cleanup:
+	return r;
+}
+
+static int api_filter_add_wrapper(uint32_t events, int kind, const char *value)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	if(plug == NULL || plug != loading || events == 0 || (events & ~EPG_EVENT_ALL) || value == NULL)
+		return 64;
+	for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+	{
+		if(!(events & (1u << i))) continue;
+		if(kind == EPG_FILTER_PLAYER && !event_has_player(i)) return 64;
+		if((kind == EPG_FILTER_PREFIX || kind == EPG_FILTER_EXACT) && !event_has_text(i)) return 64;
+		if(kind == EPG_FILTER_DEATH_CAUSE && i != PLUGIN_EVENT_PLAYER_DIE) return 64;
+	}
+	for(int i = 0; i < PLUGIN_EVENT_COUNT && !r; i ++)
+	{
+		if(!(events & (1u << i))) continue;
+		r = plugin_filter_add(&loading->filters[i], kind, value);
+	}
+	return r;
+}
+
+static int api_command_register_wrapper(const char *name, int min_args, int max_args,
+		int (*handler)(struct epg_handle *, char *, int, char **))
+{
+	int r = 0;
+	struct plugin *plug = pthread_getspecific(key_plugin);
+	if(plug == NULL || plug != loading || name == NULL || handler == NULL)
+		return 64;
+	const size_t len = strlen(name);
+	if(len == 0 || len > EPG_COMMAND_NAME_MAX || strchr(name, ' ') != NULL)
+		return 64;
+	if(min_args < 0 || max_args < -1 || (max_args != -1 && max_args < min_args))
+		return 64;
+	const struct plugin_command *existing = strmap_get(&command_index, name);
+	if(existing != NULL && existing->plugin != replacing)
+		return EEXIST;
+	for(struct plugin_command *command = plug->commands; command != NULL; command = command->next)
+		if(!strcmp(command->name, name)) return EEXIST;
+	struct plugin_command *command = calloc(1, sizeof(struct plugin_command));
+	if(command == NULL) return errno;
+	command->name = strdup(name);
+	if(command->name == NULL)
+	{
+		r = errno;
+		free(command);
+		return r;
+	}
+	command->min_args = min_args;
+	command->max_args = max_args;
+	command->handler = handler;
+	command->next = plug->commands;
+	plug->commands = command;
+	return 0;
+}
+
+/* A plugin timer, the argument of its timer_add callback. */
+struct plugin_timer {
+	plugin_ref plugin;
+	/* The version that added it, which a reload shares plugin with. */
+	uint64_t instance;
+	int (*callback)(struct epg_handle *, void *);
+	void *arg;
+};
+
+static void plugcall_timer(void *arg, uint64_t due_ns);
+
+static int api_timer_add_wrapper(uint32_t delay_ms, uint32_t interval_ms,
+		int (*callback)(struct epg_handle *, void *), void *arg, uint64_t *id)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	if(plug == NULL || callback == NULL)
+		return 64;
+	struct plugin_timer *timer = malloc(sizeof(struct plugin_timer));
+	if(timer == NULL) return errno;
+	timer->plugin = plug->ref;
+	timer->instance = plug->instance;
+	timer->callback = callback;
+	timer->arg = arg;
+	r = timer_add(plug->instance, delay_ms, interval_ms, &plugcall_timer, timer, &free, plug->queue, id);
+	if(r) free(timer);
+	return r;
+}
+
+static int api_timer_cancel_wrapper(uint64_t id)
+{
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	if(plug == NULL)
+		return 64;
+	return timer_cancel(plug->instance, id);
+}
+
+/* An async rcon command of a plugin, the argument of its completion. */
+struct plugin_async {
+	plugin_ref plugin;
+	/* As in struct plugin_timer. */
+	uint64_t instance;
+	int (*callback)(struct epg_handle *, int, const char *, size_t, void *);
+	void *arg;
+};
+
+static void plugcall_rcon_async(struct rcon_async_reply *reply);
+
+static int api_rcon_exec_async_wrapper(const char *command, int timeout_ms,
+		int (*callback)(struct epg_handle *, int, const char *, size_t, void *), void *arg)
+{
+	int r = 0;
+	const struct plugin *plug = pthread_getspecific(key_plugin);
+	if(plug == NULL || command == NULL || callback == NULL)
+		return 64;
+	printf(_("[rcon#%s] -> '%s'\n"),
+			plug->id,
+			command);
+	/* Charged by the reactor once it sends the command: the worker returns right away. */
+	struct plugin_async *job = malloc(sizeof(struct plugin_async));
+	if(job == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	job->plugin = plug->ref;
+	job->instance = plug->instance;
+	job->callback = callback;
+	job->arg = arg;
+	r = rcon_async_exec(plug->instance, command, timeout_ms, plug->rcon_bucket, (int)(intptr_t)pthread_getspecific(key_lane),
+			&plugcall_rcon_async, job, &free, plug->queue);
+	if(r) goto cleanup;
+	rcon_stats_sent(plug->rcon_stats, strlen(command));
+	goto cleanup;
+cleanup:
+	if(r)
+	{
+		free(job);
+		rcon_stats_failed(plug->rcon_stats, r);
+	}
+	return r;
+}
+
+static void api_rcon_release_wrapper()
+{
+	rcon_host_release();
+}
+
+static int api_rcon_priority_wrapper(int lane)
+{
+	if(lane < EPG_RCON_PRIO_HIGH || lane > EPG_RCON_PRIO_LOW)
+		return 64;
+	pthread_setspecific(key_lane, (void *)(intptr_t)lane);
+	return 0;
+}
+
 void plugcall_setup_handle(const struct plugin *plugin, struct epg_handle *handle)
 {
 	pthread_setspecific(key_plugin, plugin);
+	pthread_setspecific(key_lane, (void *)(intptr_t)EPG_RCON_PRIO_NORMAL);
 	handle->id = plugin->id;
 	handle->rcon_send = &api_rcon_send_wrapper;
 	handle->rcon_recv = &api_rcon_recv_wrapper;
+	handle->rcon_priority = &api_rcon_priority_wrapper;
+	handle->rcon_exec = &api_rcon_exec_wrapper;
+	handle->rcon_exec_view = &api_rcon_exec_view_wrapper;
+	handle->rcon_exec_dup = &api_rcon_exec_dup_wrapper;
+	handle->rcon_recv_view = &api_rcon_recv_view_wrapper;
+	handle->rcon_release = &api_rcon_release_wrapper;
+	handle->rcon_defer = &api_rcon_defer_wrapper;
+	handle->players_acquire = &session_acquire;
+	handle->players_release = &session_release;
+	handle->players_find = &session_find;
+	handle->score_set = &scoreboard_set;
+	handle->score_reset = &scoreboard_reset;
+	handle->rcon_batch = &api_rcon_batch_wrapper;
+	handle->console_send = &api_console_send_wrapper;
+	handle->filter_add = &api_filter_add_wrapper;
+	handle->command_register = &api_command_register_wrapper;
+	handle->timer_add = &api_timer_add_wrapper;
+	handle->timer_cancel = &api_timer_cancel_wrapper;
+	handle->rcon_exec_async = &api_rcon_exec_async_wrapper;
 }
 
-#define PLUGCALL_PRE(X) \
-	struct epg_handle handle; \
-	struct plugin_call_job_args *args = arg; \
-	struct plugin *plugin = plugin_get_by_index(args->id); \
-	plugcall_setup_handle(plugin, &handle);
-
-#define PLUGCALL_POST(X) \
+#define PLUGCALL_FREE_ARGS() \
 	if(args->arg1 != NULL) free(args->arg1); \
 	if(args->arg2 != NULL) free(args->arg2); \
 	if(args->arg3 != NULL) free(args->arg3); \
@@ -187,72 +1146,265 @@ void plugcall_setup_handle(const struct plugin *plugin, struct epg_handle *handl
 	if(args->arg5 != NULL) free(args->arg5); \
 	free(args);
 
+#define PLUGCALL_PRE(X) \
+	struct epg_handle handle; \
+	struct plugin_call_job_args *args = arg; \
+	struct plugin *plugin = plugin_acquire(args->plugin); \
+	if(plugin == NULL) \
+	{ \
+		DEBUGF("plugin_registry.c#%s: Plugin unloaded, dropping the event.\n", __func__); \
+		PLUGCALL_FREE_ARGS() \
+		return; \
+	} \
+	plugcall_setup_handle(plugin, &handle); \
+	struct plugin_profile_clock clock; \
+	plugin_profile_start(&clock);
+
+#define PLUGCALL_POST(X) \
+	plugcall_end(plugin, X, __func__, &clock, args->queued_ns); \
+	plugin_release(plugin); \
+	rcon_host_release(); \
+	PLUGCALL_FREE_ARGS()
+
+/* Account the call to the profile of the plugin and warn if it took longer than the plugin declared. */
+static void plugcall_end(const struct plugin *plugin, int call, const char *name, const struct plugin_profile_clock *clock, uint64_t queued_ns)
+{
+	const uint64_t ms = plugin_profile_end(plugin->profile, call, clock, queued_ns) / 1000000;
+	if(plugin->max_latency_ms == 0 || ms <= plugin->max_latency_ms) return;
+	fprintf(stderr, _("Plugin %s took %" PRIu64 " ms in %s, more than the %u ms it declared.\n"),
+			plugin->id,
+			ms,
+			name,
+			plugin->max_latency_ms);
+}
+
 void plugcall_player_join(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_join(&handle, args->arg1);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_JOIN)
 }
 
 void plugcall_player_leave(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_leave(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_LEAVE)
 }
 
 void plugcall_player_achievement(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_achievement(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_ACHIEVEMENT)
 }
 
 void plugcall_player_challenge(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_challenge(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_CHALLENGE)
 }
 
 void plugcall_player_goal(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_goal(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_GOAL)
 }
 
 void plugcall_player_say(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_say(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_SAY)
 }
 
 void plugcall_player_die(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_player_die(&handle, args->arg1, args->arg2);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_PLAYER_DIE)
 }
 
 void plugcall_server_stopping(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_server_stopping(&handle);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_SERVER_STOPPING)
 }
 
 void plugcall_server_starting(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_server_starting(&handle, args->arg1);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_SERVER_STARTING)
 }
 
 void plugcall_server_started(void *arg)
 {
 	PLUGCALL_PRE(arg)
 	plugin->fc_server_started(&handle, args->arg1);
-	PLUGCALL_POST(arg)
+	PLUGCALL_POST(PLUGIN_EVENT_SERVER_STARTED)
+}
+
+struct plugin_command_job {
+	plugin_ref plugin;
+	uint64_t queued_ns;
+	char *player;
+	int argc;
+	char **argv;
+};
+
+void *plugin_command_match(const char *player, const char *message, struct plugin_queue **queue)
+{
+	if(message == NULL || message[0] != EPG_COMMAND_PREFIX) return NULL;
+	const char *name = &message[1];
+	const size_t name_len = strcspn(name, " ");
+	if(name_len == 0 || name_len > EPG_COMMAND_NAME_MAX) return NULL;
+	char key[EPG_COMMAND_NAME_MAX + 1];
+	memcpy(key, name, name_len);
+	key[name_len] = '\0';
+	struct plugin_command *command = strmap_get(&command_index, key);
+	if(command == NULL) return NULL;
+	/* One block: the job, argv, then the player and the message split in place. */
+	size_t words = 1;
+	for(const char *c = name; *c; c ++)
+		if(*c == ' ') words ++;
+	const size_t player_len = strlen(player);
+	const size_t message_len = strlen(name);
+	struct plugin_command_job *job = malloc(sizeof(struct plugin_command_job) + (words + 1) * sizeof(char *) + player_len + message_len + 2);
+	if(job == NULL) return NULL;
+	job->queued_ns = plugin_profile_now();
+	job->argv = (char **)&job[1];
+	job->player = (char *)&job->argv[words + 1];
+	memcpy(job->player, player, player_len + 1);
+	char *text = &job->player[player_len + 1];
+	memcpy(text, name, message_len + 1);
+	int argc = 0;
+	char *pos = text;
+	while(*pos)
+	{
+		if(*pos == ' ')
+		{
+			pos ++;
+			continue;
+		}
+		job->argv[argc ++] = pos;
+		/* The last argument keeps its spaces. */
+		if(command->max_args > 0 && argc == command->max_args + 1) break;
+		pos += strcspn(pos, " ");
+		if(*pos) *pos ++ = '\0';
+	}
+	job->argv[argc] = NULL;
+	job->argc = argc;
+	if(argc - 1 < command->min_args || (command->max_args == 0 && argc > 1))
+	{
+		DEBUGF("plugin_registry.c#plugin_command_match: %s: unexpected number of arguments: %d.\n", key, argc - 1);
+		command->rejected ++;
+		free(job);
+		return NULL;
+	}
+	command->calls ++;
+	job->plugin = command->plugin->ref;
+	*queue = command->plugin->queue;
+	return job;
+}
+
+void plugin_commands_dump(int out)
+{
+	dprintf(out, _("Command\tPlugin\tArguments\tCalls\tIgnored\n"));
+	size_t iter = 0;
+	void *value;
+	while(strmap_next(&command_index, &iter, NULL, &value))
+	{
+		const struct plugin_command *command = value;
+		if(command->max_args == -1)
+			dprintf(out, "%s\t%s\t%d+\t%" PRIu64 "\t%" PRIu64 "\n", command->name, command->plugin->id, command->min_args, command->calls, command->rejected);
+		else
+			dprintf(out, "%s\t%s\t%d-%d\t%" PRIu64 "\t%" PRIu64 "\n", command->name, command->plugin->id, command->min_args, command->max_args, command->calls, command->rejected);
+	}
+}
+
+void plugcall_command(void *arg)
+{
+	struct plugin_command_job *job = arg;
+	struct plugin *plugin = plugin_acquire(job->plugin);
+	if(plugin == NULL)
+	{
+		DEBUG("plugin_registry.c#plugcall_command: Plugin unloaded, dropping the command.\n");
+		free(job);
+		return;
+	}
+	/* Looked up now: the plugin may have been reloaded since the command was matched. */
+	int (*handler)(struct epg_handle *, char *, int, char **) = NULL;
+	pthread_mutex_lock(&registry_mutex);
+	const struct plugin_command *command = strmap_get(&command_index, job->argv[0]);
+	if(command != NULL && command->plugin == plugin) handler = command->handler;
+	pthread_mutex_unlock(&registry_mutex);
+	if(handler == NULL)
+	{
+		DEBUG("plugin_registry.c#plugcall_command: Command no longer registered, dropping it.\n");
+		plugin_release(plugin);
+		free(job);
+		return;
+	}
+	struct epg_handle handle;
+	plugcall_setup_handle(plugin, &handle);
+	struct plugin_profile_clock clock;
+	plugin_profile_start(&clock);
+	handler(&handle, job->player, job->argc, job->argv);
+	plugcall_end(plugin, PLUGIN_CALL_COMMAND, __func__, &clock, job->queued_ns);
+	plugin_release(plugin);
+	rcon_host_release();
+	free(job);
+}
+
+static void plugcall_timer(void *arg, uint64_t due_ns)
+{
+	struct plugin_timer *timer = arg;
+	struct plugin *plugin = plugin_acquire_instance(timer->plugin, timer->instance);
+	if(plugin == NULL)
+	{
+		DEBUG("plugin_registry.c#plugcall_timer: Plugin not loaded, skipping the timer.\n");
+		return;
+	}
+	struct epg_handle handle;
+	plugcall_setup_handle(plugin, &handle);
+	struct plugin_profile_clock clock;
+	plugin_profile_start(&clock);
+	timer->callback(&handle, timer->arg);
+	plugcall_end(plugin, PLUGIN_CALL_TIMER, __func__, &clock, due_ns);
+	plugin_release(plugin);
+	rcon_host_release();
+}
+
+static void plugcall_rcon_async(struct rcon_async_reply *reply)
+{
+	struct plugin_async *job = reply->arg;
+	struct plugin *plugin = plugin_acquire_instance(job->plugin, job->instance);
+	if(plugin == NULL)
+	{
+		DEBUG("plugin_registry.c#plugcall_rcon_async: Plugin not loaded, dropping the reply.\n");
+		return;
+	}
+	if(reply->status)
+	{
+		rcon_stats_failed(plugin->rcon_stats, reply->status);
+	}
+	else
+	{
+		rcon_stats_received(plugin->rcon_stats, reply->len, reply->rtt_ns);
+		printf(_("[rcon#%s] <- %s\n"),
+				plugin->id,
+				reply->data);
+	}
+	struct epg_handle handle;
+	plugcall_setup_handle(plugin, &handle);
+	struct plugin_profile_clock clock;
+	plugin_profile_start(&clock);
+	job->callback(&handle, reply->status, reply->data, reply->len, job->arg);
+	plugcall_end(plugin, PLUGIN_CALL_RCON_ASYNC, __func__, &clock, reply->queued_ns);
+	plugin_release(plugin);
+	rcon_host_release();
 }
@@ -7,14 +7,53 @@
 #define EPLUGINNOTFOUND	74
 #define EPLUGINEXISTS	117
 
+/* A plugin handling an event, and the job that calls the handler.
+ * Jobs go to queue instead of the thread pool if it is not NULL. */
+struct plugin_subscriber {
+	struct plugin *plugin;
+	void (*call)(void *arg);
+	struct plugin_queue *queue;
+	/* NULL if every event is handled. */
+	const struct plugin_filter *filter;
+	/* Events go to the host process of an isolated plugin instead, if it is not NULL. */
+	struct plugin_host *host;
+};
+
 int plugin_registry_init();
 void plugin_registry_free();
 
 int plugin_size();
 struct plugin *plugin_get(const char *id);
+/* Plugins in load order. Only valid until the next load or unload. */
 struct plugin *plugin_get_by_index(int index);
+/* NULL once the plugin is unloaded. Otherwise the plugin counts as running until plugin_release, which
+ * keeps a reload from closing it meanwhile. */
+struct plugin *plugin_acquire(plugin_ref ref);
+void plugin_release(struct plugin *plugin);
+/* The plugins handling event, in load order. Rebuilt on load and unload: only valid until then. */
+const struct plugin_subscriber *plugin_subscribers(enum plugin_event event, size_t *count);
+/* Whether the subscriber's filter lets the event through. Counted in the plugin's statistics. */
+bool plugin_subscriber_match(const struct plugin_subscriber *subscriber, enum plugin_event event, const struct plugin_call_job_args *args);
 int plugin_registry_unload(int stderr_fd, const char *id);
-int plugin_registry_load(int stderr_fd, const char *path);
+/* An isolated plugin runs in a host process of its own, see plugin_host.h. */
+int plugin_registry_load(int stderr_fd, const char *path, bool isolated);
+/*
+ * Replace a plugin with a new version of its library, path or the one it was loaded from, in steps so
+ * that only the swap holds the dispatch. prepare loads the new version next to the running one and hands
+ * it the state of the previous version. swap makes it reachable under the same reference, queue and rcon
+ * limits, so the events queued for the previous version go to the new one. It must not race with the
+ * dispatch. retire unloads the previous version once its running handlers returned. abort drops the new
+ * version if the swap failed.
+ */
+int plugin_registry_reload_prepare(int stderr_fd, const char *id, const char *path, struct plugin **next);
+int plugin_registry_reload_swap(struct plugin *next, struct plugin **prev);
+void plugin_registry_reload_retire(int stderr_fd, struct plugin *prev);
+void plugin_registry_reload_abort(int stderr_fd, struct plugin *next);
+
+/* The call of the handler of the chat command in message, NULL if it is none. The job goes to *queue
+ * if it is not NULL, or else to the thread pool. */
+void *plugin_command_match(const char *player, const char *message, struct plugin_queue **queue);
+void plugin_commands_dump(int out);
 
 void plugcall_setup_handle(const struct plugin *plugin, struct epg_handle *handle);
 
@@ -28,5 +67,6 @@ void plugcall_player_die(void *arg);
 void plugcall_server_stopping(void *arg);
 void plugcall_server_starting(void *arg);
 void plugcall_server_started(void *arg);
+void plugcall_command(void *arg);
 
 #endif // _PLUGIN_REGISTRY_H
@@ -1,12 +1,16 @@
 #include "plugins.h"
 #include "common.h"
 #include "plugin_registry.h"
+#include "plugin_profile.h"
+#include "plugin_host.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <dlfcn.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 static const void *plugin_dlsym(int stderr_fd, void *handle, const bool mandatory, const char *name)
 {
@@ -28,21 +32,50 @@ static const void *plugin_dlsym(int stderr_fd, void *handle, const bool mandator
 
 int plugin_unload_meta(int stderr_fd, struct plugin *plugin)
 {
+	for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+	{
+		plugin_filter_free(plugin->filters[i]);
+		plugin->filters[i] = NULL;
+	}
+	while(plugin->commands != NULL)
+	{
+		struct plugin_command *command = plugin->commands;
+		plugin->commands = command->next;
+		free(command->name);
+		free(command);
+	}
 	if(plugin->handle != NULL)
 	{
 		dlclose(plugin->handle);
 		plugin->handle = NULL;
 	}
+	if(plugin->host != NULL)
+	{
+		plugin_host_free(plugin->host);
+		plugin->host = NULL;
+	}
+	if(plugin->lib_fd != -1)
+	{
+		close(plugin->lib_fd);
+		plugin->lib_fd = -1;
+	}
+	free(plugin->path);
+	plugin->path = NULL;
 	return 0;
 }
 
 int plugin_unload(int stderr_fd, const struct plugin *plugin)
 {
+	if(plugin->host != NULL)
+		return plugin_host_unload(stderr_fd, plugin);
 	if(plugin->fc_unload != NULL)
 	{
 		struct epg_handle hdl;
 		plugcall_setup_handle(plugin, &hdl);
+		struct plugin_profile_clock clock;
+		plugin_profile_start(&clock);
 		int unload_r = plugin->fc_unload(&hdl);
+		plugin_profile_end(plugin->profile, PLUGIN_CALL_UNLOAD, &clock, 0);
 		if(unload_r)
 		{
 			dprintf(stderr_fd, _("Cannot unload plugin: it returned an error: %d.\n"), unload_r);
@@ -82,18 +115,80 @@ static int plugin_load_v1(int stderr_fd, struct plugin *out)
 	out->fc_server_stopping = plugin_dlsym(stderr_fd, out->handle, false, "epg_server_stopping");
 	out->fc_server_starting = plugin_dlsym(stderr_fd, out->handle, false, "epg_server_starting");
 	out->fc_server_started = plugin_dlsym(stderr_fd, out->handle, false, "epg_server_started");
+	/* Nothing is known about thread safety. */
+	out->events = EPG_EVENT_ALL;
+	out->concurrency = EPG_CONCURRENCY_SERIALIZED;
 	goto cleanup;
 cleanup:
 	return r;
 }
 
-int plugin_load_meta(int stderr_fd, const char *path, struct plugin *out)
+static int plugin_load_v2(int stderr_fd, struct plugin *out)
 {
 	int r = 0;
-	out->path = path;
+	const struct epg_plugin *desc = plugin_dlsym(stderr_fd, out->handle, true, "epg_plugin");
+	if(desc == NULL)
+	{
+		r = 64;
+		goto cleanup;
+	}
+	if(desc->id == NULL || desc->name == NULL)
+	{
+		dprintf(stderr_fd, _("Cannot load %s, aborting: no ID or name.\n"), out->path);
+		r = 64;
+		goto cleanup;
+	}
+	if(desc->concurrency > EPG_CONCURRENCY_PINNED)
+	{
+		dprintf(stderr_fd, _("Cannot load %s, aborting: unknown concurrency %u.\n"), out->path, desc->concurrency);
+		r = 64;
+		goto cleanup;
+	}
+	out->id = desc->id;
+	out->name = (char *)desc->name;
+	out->events = desc->events & EPG_EVENT_ALL;
+	out->concurrency = desc->concurrency;
+	out->max_latency_ms = desc->max_latency_ms;
+	out->fc_load = desc->load;
+	out->fc_unload = desc->unload;
+	out->fc_player_join = desc->player_join;
+	out->fc_player_leave = desc->player_leave;
+	out->fc_player_say = desc->player_say;
+	out->fc_player_die = desc->player_die;
+	out->fc_player_achievement = desc->player_achievement;
+	out->fc_player_challenge = desc->player_challenge;
+	out->fc_player_goal = desc->player_goal;
+	out->fc_server_stopping = desc->server_stopping;
+	out->fc_server_starting = desc->server_starting;
+	out->fc_server_started = desc->server_started;
+	goto cleanup;
+cleanup:
+	return r;
+}
+
+static void plugin_meta_init(struct plugin *out)
+{
+	out->ref = 0;
+	out->instance = 0;
+	out->running = 0;
+	out->path = NULL;
 	out->handle = NULL;
+	out->lib_fd = -1;
 	out->name = NULL;
 	out->version = 0;
+	out->events = 0;
+	out->concurrency = EPG_CONCURRENCY_SERIALIZED;
+	out->max_latency_ms = 0;
+	out->queue = NULL;
+	for(int i = 0; i < PLUGIN_EVENT_COUNT; i ++)
+		out->filters[i] = NULL;
+	out->delivered = 0;
+	out->filtered = 0;
+	out->commands = NULL;
+	out->rcon_bucket = NULL;
+	out->rcon_stats = NULL;
+	out->profile = NULL;
+	out->host = NULL;
 	out->fc_load = NULL;
 	out->fc_unload = NULL;
 	out->fc_player_join = NULL;
@@ -106,8 +201,23 @@ int plugin_load_meta(int stderr_fd, const char *path, struct plugin *out)
 	out->fc_server_stopping = NULL;
 	out->fc_server_starting = NULL;
 	out->fc_server_started = NULL;
+	out->fc_reload_save = NULL;
+	out->fc_reload_restore = NULL;
+}
 
-	void *handle = dlopen(path, RTLD_LAZY);
+int plugin_load_meta(int stderr_fd, const char *path, struct plugin *out)
+{
+	int r = 0;
+	plugin_meta_init(out);
+	out->path = strdup(path);
+	if(out->path == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	/* Bind everything now: a missing symbol fails the load instead of a handler later. */
+	void *handle = dlopen(path, RTLD_NOW);
 	if(handle == NULL)
 	{
 		dprintf(stderr_fd, _("Cannot load %s: %s.\n"), path, dlerror());
@@ -128,10 +238,36 @@ int plugin_load_meta(int stderr_fd, const char *path, struct plugin *out)
 			r = plugin_load_v1(stderr_fd, out);
 			if(r) goto cleanup;
 			break;
+		case 2:
+			r = plugin_load_v2(stderr_fd, out);
+			if(r) goto cleanup;
+			break;
 		default:
 			dprintf(stderr_fd, _("Unsupported plugin %s: Incompatible with version %u.\n"), path, out->version);
-			break;
+			r = 64;
+			goto cleanup;
 	}
+	/* Optional for both versions, and usually absent: not worth a warning. */
+	out->fc_reload_save = dlsym(handle, "epg_reload_save");
+	out->fc_reload_restore = dlsym(handle, "epg_reload_restore");
+	goto cleanup;
+cleanup:
+	if(r) plugin_unload_meta(stderr_fd, out);
+	return r;
+}
+
+int plugin_load_meta_isolated(int stderr_fd, const char *path, struct plugin *out)
+{
+	int r = 0;
+	plugin_meta_init(out);
+	out->path = strdup(path);
+	if(out->path == NULL)
+	{
+		r = errno;
+		dprintf(stderr_fd, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	r = plugin_host_spawn(stderr_fd, path, out);
 	goto cleanup;
 cleanup:
 	if(r) plugin_unload_meta(stderr_fd, out);
@@ -141,9 +277,17 @@ cleanup:
 int plugin_load(int stderr_fd, const struct plugin *plugin)
 {
 	int r = 0;
+	if(plugin->host != NULL)
+		return plugin_host_load(stderr_fd, plugin);
 	struct epg_handle hdl;
 	plugcall_setup_handle(plugin, &hdl);
-	r = plugin->fc_load(&hdl);
+	if(plugin->fc_load != NULL)
+	{
+		struct plugin_profile_clock clock;
+		plugin_profile_start(&clock);
+		r = plugin->fc_load(&hdl);
+		plugin_profile_end(plugin->profile, PLUGIN_CALL_LOAD, &clock, 0);
+	}
 	if(r)
 	{
 		dprintf(stderr_fd, _("Cannot load plugin: it returned an error: %d.\n"), r);
@@ -2,9 +2,37 @@
 #define _PLUGINS_H
 
 #include "plugin/plugin.h"
+#include "rcon_sched.h"
+#include "rcon_stats.h"
+#include "plugin_queue.h"
+#include "plugin_filter.h"
+
+/* Stable reference to a loaded plugin: the generation of its slot in the high 32 bits, the slot in the
+ * low ones. A reference no longer resolves once the plugin is unloaded, even if the slot is reused. */
+typedef uint64_t plugin_ref;
+
+struct plugin_profile;
+struct plugin_host;
+
+/* Same order as the EPG_EVENT_* bits. */
+enum plugin_event {
+	PLUGIN_EVENT_PLAYER_JOIN,
+	PLUGIN_EVENT_PLAYER_LEAVE,
+	PLUGIN_EVENT_PLAYER_ACHIEVEMENT,
+	PLUGIN_EVENT_PLAYER_CHALLENGE,
+	PLUGIN_EVENT_PLAYER_GOAL,
+	PLUGIN_EVENT_PLAYER_SAY,
+	PLUGIN_EVENT_PLAYER_DIE,
+	PLUGIN_EVENT_SERVER_STOPPING,
+	PLUGIN_EVENT_SERVER_STARTING,
+	PLUGIN_EVENT_SERVER_STARTED,
+	PLUGIN_EVENT_COUNT
+};
 
 struct plugin_call_job_args {
-	int id;
+	plugin_ref plugin;
+	/* When the event was scheduled, see plugin_profile_now(). */
+	uint64_t queued_ns;
 	char *arg1;
 	char *arg2;
 	char *arg3;
@@ -12,12 +40,53 @@ struct plugin_call_job_args {
 	char *arg5;
 };
 
+/* A chat command of a plugin. */
+struct plugin_command {
+	char *name;
+	int min_args;
+	int max_args;
+	int (*handler)(struct epg_handle *, char *, int, char **);
+	/* Updated while dispatching. */
+	uint64_t calls;
+	uint64_t rejected;
+	/* Set once the plugin is loaded. */
+	struct plugin *plugin;
+	struct plugin_command *next;
+};
+
 struct plugin {
+	plugin_ref ref;
+	/* Unique per load: a reload keeps the reference but not the instance. Owner of the timers and
+	 * async commands of the plugin. */
+	uint64_t instance;
+	/* Handlers running. Guarded by the registry. */
+	int running;
 	const char *id;
-	const char *path;
+	char *path;
 	void *handle;
+	/* What handle was opened through on a reload, -1 otherwise. Open as long as the library: the name
+	 * dlopen knows it by must stay unique. */
+	int lib_fd;
 	char *name;
 	uint32_t version;
+	/* EPG_EVENT_* */
+	uint32_t events;
+	/* EPG_CONCURRENCY_* */
+	uint32_t concurrency;
+	uint32_t max_latency_ms;
+	/* Serialized and pinned plugins. */
+	struct plugin_queue *queue;
+	/* Per event, NULL if not filtered. */
+	struct plugin_filter *filters[PLUGIN_EVENT_COUNT];
+	/* Events scheduled and skipped by the filters. Updated while dispatching. */
+	uint64_t delivered;
+	uint64_t filtered;
+	struct plugin_command *commands;
+	struct rcon_sched_bucket *rcon_bucket;
+	struct rcon_stats *rcon_stats;
+	struct plugin_profile *profile;
+	/* NULL unless the plugin is isolated in a host process, which has the handlers. */
+	struct plugin_host *host;
 	int (*fc_load)(struct epg_handle *);
 	int (*fc_unload)(struct epg_handle *);
 	int (*fc_player_join)(struct epg_handle *, char *);
@@ -30,9 +99,13 @@ struct plugin {
 	int (*fc_server_stopping)(struct epg_handle *);
 	int (*fc_server_starting)(struct epg_handle *, char *);
 	int (*fc_server_started)(struct epg_handle *, char *);
+	void *(*fc_reload_save)(struct epg_handle *);
+	int (*fc_reload_restore)(struct epg_handle *, void *);
 };
 
 int plugin_load_meta(int stderr_fd, const char *path, struct plugin *out);
+/* Start a host process for the library instead of opening it. */
+int plugin_load_meta_isolated(int stderr_fd, const char *path, struct plugin *out);
 int plugin_load(int stderr_fd, const struct plugin *plugin);
 int plugin_unload_meta(int stderr_fd, struct plugin *plugin);
 int plugin_unload(int stderr_fd, const struct plugin *plugin);
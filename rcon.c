@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 int rcon_send_packet(int sd, struct rc_packet *packet)
 {
@@ -54,60 +55,95 @@ int rcon_build_packet(struct rc_packet *out, int id, int cmd, char *s1)
 	return EX_OK;
 }
 
-int rcon_recv_packet(struct rc_packet *out, int sd)
+/* Milliseconds left until the deadline, or -1 to block. */
+static int rcon_poll_timeout(const struct timespec *deadline)
 {
-        int psize;
-
-        int ret = recv(sd, (char *) &psize, sizeof(int), 0);
+	if(deadline == NULL) return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	if(ms <= 0) return 0;
+	return ms;
+}
 
-        if (ret == 0)
-	{
-                fprintf(stderr, _("Connection lost.\n"));
-                return EX_IOERR;
-        }
-	if(ret == -1)
+static int rcon_recv_all(int sd, char *buf, int len, const struct timespec *deadline)
+{
+	int received = 0;
+	while(received < len)
 	{
-		fprintf(stderr, _("recv(): %d\n"), errno);
-		return EX_IOERR;
+		if(deadline != NULL)
+		{
+			struct pollfd pfd = { sd, POLLIN, 0 };
+			const int ready = poll(&pfd, 1, rcon_poll_timeout(deadline));
+			if(ready == -1)
+			{
+				if(errno == EINTR) continue;
+				fprintf(stderr, _("poll(): %s.\n"), strerror(errno));
+				return EX_IOERR;
+			}
+			if(ready == 0)
+				return EX_TEMPFAIL;
+		}
+		const ssize_t ret = recv(sd, buf + received, len - received, 0);
+		if(ret == 0)
+		{
+			fprintf(stderr, _("Connection lost.\n"));
+			return EX_IOERR;
+		}
+		if(ret == -1)
+		{
+			/* Non-blocking sockets are only read with a deadline, polled above. */
+			if(errno == EINTR || (deadline != NULL && (errno == EAGAIN || errno == EWOULDBLOCK))) continue;
+			fprintf(stderr, _("recv(): %d\n"), errno);
+			return EX_IOERR;
+		}
+		received += ret;
 	}
+	return EX_OK;
+}
 
-        if (ret != sizeof(int))
-	{
-                fprintf(stderr, _("Error: recv() failed. Invalid packet size (%d).\n"), ret);
-                return EX_IOERR;
-        }
+/* Receive the header and then the body straight into body. */
+static int rcon_recv_split(int sd, const struct timespec *deadline, int *size, int *id, int *cmd, char *body)
+{
+	// size + id + cmd
+	int header[3];
+	int ret = rcon_recv_all(sd, (char *) header, sizeof(header), deadline);
+	if (ret) return ret;
 
-        if (psize < 10 || psize > RCON_DATA_BUFFSIZE)
+	const int psize = header[0];
+	if (psize < 10 || psize > RCON_PACKET_MAXSIZE)
 	{
-                fprintf(stderr, _("Warning: invalid packet size (%d). Must over 10 and less than %d.\n"), psize, RCON_DATA_BUFFSIZE);
-
-                if(psize > RCON_DATA_BUFFSIZE  || psize < 0) psize = RCON_DATA_BUFFSIZE;
-		// Former net_clean_incoming.
-		char tmp[psize];
-		ret = recv(sd, tmp, psize, 0);
-
-	        if(ret == 0)
-		{
-			fprintf(stderr, _("Connection lost.\n"));
-		}
+		fprintf(stderr, _("Warning: invalid packet size (%d). Must over 10 and less than %d.\n"), psize, RCON_PACKET_MAXSIZE);
+		// The stream cannot be resynchronised.
+		return EX_IOERR;
+	}
 
-                return EX_DATAERR;
-        }
+	ret = rcon_recv_all(sd, body, psize - sizeof(int) * 2, deadline);
+	if (ret) return ret;
+	// Guard against servers which do not terminate the body.
+	body[psize - 9] = '\0';
+	*size = psize;
+	*id = header[1];
+	*cmd = header[2];
 
-        out->size = psize;
+	return EX_OK;
+}
 
-        int received = 0;
-        while (received < psize)
-	{
-                ret = recv(sd, (char *) out + sizeof(int) + received, psize - received, 0);
-                if (ret == 0) // connection closed before completing receving
-		{
-                        fprintf(stderr, _("Connection lost.\n"));
-                        return EX_IOERR;
-                }
+int rcon_recv_packet_deadline(struct rc_packet *out, int sd, const struct timespec *deadline)
+{
+	return rcon_recv_split(sd, deadline, &out->size, &out->id, &out->cmd, out->data);
+}
 
-                received += ret;
-        }
+int rcon_recv_packet_body(int sd, const struct timespec *deadline, int *id, int *cmd, char *body, size_t *body_len)
+{
+	int size;
+	const int ret = rcon_recv_split(sd, deadline, &size, id, cmd, body);
+	if (ret) return ret;
+	*body_len = strlen(body);
+	return EX_OK;
+}
 
-        return EX_OK;
+int rcon_recv_packet(struct rc_packet *out, int sd)
+{
+	return rcon_recv_packet_deadline(out, sd, NULL);
 }
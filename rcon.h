@@ -8,22 +8,34 @@
 
 #include "plugin/common.h"
 
+#include <stddef.h>
+#include <time.h>
+
 #define RCON_EXEC_COMMAND       2
 #define RCON_AUTHENTICATE       3
 #define RCON_RESPONSEVALUE      0
 #define RCON_AUTH_RESPONSE      2
 #define RCON_PID                0xBADC0DE
+// id + cmd + body + two NULL terminators
+#define RCON_PACKET_MAXSIZE     (RCON_DATA_BUFFSIZE + 10)
+// body + two NULL terminators
+#define RCON_PACKET_BODY_MAXSIZE        (RCON_DATA_BUFFSIZE + 2)
 
 struct rc_packet {
     int size;
     int id;
     int cmd;
-    char data[RCON_DATA_BUFFSIZE];
+    char data[RCON_DATA_BUFFSIZE + 2];
     // ignoring string2 for now
 };
 
 int rcon_send_packet(int sd, struct rc_packet *packet);
 int rcon_build_packet(struct rc_packet *out, int id, int cmd, char *s1);
 int rcon_recv_packet(struct rc_packet *out, int sd);
+/* Returns EX_TEMPFAIL once the CLOCK_MONOTONIC deadline passes. A NULL deadline blocks. */
+int rcon_recv_packet_deadline(struct rc_packet *out, int sd, const struct timespec *deadline);
+/* Like rcon_recv_packet_deadline, but the body is received in place into a buffer of at least
+ * RCON_PACKET_BODY_MAXSIZE bytes, so replies can be assembled without copying. */
+int rcon_recv_packet_body(int sd, const struct timespec *deadline, int *id, int *cmd, char *body, size_t *body_len);
 
 #endif // _RCON_H
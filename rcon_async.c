@@ -0,0 +1,573 @@
+#include "rcon_async.h"
+#include "rcon_host.h"
+#include "rcon.h"
+#include "hist.h"
+#include "threads_util.h"
+#include "plugin/plugin.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+struct rcon_async_req {
+	struct rcon_async_reply reply;
+	uint64_t owner;
+	/* The end marker is id + 1. */
+	int id;
+	struct timespec deadline;
+	struct timespec start;
+	uint64_t start_ns;
+	struct rcon_sched_bucket *bucket;
+	int lane;
+	void (*complete)(struct rcon_async_reply *);
+	void (*arg_free)(void *);
+	struct plugin_queue *queue;
+	bool cancelled;
+	bool running;
+	/* The reply is assembled here. */
+	char *buf;
+	size_t len;
+	size_t cap;
+	/* In the pending or in-flight list. */
+	struct rcon_async_req *next;
+	/* Every request until its completion returned. */
+	struct rcon_async_req *live_prev;
+	struct rcon_async_req *live_next;
+	char command[];
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* A completion returned. */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct rcon_async_req *pending_head = NULL;
+static struct rcon_async_req *pending_tail = NULL;
+static size_t pending_count = 0;
+/* Sent, in the order the server answers. */
+static struct rcon_async_req *inflight_head = NULL;
+static struct rcon_async_req *inflight_tail = NULL;
+static size_t inflight_count = 0;
+static struct rcon_async_req *live = NULL;
+static int next_id = 0;
+
+/* Owned by the reactor. */
+static int conn_fd = -1;
+static uint64_t conn_generation = 0;
+/* The packets of the commands in flight not written yet. The socket is non-blocking and written
+ * without async_mutex, so a server which stops reading never blocks the submitters. */
+static char *out_buf = NULL;
+static size_t out_len = 0;
+static size_t out_off = 0;
+/* Two packets per command in flight. */
+#define RCON_ASYNC_OUT_SIZE	(RCON_HOST_PIPELINE * 2 * (RCON_PACKET_MAXSIZE + sizeof(int)))
+/* Plugins whose bucket is empty, skipped for the rest of a pass to keep their commands in order. */
+#define RCON_ASYNC_BLOCKED_MAX	16
+
+/* Wakes the reactor up from poll. */
+static int wake_pipe[2] = { -1, -1 };
+static bool async_quit = false;
+static bool reactor_init = false;
+static pthread_t reactor;
+static threadpool pool = NULL;
+
+static uint64_t total_commands = 0;
+static uint64_t total_replies = 0;
+static uint64_t total_failed = 0;
+static uint64_t total_rejected = 0;
+static size_t max_inflight = 0;
+/* Submission to reply. */
+static struct hist rtt;
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Milliseconds until the deadline, rounded up so that poll returns after it. */
+static int ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms < 0 ? 0 : (int)ms;
+}
+
+static bool deadline_passed(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* Caller holds async_mutex, for all of the following. */
+static void req_free(struct rcon_async_req *req)
+{
+	if(req->live_prev != NULL) req->live_prev->live_next = req->live_next;
+	else live = req->live_next;
+	if(req->live_next != NULL) req->live_next->live_prev = req->live_prev;
+	if(req->arg_free != NULL) req->arg_free(req->reply.arg);
+	free(req->buf);
+	free(req);
+}
+
+static void reply_job(void *arg)
+{
+	struct rcon_async_req *req = arg;
+	pthread_mutex_lock(&async_mutex);
+	const bool run = !req->cancelled;
+	req->running = run;
+	pthread_mutex_unlock(&async_mutex);
+	if(run) req->complete(&req->reply);
+	pthread_mutex_lock(&async_mutex);
+	req->running = false;
+	pthread_cond_broadcast(&done_cond);
+	req_free(req);
+	pthread_mutex_unlock(&async_mutex);
+}
+
+/* Schedule the completion of a request taken off its list. */
+static void finish(struct rcon_async_req *req, int status)
+{
+	if(req->cancelled)
+	{
+		req_free(req);
+		return;
+	}
+	req->reply.status = status;
+	req->reply.data = req->buf != NULL ? req->buf : "";
+	req->reply.len = req->len;
+	req->reply.queued_ns = now_ns();
+	req->reply.rtt_ns = req->reply.queued_ns - req->start_ns;
+	if(status)
+	{
+		total_failed ++;
+	}
+	else
+	{
+		total_replies ++;
+		hist_add(&rtt, req->reply.rtt_ns);
+	}
+	int r = 0;
+	if(req->queue != NULL)
+		r = plugin_queue_push(req->queue, pool, &reply_job, req);
+	else
+		r = thpool_add_work(pool, &reply_job, req);
+	if(r)
+	{
+		DEBUGF("rcon_async.c#finish: Cannot schedule the completion: %d.\n", r);
+		req_free(req);
+	}
+}
+
+static void fail_all(struct rcon_async_req **head, struct rcon_async_req **tail, int status)
+{
+	struct rcon_async_req *req = *head;
+	*head = NULL;
+	*tail = NULL;
+	while(req != NULL)
+	{
+		struct rcon_async_req *next = req->next;
+		finish(req, status);
+		req = next;
+	}
+}
+
+/* Close the connection. The commands in flight are lost with it. */
+static void conn_drop(int status)
+{
+	if(conn_fd != -1)
+	{
+		DEBUGF("rcon_async.c#conn_drop: Closing rcon socket %d: %d.\n", conn_fd, status);
+		close(conn_fd);
+	}
+	conn_fd = -1;
+	conn_generation = 0;
+	out_len = 0;
+	out_off = 0;
+	fail_all(&inflight_head, &inflight_tail, status);
+	inflight_count = 0;
+}
+
+static int out_append(int id, int cmd, char *body)
+{
+	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
+	const int r = rcon_build_packet(&pkgt, id, cmd, body);
+	if(r) return r;
+	const size_t len = pkgt.size + sizeof(int);
+	memcpy(&out_buf[out_len], &pkgt, len);
+	out_len += len;
+	return 0;
+}
+
+/*
+ * Move the commands that got their tokens in flight, in order except that a plugin short of tokens
+ * does not hold back the others. Their packets are only written later by out_flush.
+ * Returns the nanoseconds until more commands may get their tokens, 0 if none wait for them.
+ */
+static uint64_t queue_pending()
+{
+	uint64_t wait_ns = 0;
+	struct rcon_sched_bucket *blocked[RCON_ASYNC_BLOCKED_MAX];
+	int blocked_count = 0;
+	if(out_off == out_len) out_off = out_len = 0;
+	else if(out_off > 0)
+	{
+		memmove(out_buf, &out_buf[out_off], out_len - out_off);
+		out_len -= out_off;
+		out_off = 0;
+	}
+	struct rcon_async_req *prev = NULL;
+	struct rcon_async_req *req = pending_head;
+	while(req != NULL && inflight_count < RCON_HOST_PIPELINE)
+	{
+		struct rcon_async_req *next = req->next;
+		int r = 0;
+		bool skip = false;
+		if(!req->cancelled && !deadline_passed(&req->deadline))
+		{
+			for(int i = 0; i < blocked_count && !skip; i ++)
+				skip = req->bucket == blocked[i];
+			uint64_t eta = 0;
+			bool only_bucket = false;
+			if(!skip && rcon_sched_try_acquire(req->bucket, req->lane, &req->start, &eta, &only_bucket))
+			{
+				if(wait_ns == 0 || eta < wait_ns) wait_ns = eta;
+				if(!only_bucket || blocked_count == RCON_ASYNC_BLOCKED_MAX) break;
+				blocked[blocked_count ++] = req->bucket;
+				skip = true;
+			}
+		}
+		if(skip)
+		{
+			prev = req;
+			req = next;
+			continue;
+		}
+		if(prev == NULL) pending_head = next;
+		else prev->next = next;
+		if(pending_tail == req) pending_tail = prev;
+		pending_count --;
+		req->next = NULL;
+		if(req->cancelled)
+		{
+			req_free(req);
+			req = next;
+			continue;
+		}
+		if(deadline_passed(&req->deadline))
+		{
+			finish(req, EPG_RCON_TIMEOUT);
+			req = next;
+			continue;
+		}
+		req->id = RCON_ASYNC_ID + next_id;
+		next_id = (next_id + 2) % RCON_ASYNC_ID_SPAN;
+		r = out_append(req->id, RCON_EXEC_COMMAND, req->command);
+		/* Answered in order after the command, like in rcon_host_exec_view. */
+		if(!r) r = out_append(req->id + 1, RCON_RESPONSEVALUE, "");
+		if(r)
+		{
+			finish(req, r);
+			req = next;
+			continue;
+		}
+		if(inflight_tail == NULL) inflight_head = req;
+		else inflight_tail->next = req;
+		inflight_tail = req;
+		inflight_count ++;
+		total_commands ++;
+		if(inflight_count > max_inflight) max_inflight = inflight_count;
+		req = next;
+	}
+	return wait_ns;
+}
+
+/* Write what the socket takes without blocking. Only the reactor calls this, without async_mutex. */
+static int out_flush(int fd)
+{
+	while(out_off < out_len)
+	{
+		const ssize_t n = send(fd, &out_buf[out_off], out_len - out_off, 0);
+		if(n == -1)
+		{
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			fprintf(stderr, _("send(): %s.\n"), strerror(errno));
+			return EX_IOERR;
+		}
+		out_off += n;
+	}
+	return 0;
+}
+
+static void handle_packet(int id, const char *body, size_t len)
+{
+	struct rcon_async_req *req = inflight_head;
+	if(req == NULL || (id != req->id && id != req->id + 1))
+	{
+		DEBUGF("rcon_async.c#handle_packet: Dropping stale packet %d.\n", id);
+		return;
+	}
+	if(id == req->id)
+	{
+		if(req->cancelled) return;
+		if(req->len + len + 1 > req->cap)
+		{
+			size_t cap = req->cap == 0 ? RCON_PACKET_BODY_MAXSIZE : req->cap;
+			while(cap < req->len + len + 1) cap *= 2;
+			char *buf = realloc(req->buf, cap);
+			if(buf == NULL)
+			{
+				fprintf(stderr, _("Cannot allocate memory: %d.\n"), errno);
+				return;
+			}
+			req->buf = buf;
+			req->cap = cap;
+		}
+		memcpy(&req->buf[req->len], body, len);
+		req->len += len;
+		req->buf[req->len] = '\0';
+		return;
+	}
+	inflight_head = req->next;
+	if(inflight_head == NULL) inflight_tail = NULL;
+	inflight_count --;
+	req->next = NULL;
+	finish(req, 0);
+}
+
+static void *reactor_main(void *arg)
+{
+	thread_set_name("rcon-async");
+	char body[RCON_PACKET_BODY_MAXSIZE];
+	pthread_mutex_lock(&async_mutex);
+	while(!async_quit)
+	{
+		int r = 0;
+		/* Reconnect between commands when the server changed. */
+		if(pending_head != NULL && inflight_head == NULL && (conn_fd == -1 || !rcon_host_current(conn_generation)))
+		{
+			conn_drop(0);
+			pthread_mutex_unlock(&async_mutex);
+			int fd = -1;
+			uint64_t generation = 0;
+			r = rcon_host_connect(&fd, &generation);
+			pthread_mutex_lock(&async_mutex);
+			if(!r && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+			{
+				r = errno;
+				close(fd);
+			}
+			if(r)
+			{
+				fail_all(&pending_head, &pending_tail, r);
+				pending_count = 0;
+				continue;
+			}
+			conn_fd = fd;
+			conn_generation = generation;
+		}
+		uint64_t wait_ns = 0;
+		if(conn_fd != -1) wait_ns = queue_pending();
+		const bool waiting = inflight_head != NULL;
+		struct timespec deadline = { 0, 0 };
+		if(waiting) deadline = inflight_head->deadline;
+		const int fd = conn_fd;
+		pthread_mutex_unlock(&async_mutex);
+		if(waiting) r = out_flush(fd);
+		int timeout = waiting ? ms_until(&deadline) : -1;
+		if(wait_ns != 0)
+		{
+			const uint64_t wait_ms = (wait_ns + 999999) / 1000000;
+			if(timeout == -1 || wait_ms < (uint64_t)timeout) timeout = (int)wait_ms;
+		}
+		const short events = POLLIN | (out_off < out_len ? POLLOUT : 0);
+		struct pollfd pfds[2] = { { wake_pipe[0], POLLIN, 0 }, { waiting ? fd : -1, events, 0 } };
+		const int ready = r ? 0 : poll(pfds, 2, timeout);
+		if(pfds[0].revents & POLLIN)
+		{
+			char drain[64];
+			while(read(wake_pipe[0], drain, sizeof(drain)) > 0);
+		}
+		bool received = false;
+		int id = 0, cmd = 0;
+		size_t len = 0;
+		/* Writable only: flushed on the next turn. */
+		if(!r && waiting && ready > 0 && (pfds[1].revents & ~POLLOUT))
+		{
+			/* Only the rest of a packet that started arriving is waited for. */
+			r = rcon_recv_packet_body(fd, &deadline, &id, &cmd, body, &len);
+			received = !r;
+		}
+		else if(!r && waiting && ready == 0 && deadline_passed(&deadline))
+		{
+			r = EX_TEMPFAIL;
+		}
+		pthread_mutex_lock(&async_mutex);
+		if(r)
+		{
+			conn_drop(r == EX_TEMPFAIL ? EPG_RCON_TIMEOUT : r);
+			continue;
+		}
+		if(received) handle_packet(id, body, len);
+	}
+	conn_drop(ECANCELED);
+	fail_all(&pending_head, &pending_tail, ECANCELED);
+	pending_count = 0;
+	pthread_mutex_unlock(&async_mutex);
+	return NULL;
+}
+
+int rcon_async_init(threadpool thpool)
+{
+	int r = 0;
+	pool = thpool;
+	hist_reset(&rtt);
+	out_buf = malloc(RCON_ASYNC_OUT_SIZE);
+	if(out_buf == NULL)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	if(pipe(wake_pipe))
+	{
+		r = errno;
+		goto cleanup;
+	}
+	for(int i = 0; i < 2; i ++)
+		fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+	r = pthread_create(&reactor, NULL, &reactor_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	reactor_init = true;
+cleanup:
+	if(r) rcon_async_free();
+	return r;
+}
+
+static void wake()
+{
+	const char c = 0;
+	if(write(wake_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+		DEBUGF("rcon_async.c#wake: Cannot wake the reactor up: %d.\n", errno);
+}
+
+void rcon_async_free()
+{
+	if(reactor_init)
+	{
+		pthread_mutex_lock(&async_mutex);
+		async_quit = true;
+		pthread_mutex_unlock(&async_mutex);
+		wake();
+		pthread_join(reactor, NULL);
+		reactor_init = false;
+	}
+	for(int i = 0; i < 2; i ++)
+	{
+		if(wake_pipe[i] != -1) close(wake_pipe[i]);
+		wake_pipe[i] = -1;
+	}
+	free(out_buf);
+	out_buf = NULL;
+}
+
+int rcon_async_exec(uint64_t owner, const char *command, int timeout_ms, struct rcon_sched_bucket *bucket, int lane,
+		void (*complete)(struct rcon_async_reply *), void *arg, void (*arg_free)(void *), struct plugin_queue *queue)
+{
+	int r = 0;
+	const size_t len = strlen(command);
+	if(timeout_ms <= 0 || len > RCON_DATA_BUFFSIZE) return 64;
+	struct rcon_async_req *req = calloc(1, sizeof(struct rcon_async_req) + len + 1);
+	if(req == NULL) return errno;
+	memcpy(req->command, command, len + 1);
+	req->owner = owner;
+	req->bucket = bucket;
+	req->lane = lane;
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	req->start_ns = (uint64_t)req->start.tv_sec * 1000000000 + req->start.tv_nsec;
+	req->deadline = req->start;
+	req->deadline.tv_sec += timeout_ms / 1000;
+	req->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(req->deadline.tv_nsec >= 1000000000L)
+	{
+		req->deadline.tv_sec ++;
+		req->deadline.tv_nsec -= 1000000000L;
+	}
+	req->complete = complete;
+	req->reply.arg = arg;
+	req->arg_free = arg_free;
+	req->queue = queue;
+	pthread_mutex_lock(&async_mutex);
+	if(!reactor_init || async_quit)
+	{
+		r = ECANCELED;
+		goto cleanup;
+	}
+	if(pending_count >= RCON_ASYNC_PENDING_MAX)
+	{
+		total_rejected ++;
+		r = ENOSPC;
+		goto cleanup;
+	}
+	if(pending_tail == NULL) pending_head = req;
+	else pending_tail->next = req;
+	pending_tail = req;
+	pending_count ++;
+	req->live_next = live;
+	if(live != NULL) live->live_prev = req;
+	live = req;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&async_mutex);
+	if(r) free(req);
+	else wake();
+	return r;
+}
+
+void rcon_async_cancel_owner(uint64_t owner)
+{
+	pthread_mutex_lock(&async_mutex);
+	for(struct rcon_async_req *req = live; req != NULL; req = req->live_next)
+		if(req->owner == owner) req->cancelled = true;
+	while(true)
+	{
+		bool running = false;
+		for(struct rcon_async_req *req = live; req != NULL && !running; req = req->live_next)
+			running = req->owner == owner && req->running;
+		if(!running) break;
+		pthread_cond_wait(&done_cond, &async_mutex);
+	}
+	pthread_mutex_unlock(&async_mutex);
+}
+
+void rcon_async_dump(int out)
+{
+	pthread_mutex_lock(&async_mutex);
+	const size_t pending = pending_count, inflight = inflight_count, inflight_max = max_inflight;
+	const uint64_t commands = total_commands, replies = total_replies, failed = total_failed, rejected = total_rejected;
+	const struct hist h = rtt;
+	pthread_mutex_unlock(&async_mutex);
+	dprintf(out, _("Pending:\t%zu (at most %d)\nIn flight:\t%zu (at most %zu)\nCommands:\t%" PRIu64 "\nReplies:\t%" PRIu64 "\nFailed:\t%" PRIu64 "\nRejected:\t%" PRIu64 "\n"),
+			pending, RCON_ASYNC_PENDING_MAX, inflight, inflight_max, commands, replies, failed, rejected);
+	dprintf(out, _("Round trip (us):\tp50 %" PRIu64 "\tp99 %" PRIu64 "\tmax %" PRIu64 "\n"),
+			hist_percentile_us(&h, 0.5),
+			hist_percentile_us(&h, 0.99),
+			h.max_ns / 1000);
+}
@@ -0,0 +1,50 @@
+#ifndef _RCON_ASYNC_H
+#define _RCON_ASYNC_H
+
+#include "thpool.h"
+#include "plugin_queue.h"
+#include "rcon_sched.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Async requests use consecutive pairs of ids from here: the command and the marker of its end. */
+#define RCON_ASYNC_ID		0x41000000
+#define RCON_ASYNC_ID_SPAN	0x100000
+/* Commands waiting to be sent, beyond which rcon_async_exec fails with ENOSPC. */
+#define RCON_ASYNC_PENDING_MAX	1024
+
+struct rcon_async_reply {
+	/* 0, EPG_RCON_TIMEOUT, or why the command could not be sent. */
+	int status;
+	/* NULL terminated. Valid during the completion. */
+	const char *data;
+	size_t len;
+	/* Submission to completion. */
+	uint64_t rtt_ns;
+	/* When the completion was scheduled, in CLOCK_MONOTONIC nanoseconds. */
+	uint64_t queued_ns;
+	void *arg;
+};
+
+/*
+ * Rcon commands whose replies are handed to a completion instead of a waiting thread.
+ * A reactor thread owns one connection, keeps up to RCON_HOST_PIPELINE commands in flight
+ * on it and schedules each completion on the thread pool, or on the queue given with the command.
+ * The reactor charges the rate limits as it sends, so submitting never blocks.
+ */
+int rcon_async_init(threadpool thpool);
+/* Commands not answered yet complete with ECANCELED. */
+void rcon_async_free();
+
+/* complete(reply) runs once, unless owner is cancelled first. arg_free(arg) is called after that.
+ * The command takes a token of bucket (may be NULL) in lane, like rcon_sched_acquire. bucket must
+ * stay valid until owner is cancelled. */
+int rcon_async_exec(uint64_t owner, const char *command, int timeout_ms, struct rcon_sched_bucket *bucket, int lane,
+		void (*complete)(struct rcon_async_reply *), void *arg, void (*arg_free)(void *), struct plugin_queue *queue);
+/* Drop the commands of owner and wait for their running completions. Not from one of these completions. */
+void rcon_async_cancel_owner(uint64_t owner);
+
+void rcon_async_dump(int out);
+
+#endif // _RCON_ASYNC_H
@@ -2,7 +2,8 @@
 #include "rcon.h"
 #include "net.h"
 #include "plugin/plugin.h"
-#include "md5.h"
+#include "config.h"
+#include "threads_util.h"
 
 #include <string.h>
 #include <unistd.h>
@@ -12,169 +13,531 @@
 #include "common.h"
 #include <errno.h>
 #include <stdbool.h>
+#include <sysexits.h>
+#include <time.h>
+#include <limits.h>
+
+/* After a failed connection, other workers fail fast for this long instead of queueing up on the dead server. */
+#define RCON_HOST_HOLDOFF_MS	1000
+/* Reconnect backoff after the server announced it is ready. */
+#define RCON_HOST_PREWARM_BACKOFF_MIN	100
+#define RCON_HOST_PREWARM_BACKOFF_MAX	10000
+/* Receive buffers grown beyond this by a long reply are dropped when the lease ends. */
+#define RCON_HOST_BUF_KEEP	65536
 
 static bool pthread_key_init = false;
 static pthread_key_t key_rcon_fd;
 
-static struct rcon_host_connarg *connarg;
-static uint64_t connarg_existing_hash_1;
-static uint64_t connarg_existing_hash_2;
+static pthread_mutex_t holdoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec holdoff_until = { 0, 0 };
+
+enum rcon_server_state {
+	/* No lifecycle event seen yet. Connect lazily. */
+	RCON_SERVER_UNKNOWN,
+	RCON_SERVER_STOPPED,
+	RCON_SERVER_STARTED
+};
 
-struct rcon_thread_data {
+struct rcon_conn {
 	int fd;
-	uint64_t connarg_hash_1;
-	uint64_t connarg_hash_2;
+	/* config rcon_generation the connection was authenticated with. */
+	uint64_t generation;
+	bool busy;
+	/* Close on release: the server went away while it was leased. */
+	bool stale;
+	/* Replies are received in place here and lent to the lessee as views. */
+	char *buf;
+	size_t buf_cap;
+	/* Held by one thread until it exits, outside the pool. */
+	bool owned;
+	struct rcon_conn *next;
 };
 
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* On CLOCK_MONOTONIC, like the deadlines of the callers. */
+static pthread_cond_t pool_cond;
+static bool pool_cond_init = false;
+static struct rcon_conn *pool = NULL;
+static int pool_size = 0;
+/* Connections given to threads by rcon_host_own(). Guarded by pool_mutex. */
+static struct rcon_conn *owned = NULL;
+static enum rcon_server_state server_state = RCON_SERVER_UNKNOWN;
+
+static pthread_cond_t prewarm_cond;
+static bool prewarm_cond_init = false;
+static bool prewarm_requested = false;
+static bool prewarm_quit = false;
+static bool prewarm_thread_init = false;
+static pthread_t prewarm_thread;
+
+static void conn_close(struct rcon_conn *conn)
+{
+	if(conn->fd != -1)
+	{
+		DEBUGF("rcon_host.c#conn_close: Closing rcon socket %d\n", conn->fd);
+		close(conn->fd);
+	}
+	conn->fd = -1;
+	conn->generation = 0;
+}
+
+/* Return the lease. Caller holds pool_mutex. */
+static void conn_release_locked(struct rcon_conn *conn)
+{
+	if(conn->stale) conn_close(conn);
+	conn->stale = false;
+	if(conn->buf_cap > RCON_HOST_BUF_KEEP)
+	{
+		free(conn->buf);
+		conn->buf = NULL;
+		conn->buf_cap = 0;
+	}
+	if(conn->owned) return;
+	conn->busy = false;
+	pthread_cond_signal(&pool_cond);
+}
+
 static void destructor(void *data)
 {
 	DEBUGF("rcon_host.c#destructor: (%p)\n", data);
-	struct rcon_thread_data *dat = (struct rcon_thread_data *)data;
-	if(dat->fd != -1)
+	struct rcon_conn *conn = data;
+	pthread_mutex_lock(&pool_mutex);
+	if(conn->owned)
 	{
-		DEBUGF("rcon_host.c#destructor: Closing rcon socket %d\n", dat->fd);
-		close(dat->fd);
+		struct rcon_conn **link = &owned;
+		while(*link != conn) link = &(*link)->next;
+		*link = conn->next;
+		conn_close(conn);
+		free(conn->buf);
+		free(conn);
 	}
-	free(dat);
+	/* The pool may already be gone when detached workers exit late. */
+	else if(pool != NULL) conn_release_locked(conn);
+	pthread_mutex_unlock(&pool_mutex);
 }
 
-/* https://stackoverflow.com/a/25669375/6792243 */
-static uint64_t uint8ArrtoUint64(uint8_t *var, uint32_t lowest_pos)
+static bool holdoff_active()
 {
-    return  (((uint64_t)var[lowest_pos+7]) << 56) | 
-            (((uint64_t)var[lowest_pos+6]) << 48) |
-            (((uint64_t)var[lowest_pos+5]) << 40) | 
-            (((uint64_t)var[lowest_pos+4]) << 32) |
-            (((uint64_t)var[lowest_pos+3]) << 24) | 
-            (((uint64_t)var[lowest_pos+2]) << 16) |
-            (((uint64_t)var[lowest_pos+1]) << 8)  | 
-            (((uint64_t)var[lowest_pos])   << 0);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&holdoff_mutex);
+	const bool active = now.tv_sec < holdoff_until.tv_sec ||
+		(now.tv_sec == holdoff_until.tv_sec && now.tv_nsec < holdoff_until.tv_nsec);
+	pthread_mutex_unlock(&holdoff_mutex);
+	return active;
 }
 
-static void connarg_hash_update(struct rcon_host_connarg *connarg)
+static void holdoff_set(const int ms)
 {
-	uint64_t hash_1 = 0;
-	uint64_t hash_2 = 0;
-	if(connarg != NULL)
-	{
-		MD5Context ctx;
-		md5Init(&ctx);
-		if(connarg->host != NULL) md5Update(&ctx, (uint8_t *)connarg->host, sizeof(char) * strlen(connarg->host));
-		if(connarg->port != NULL) md5Update(&ctx, (uint8_t *)connarg->port, sizeof(char) * strlen(connarg->port));
-		if(connarg->password != NULL) md5Update(&ctx, (uint8_t *)connarg->password, sizeof(char) * strlen(connarg->password));
-		md5Finalize(&ctx);
-		hash_1 = uint8ArrtoUint64(ctx.digest, 0);
-		hash_2 = uint8ArrtoUint64(ctx.digest, 8);
-	}
-	connarg_existing_hash_1 = hash_1;
-	connarg_existing_hash_2 = hash_2;
-	DEBUGF("rcon_host.c#connarg_hash: %lu%lu.\n", hash_1, hash_2);
+	struct timespec until = { 0, 0 };
+	if(ms > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &until);
+		until.tv_sec += ms / 1000;
+		until.tv_nsec += (ms % 1000) * 1000000L;
+		if(until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec ++;
+			until.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&holdoff_mutex);
+	holdoff_until = until;
+	pthread_mutex_unlock(&holdoff_mutex);
+}
+
+void rcon_host_deadline(struct timespec *out, const int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, out);
+	out->tv_sec += ms / 1000;
+	out->tv_nsec += (ms % 1000) * 1000000L;
+	if(out->tv_nsec >= 1000000000L)
+	{
+		out->tv_sec ++;
+		out->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Milliseconds left until deadline, rounded up. 0 once it passed. */
+static int ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!ts_before(&now, deadline)) return 0;
+	const int64_t ms = ((int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000LL + deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
 }
 
 static int rcon_host_clear_current_thread_socket()
 {
-	struct rcon_thread_data *data = pthread_getspecific(key_rcon_fd);
-	if(data != NULL) data->fd = -1;
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	if(conn != NULL)
+	{
+		/* The caller already closed it. Reconnect on the next request. */
+		conn->fd = -1;
+		conn->generation = 0;
+	}
+	return 0;
+}
+
+/* Make room for one more packet body after len bytes. */
+static int conn_reserve(struct rcon_conn *conn, const size_t len)
+{
+	const size_t need = len + RCON_PACKET_BODY_MAXSIZE;
+	if(need <= conn->buf_cap) return 0;
+	size_t cap = conn->buf_cap == 0 ? RCON_PACKET_BODY_MAXSIZE : conn->buf_cap;
+	while(cap < need) cap *= 2;
+	char *buf = realloc(conn->buf, cap);
+	if(buf == NULL)
+	{
+		const int r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		return r;
+	}
+	conn->buf = buf;
+	conn->buf_cap = cap;
 	return 0;
 }
 
-static int rcon_host_get_current_thread_socket(int *out)
+/* Connect and authenticate. The connection is leased by the caller.
+ * Without holdoff, as when prewarming, a failure leaves the calls of the plugins free to try on their own.
+ * Gives up with EPG_RCON_TIMEOUT at deadline, unless it is NULL, if that comes before the connect timeout. */
+static int conn_connect(struct rcon_conn *conn, bool holdoff, const struct timespec *deadline)
 {
 	int r = 0;
-	struct rcon_thread_data *data = pthread_getspecific(key_rcon_fd);
-	if(data == NULL)
+	struct config *cfg = config_acquire();
+	conn_close(conn);
+	if(cfg->rcon_host == NULL)
 	{
-		DEBUG("rcon_host.c#rcon_host_get_current_thread_socket: Allocating new thread specific data.\n");
-		data = malloc(sizeof(struct rcon_thread_data));
-		r = pthread_setspecific(key_rcon_fd, data);
-		if(r)
-		{
-			fprintf(stderr, _("Cannot set thread specific data: %d\n"), r);
-			free(data);
-			data = NULL;
-			goto cleanup;
-		}
-		data->fd = -1;
-		data->connarg_hash_1 = 0;
-		data->connarg_hash_2 = 0;
-	}
-	DEBUGF("rcon_host.c#rcon_host_get_current_thread_socket: Hash: %lu%lu -> %lu%lu.\n",
-			data->connarg_hash_1,
-			data->connarg_hash_2,
-			connarg_existing_hash_1,
-			connarg_existing_hash_2);
-
-	if(data->connarg_hash_1 != connarg_existing_hash_1 || data->connarg_hash_2 != connarg_existing_hash_2)
-	{
-		DEBUGF("rcon_host.c#rcon_host_get_current_thread_socket: Hash mismatch (%lu%lu -> %lu%lu). Recreating.\n",
-				data->connarg_hash_1,
-				data->connarg_hash_2,
-				connarg_existing_hash_1,
-				connarg_existing_hash_2);
-		if(data->fd != -1)
-		{
-			DEBUGF("rcon_host.c#rcon_host_get_current_thread_socket: Disconnecting existing socket %d.\n", data->fd);
-			close(data->fd);
-			data->fd = -1;
-			data->connarg_hash_1 = 0;
-			data->connarg_hash_2 = 0;
-		}
-		if(connarg != NULL)
+		r = EPG_RCON_DISABLED;
+		goto cleanup;
+	}
+	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
+	r = rcon_build_packet(&pkgt, RCON_PID, RCON_AUTHENTICATE, cfg->rcon_password);
+	if(r) goto cleanup;
+	/* The connect timeout covers authenticating as well, unless the deadline of the caller comes first. */
+	struct timespec auth_deadline;
+	rcon_host_deadline(&auth_deadline, cfg->rcon_connect_timeout);
+	const bool bounded = deadline != NULL && ts_before(deadline, &auth_deadline);
+	if(bounded) auth_deadline = *deadline;
+	const int timeout = bounded ? ms_until(deadline) : cfg->rcon_connect_timeout;
+	if(timeout == 0)
+	{
+		r = EPG_RCON_TIMEOUT;
+		goto cleanup;
+	}
+	int fd = -1;
+	r = net_connect(cfg->rcon_host, cfg->rcon_port, timeout, &fd);
+	if(r && bounded && ms_until(deadline) == 0)
+	{
+		/* Cut short by the caller: this says nothing about the server. */
+		r = EPG_RCON_TIMEOUT;
+		goto cleanup;
+	}
+	if(r)
+	{
+		fprintf(stderr, _("Cannot connect to %s:%s: %d\n"), cfg->rcon_host, cfg->rcon_port, r);
+		if(holdoff) holdoff_set(RCON_HOST_HOLDOFF_MS);
+		goto cleanup;
+	}
+	r = rcon_send_packet(fd, &pkgt);
+	if(r)
+	{
+		close(fd);
+		goto cleanup;
+	}
+	r = rcon_recv_packet_deadline(&pkgt, fd, &auth_deadline);
+	if(r)
+	{
+		if(r == EX_TEMPFAIL) r = EPG_RCON_TIMEOUT;
+		close(fd);
+		goto cleanup;
+	}
+	if(pkgt.id == -1)
+	{
+		fprintf(stderr, _("Incorrect rcon password.\n"));
+		close(fd);
+		r = 77;
+		goto cleanup;
+	}
+	conn->fd = fd;
+	conn->generation = cfg->rcon_generation;
+	DEBUGF("rcon_host.c#conn_connect: Socket updated: %d.\n", conn->fd);
+	goto cleanup;
+cleanup:
+	config_release(cfg);
+	return r;
+}
+
+static bool conn_current(const struct rcon_conn *conn, const struct config *cfg)
+{
+	return conn->fd != -1 && conn->generation == cfg->rcon_generation;
+}
+
+/* Lease a connection to the calling thread until rcon_host_release().
+ * Gives up with EPG_RCON_TIMEOUT at deadline while all of them are leased, or if connecting takes longer. */
+static int rcon_host_get_current_thread_socket(int *out, const struct timespec *deadline)
+{
+	int r = 0;
+	struct config *cfg = config_acquire();
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	if(conn == NULL)
+	{
+		pthread_mutex_lock(&pool_mutex);
+		while(true)
 		{
-			struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
-			r = rcon_build_packet(&pkgt, RCON_PID, RCON_AUTHENTICATE, connarg->password);
-			if(r) goto cleanup;
-			int fd = -1;
-			r = net_connect(connarg->host, connarg->port, &fd);
-			if(r)
+			if(server_state == RCON_SERVER_STOPPED)
 			{
-				fprintf(stderr, _("Cannot connect to %s:%s: %d\n"), connarg->host, connarg->port, r);
+				pthread_mutex_unlock(&pool_mutex);
+				r = cfg->rcon_host == NULL ? EPG_RCON_DISABLED : EX_UNAVAILABLE;
 				goto cleanup;
 			}
-			r = rcon_send_packet(fd, &pkgt);
-			if(r)
+			/* Prefer an established connection. */
+			for(int i = 0; i < pool_size; i ++)
 			{
-				close(fd);
-				goto cleanup;
+				if(pool[i].busy) continue;
+				if(conn == NULL || (!conn_current(conn, cfg) && conn_current(&pool[i], cfg)))
+					conn = &pool[i];
 			}
-			r = rcon_recv_packet(&pkgt, fd);
+			if(conn != NULL) break;
+			r = pthread_cond_timedwait(&pool_cond, &pool_mutex, deadline);
 			if(r)
 			{
-				close(fd);
-				goto cleanup;
-			}
-			if(pkgt.id == -1)
-			{
-				fprintf(stderr, _("Incorrect rcon password.\n"));
-				close(fd);
-				r = 77;
+				pthread_mutex_unlock(&pool_mutex);
+				if(r == ETIMEDOUT) r = EPG_RCON_TIMEOUT;
 				goto cleanup;
 			}
-			data->fd = fd;
-			data->connarg_hash_1 = connarg_existing_hash_1;
-			data->connarg_hash_2 = connarg_existing_hash_2;
 		}
-		else
+		conn->busy = true;
+		pthread_mutex_unlock(&pool_mutex);
+		r = pthread_setspecific(key_rcon_fd, conn);
+		if(r)
 		{
-			r = EPG_RCON_DISABLED;
+			fprintf(stderr, _("Cannot set thread specific data: %d\n"), r);
+			pthread_mutex_lock(&pool_mutex);
+			conn_release_locked(conn);
+			pthread_mutex_unlock(&pool_mutex);
+			goto cleanup;
 		}
-		DEBUGF("rcon_host.c#rcon_host_get_current_thread_socket: Socket updated: %d.\n", data->fd);
 	}
-	else if(data->fd == -1) /* Disabled */
+	else if(conn->owned)
 	{
-		r = EPG_RCON_DISABLED;
+		/* Not dropped with the pool while idle: do it now. */
+		pthread_mutex_lock(&pool_mutex);
+		const bool stopped = server_state == RCON_SERVER_STOPPED;
+		if(conn->stale || stopped) conn_close(conn);
+		conn->stale = false;
+		pthread_mutex_unlock(&pool_mutex);
+		if(stopped)
+		{
+			r = cfg->rcon_host == NULL ? EPG_RCON_DISABLED : EX_UNAVAILABLE;
+			goto cleanup;
+		}
+	}
+	if(!conn_current(conn, cfg))
+	{
+		if(cfg->rcon_host == NULL)
+		{
+			conn_close(conn);
+			r = EPG_RCON_DISABLED;
+			goto cleanup;
+		}
+		if(holdoff_active())
+		{
+			r = EX_UNAVAILABLE;
+			goto cleanup;
+		}
+		r = conn_connect(conn, true, deadline);
+		if(r) goto cleanup;
 	}
-	*out = data->fd;
+	*out = conn->fd;
 	goto cleanup;
 cleanup:
+	config_release(cfg);
+	return r;
+}
+
+int rcon_host_connect(int *fd, uint64_t *generation)
+{
+	struct rcon_conn conn = { -1, 0, false, false, NULL, 0 };
+	pthread_mutex_lock(&pool_mutex);
+	const bool stopped = server_state == RCON_SERVER_STOPPED;
+	pthread_mutex_unlock(&pool_mutex);
+	if(stopped || holdoff_active()) return EX_UNAVAILABLE;
+	const int r = conn_connect(&conn, true, NULL);
+	*fd = conn.fd;
+	*generation = conn.generation;
 	return r;
 }
 
+bool rcon_host_current(uint64_t generation)
+{
+	struct config *cfg = config_acquire();
+	const bool current = cfg->rcon_host != NULL && generation == cfg->rcon_generation;
+	config_release(cfg);
+	return current;
+}
+
+void rcon_host_release()
+{
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	if(conn == NULL) return;
+	if(!conn->owned) pthread_setspecific(key_rcon_fd, NULL);
+	pthread_mutex_lock(&pool_mutex);
+	conn_release_locked(conn);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void rcon_host_own()
+{
+	if(!pthread_key_init || pthread_getspecific(key_rcon_fd) != NULL) return;
+	struct rcon_conn *conn = calloc(1, sizeof(struct rcon_conn));
+	if(conn == NULL)
+	{
+		/* Falls back to the pool. */
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), errno);
+		return;
+	}
+	conn->fd = -1;
+	conn->busy = true;
+	conn->owned = true;
+	const int r = pthread_setspecific(key_rcon_fd, conn);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot set thread specific data: %d\n"), r);
+		free(conn);
+		return;
+	}
+	pthread_mutex_lock(&pool_mutex);
+	conn->next = owned;
+	owned = conn;
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Connect every idle connection. Returns true once the whole pool is ready. */
+static bool prewarm_once()
+{
+	bool done = true;
+	for(int i = 0; i < pool_size; i ++)
+	{
+		pthread_mutex_lock(&pool_mutex);
+		struct rcon_conn *conn = &pool[i];
+		if(server_state != RCON_SERVER_STARTED || prewarm_quit)
+		{
+			pthread_mutex_unlock(&pool_mutex);
+			return true;
+		}
+		struct config *cfg = config_acquire();
+		const bool current = conn_current(conn, cfg);
+		config_release(cfg);
+		if(conn->busy || current)
+		{
+			pthread_mutex_unlock(&pool_mutex);
+			continue;
+		}
+		conn->busy = true;
+		pthread_mutex_unlock(&pool_mutex);
+		const int r = conn_connect(conn, false, NULL);
+		pthread_mutex_lock(&pool_mutex);
+		conn_release_locked(conn);
+		pthread_mutex_unlock(&pool_mutex);
+		if(r == EPG_RCON_DISABLED) return true;
+		if(r)
+		{
+			done = false;
+			break;
+		}
+	}
+	return done;
+}
+
+static void *prewarm_main(void *arg)
+{
+	thread_set_name("rcon-prewarm");
+	pthread_mutex_lock(&pool_mutex);
+	while(!prewarm_quit)
+	{
+		while(!prewarm_requested && !prewarm_quit)
+			pthread_cond_wait(&prewarm_cond, &pool_mutex);
+		prewarm_requested = false;
+		int delay = RCON_HOST_PREWARM_BACKOFF_MIN;
+		while(server_state == RCON_SERVER_STARTED && !prewarm_quit && !prewarm_requested)
+		{
+			pthread_mutex_unlock(&pool_mutex);
+			const bool done = prewarm_once();
+			pthread_mutex_lock(&pool_mutex);
+			if(done)
+			{
+				DEBUG("rcon_host.c#prewarm_main: Pool is ready.\n");
+				break;
+			}
+			DEBUGF("rcon_host.c#prewarm_main: Retrying in %d ms.\n", delay);
+			struct timespec deadline;
+			rcon_host_deadline(&deadline, delay);
+			pthread_cond_timedwait(&prewarm_cond, &pool_mutex, &deadline);
+			delay *= 2;
+			if(delay > RCON_HOST_PREWARM_BACKOFF_MAX) delay = RCON_HOST_PREWARM_BACKOFF_MAX;
+		}
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+void rcon_host_server_stopping()
+{
+	pthread_mutex_lock(&pool_mutex);
+	server_state = RCON_SERVER_STOPPED;
+	for(int i = 0; i < pool_size; i ++)
+	{
+		if(pool[i].busy) pool[i].stale = true;
+		else conn_close(&pool[i]);
+	}
+	/* Their threads may be using them: closed by the next call. */
+	for(struct rcon_conn *conn = owned; conn != NULL; conn = conn->next)
+		conn->stale = true;
+	if(prewarm_cond_init) pthread_cond_signal(&prewarm_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void rcon_host_server_started()
+{
+	holdoff_set(0);
+	pthread_mutex_lock(&pool_mutex);
+	server_state = RCON_SERVER_STARTED;
+	prewarm_requested = true;
+	if(prewarm_cond_init) pthread_cond_signal(&prewarm_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void rcon_host_pool_stat(int *connected, int *busy, int *size, int *owned_count)
+{
+	*connected = 0;
+	*busy = 0;
+	*owned_count = 0;
+	pthread_mutex_lock(&pool_mutex);
+	for(int i = 0; i < pool_size; i ++)
+	{
+		if(pool[i].fd != -1) (*connected) ++;
+		if(pool[i].busy) (*busy) ++;
+	}
+	*size = pool_size;
+	for(struct rcon_conn *conn = owned; conn != NULL; conn = conn->next)
+		(*owned_count) ++;
+	pthread_mutex_unlock(&pool_mutex);
+}
+
 int rcon_host_send(const int pkt_id, const char *command)
 {
 	int r = 0;
 	int fd = 0;
-	r = rcon_host_get_current_thread_socket(&fd);
+	struct timespec deadline;
+	rcon_host_deadline(&deadline, RCON_HOST_RECV_TIMEOUT);
+	r = rcon_host_get_current_thread_socket(&fd, &deadline);
 	if(r) goto cleanup;
 	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
 	r = rcon_build_packet(&pkgt, pkt_id, RCON_EXEC_COMMAND, (char *)command);
@@ -191,75 +554,285 @@ cleanup:
 	return r;
 }
 
-int rcon_host_recv(int *pkt_id, char *out)
+int rcon_host_recv_view(int *pkt_id, const char **data, size_t *len)
 {
 	int r = 0;
 	int fd = 0;
-	r = rcon_host_get_current_thread_socket(&fd);
+	*data = "";
+	*len = 0;
+	struct timespec deadline;
+	rcon_host_deadline(&deadline, RCON_HOST_RECV_TIMEOUT);
+	r = rcon_host_get_current_thread_socket(&fd, &deadline);
 	if(r) goto cleanup;
-	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
-	r = rcon_recv_packet(&pkgt, fd);
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	r = conn_reserve(conn, 0);
+	if(r) goto cleanup;
+	int cmd;
+	r = rcon_recv_packet_body(fd, &deadline, pkt_id, &cmd, conn->buf, len);
 	if(r)
 	{
+		if(r == EX_TEMPFAIL) r = EPG_RCON_TIMEOUT;
 		close(fd);
 		rcon_host_clear_current_thread_socket();
 		goto cleanup;
 	}
-	// TODO: Size issue? Memory issue?
-	*pkt_id = pkgt.id;
-	strcpy(out, pkgt.data);
+	*data = conn->buf;
 	goto cleanup;
 cleanup:
 	return r;
 }
 
-int rcon_host_init()
+int rcon_host_recv(int *pkt_id, char *out)
+{
+	const char *data;
+	size_t len;
+	const int r = rcon_host_recv_view(pkt_id, &data, &len);
+	if(r) return r;
+	// The caller provides RCON_DATA_BUFFSIZE bytes.
+	if(len > RCON_DATA_BUFFSIZE - 1) len = RCON_DATA_BUFFSIZE - 1;
+	memcpy(out, data, len);
+	out[len] = '\0';
+	return 0;
+}
+
+int rcon_host_exec_view(const char *command, const struct timespec *deadline, const char **data, size_t *len)
 {
 	int r = 0;
-	r = pthread_key_create(&key_rcon_fd, &destructor);
+	int fd = 0;
+	size_t total = 0;
+	*data = "";
+	*len = 0;
+	r = rcon_host_get_current_thread_socket(&fd, deadline);
 	if(r) goto cleanup;
-	pthread_key_init = true;
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
+	r = rcon_build_packet(&pkgt, RCON_HOST_EXEC_ID, RCON_EXEC_COMMAND, (char *)command);
+	if(r) goto cleanup;
+	r = rcon_send_packet(fd, &pkgt);
+	if(r) goto fail;
+	/* Replies longer than one packet are split by the server. It answers an unknown
+	 * request type in order, so its reply marks the end of the command output. */
+	r = rcon_build_packet(&pkgt, RCON_HOST_EXEC_ID + 1, RCON_RESPONSEVALUE, "");
+	if(r) goto cleanup;
+	r = rcon_send_packet(fd, &pkgt);
+	if(r) goto fail;
+	while(true)
+	{
+		/* Each chunk lands right after the previous one. */
+		r = conn_reserve(conn, total);
+		if(r) goto fail;
+		int id, cmd;
+		size_t chunk;
+		r = rcon_recv_packet_body(fd, deadline, &id, &cmd, &conn->buf[total], &chunk);
+		if(r) goto fail;
+		if(id == RCON_HOST_EXEC_ID + 1) break;
+		if(id != RCON_HOST_EXEC_ID)
+		{
+			DEBUGF("rcon_host.c#rcon_host_exec_view: Dropping stale packet %d.\n", id);
+			continue;
+		}
+		total += chunk;
+	}
+	conn->buf[total] = '\0';
+	*data = conn->buf;
+	*len = total;
+	goto cleanup;
+fail:
+	if(r == EX_TEMPFAIL) r = EPG_RCON_TIMEOUT;
+	close(fd);
+	rcon_host_clear_current_thread_socket();
+	goto cleanup;
 cleanup:
-	if(r) rcon_host_free();
 	return r;
 }
 
-void rcon_host_free()
+int rcon_host_exec_batch(const char *const *commands, const size_t count, const struct timespec *deadline,
+		rcon_host_reply_cb on_reply, void *arg)
 {
-	if(pthread_key_init)
+	int r = 0;
+	int fd = 0;
+	if(count > RCON_HOST_BATCH_MAX) return 64;
+	for(size_t i = 0; i < count; i ++)
+		if(strlen(commands[i]) > RCON_DATA_BUFFSIZE) return 64;
+	r = rcon_host_get_current_thread_socket(&fd, deadline);
+	if(r) goto cleanup;
+	struct rcon_conn *conn = pthread_getspecific(key_rcon_fd);
+	struct rc_packet pkgt = {0, 0, 0, { 0x00 }};
+	const int end_id = RCON_HOST_BATCH_ID + (int)count;
+	size_t sent = 0;
+	/* Commands before the one being answered are done. */
+	size_t answered = 0;
+	/* Bytes of its reply so far. */
+	size_t total = 0;
+	bool end_sent = false;
+	while(true)
 	{
-		pthread_key_delete(key_rcon_fd);
-		pthread_key_init = false;
+		while(sent < count && sent - answered < RCON_HOST_PIPELINE)
+		{
+			r = rcon_build_packet(&pkgt, RCON_HOST_BATCH_ID + (int)sent, RCON_EXEC_COMMAND, (char *)commands[sent]);
+			if(!r) r = rcon_send_packet(fd, &pkgt);
+			if(r) goto fail;
+			sent ++;
+		}
+		if(sent == count && !end_sent)
+		{
+			/* Answered in order after the last command, like in rcon_host_exec_view. */
+			r = rcon_build_packet(&pkgt, end_id, RCON_RESPONSEVALUE, "");
+			if(!r) r = rcon_send_packet(fd, &pkgt);
+			if(r) goto fail;
+			end_sent = true;
+		}
+		r = conn_reserve(conn, total);
+		if(r) goto fail;
+		int id, cmd;
+		size_t chunk;
+		r = rcon_recv_packet_body(fd, deadline, &id, &cmd, &conn->buf[total], &chunk);
+		if(r) goto fail;
+		if(id < RCON_HOST_BATCH_ID || id > end_id)
+		{
+			DEBUGF("rcon_host.c#rcon_host_exec_batch: Dropping stale packet %d.\n", id);
+			continue;
+		}
+		const size_t index = (size_t)(id - RCON_HOST_BATCH_ID);
+		/* The first packet of a later reply completes the previous ones. */
+		while(answered < index)
+		{
+			if(on_reply != NULL && answered < count)
+			{
+				const char saved = conn->buf[total];
+				conn->buf[total] = '\0';
+				on_reply(answered, conn->buf, total, arg);
+				conn->buf[total] = saved;
+			}
+			if(total > 0)
+			{
+				memmove(conn->buf, &conn->buf[total], chunk);
+				total = 0;
+			}
+			answered ++;
+		}
+		if(id == end_id) break;
+		if(on_reply != NULL) total += chunk;
 	}
+	goto cleanup;
+fail:
+	if(r == EX_TEMPFAIL) r = EPG_RCON_TIMEOUT;
+	close(fd);
+	rcon_host_clear_current_thread_socket();
+	goto cleanup;
+cleanup:
+	return r;
 }
 
-struct rcon_host_connarg *rcon_host_getconnarg()
+int rcon_host_exec(const char *command, const struct timespec *deadline, char *out, const size_t out_cap, size_t *out_len)
 {
-	return connarg;
+	const char *data;
+	size_t len;
+	const int r = rcon_host_exec_view(command, deadline, &data, &len);
+	if(out_cap > 0)
+	{
+		const size_t copy = len < out_cap - 1 ? len : out_cap - 1;
+		memcpy(out, data, copy);
+		out[copy] = '\0';
+	}
+	if(out_len != NULL) *out_len = len;
+	return r;
 }
 
-void rcon_host_setconnarg(struct rcon_host_connarg *arg)
+int rcon_host_init(const int size)
 {
-	connarg = arg;
-	connarg_hash_update(arg);
+	int r = 0;
+	r = pthread_key_create(&key_rcon_fd, &destructor);
+	if(r) goto cleanup;
+	pthread_key_init = true;
+	pool = calloc(size, sizeof(struct rcon_conn));
+	if(pool == NULL)
+	{
+		r = errno;
+		fprintf(stderr, _("Cannot allocate memory: %d.\n"), r);
+		goto cleanup;
+	}
+	pool_size = size;
+	for(int i = 0; i < pool_size; i ++)
+	{
+		pool[i].fd = -1;
+		pool[i].busy = false;
+		pool[i].stale = false;
+	}
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(!r) r = pthread_cond_init(&pool_cond, &attr);
+	if(!r) pool_cond_init = true;
+	if(!r) r = pthread_cond_init(&prewarm_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	prewarm_cond_init = true;
+	r = pthread_create(&prewarm_thread, NULL, &prewarm_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	prewarm_thread_init = true;
+cleanup:
+	if(r) rcon_host_free();
+	return r;
 }
 
-void rcon_host_connarg_free(struct rcon_host_connarg *arg)
+void rcon_host_free()
 {
-	if(arg->host != NULL)
+	if(prewarm_thread_init)
+	{
+		pthread_mutex_lock(&pool_mutex);
+		prewarm_quit = true;
+		pthread_cond_signal(&prewarm_cond);
+		pthread_mutex_unlock(&pool_mutex);
+		pthread_join(prewarm_thread, NULL);
+		prewarm_thread_init = false;
+	}
+	if(prewarm_cond_init)
+	{
+		pthread_cond_destroy(&prewarm_cond);
+		prewarm_cond_init = false;
+	}
+	pthread_mutex_lock(&pool_mutex);
+	if(pool != NULL)
 	{
-		free(arg->host);
-		arg->host = NULL;
+		for(int i = 0; i < pool_size; i ++)
+		{
+			conn_close(&pool[i]);
+			free(pool[i].buf);
+		}
+		free(pool);
+		pool = NULL;
+		pool_size = 0;
 	}
-	if(arg->port != NULL)
+	pthread_mutex_unlock(&pool_mutex);
+	if(pool_cond_init)
 	{
-		free(arg->port);
-		arg->port = NULL;
+		pthread_cond_destroy(&pool_cond);
+		pool_cond_init = false;
 	}
-	if(arg->password != NULL)
+	if(pthread_key_init)
+	{
+		pthread_key_delete(key_rcon_fd);
+		pthread_key_init = false;
+	}
+}
+
+void rcon_host_reload()
+{
+	net_cache_invalidate();
+	holdoff_set(0);
+	pthread_mutex_lock(&pool_mutex);
+	/* May be a different server now. */
+	if(server_state == RCON_SERVER_STOPPED) server_state = RCON_SERVER_UNKNOWN;
+	if(server_state == RCON_SERVER_STARTED && prewarm_cond_init)
 	{
-		free(arg->password);
-		arg->password = NULL;
+		prewarm_requested = true;
+		pthread_cond_signal(&prewarm_cond);
 	}
-	free(arg);
+	pthread_mutex_unlock(&pool_mutex);
 }
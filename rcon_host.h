@@ -1,20 +1,68 @@
 #ifndef _RCON_HOST_H
 #define _RCON_HOST_H
 
-struct rcon_host_connarg {
-	char *host;
-	char *port;
-	char *password;
-};
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
 
-int rcon_host_init();
+/* Upper bound for the legacy rcon_recv call. */
+#define RCON_HOST_RECV_TIMEOUT		30000
+#define RCON_HOST_EXEC_ID		0x45584543
+/* Commands of a batch use consecutive ids from here. */
+#define RCON_HOST_BATCH_ID		0x42000000
+#define RCON_HOST_BATCH_MAX		0x100000
+/* Commands sent ahead of their replies in a batch. Bounded so that neither side blocks on a full socket. */
+#define RCON_HOST_PIPELINE		32
+
+/* size: number of pooled connections. */
+int rcon_host_init(const int size);
 void rcon_host_free();
-void rcon_host_connarg_free(struct rcon_host_connarg *arg);
+
+/* The deadline of the calls below, timeout_ms from now on CLOCK_MONOTONIC. Taken before scheduling
+ * the command (rcon_sched_acquire), the same deadline bounds the whole call. */
+void rcon_host_deadline(struct timespec *out, const int timeout_ms);
 
 int rcon_host_send(const int id, const char *command);
 int rcon_host_recv(int *pkgt_id, char *out);
+/* Send a command and collect its whole reply before deadline, waiting for a free connection and
+ * connecting included. Like snprintf, out_len receives the full length even if out was truncated. */
+int rcon_host_exec(const char *command, const struct timespec *deadline, char *out, const size_t out_cap, size_t *out_len);
+
+/* Zero-copy variants. data points into the receive buffer of the leased connection and is
+ * NULL terminated. It stays valid until the next call on this thread or rcon_host_release(). */
+int rcon_host_recv_view(int *pkt_id, const char **data, size_t *len);
+int rcon_host_exec_view(const char *command, const struct timespec *deadline, const char **data, size_t *len);
+
+/* Called with each whole reply of a batch, in order. data is NULL terminated and only valid during the call. */
+typedef void (*rcon_host_reply_cb)(size_t index, const char *data, size_t len, void *arg);
+
+/* Send commands without waiting for each reply, and return once all of them were answered
+ * before deadline. Replies are passed to on_reply, or discarded if it is NULL.
+ * Returns 64 if the batch is too large or a command too long, before anything is sent. */
+int rcon_host_exec_batch(const char *const *commands, const size_t count, const struct timespec *deadline,
+		rcon_host_reply_cb on_reply, void *arg);
+
+/* Connect and authenticate a connection outside the pool, for the caller to own.
+ * Fails fast like the pool while the server is stopped or after a failed connection. */
+int rcon_host_connect(int *fd, uint64_t *generation);
+/* The connection authenticated with generation still targets the configured server. */
+bool rcon_host_current(uint64_t generation);
+
+/* Return the connection leased by the calling thread to the pool. */
+void rcon_host_release();
+/* Give the calling thread a connection of its own until it exits, so that its calls never wait for
+ * the pool. For the long-lived threads of the core and of pinned or isolated plugins: the pool only
+ * has to cover the workers then. rcon_host_release() keeps it. */
+void rcon_host_own();
+/* owned: connections given out by rcon_host_own(). */
+void rcon_host_pool_stat(int *connected, int *busy, int *size, int *owned);
+
+/* Server lifecycle: drop the pool on stop and reconnect it with backoff once started. */
+void rcon_host_server_stopping();
+void rcon_host_server_started();
 
-void rcon_host_setconnarg(struct rcon_host_connarg *arg);
-struct rcon_host_connarg *rcon_host_getconnarg();
+/* The rcon target in the published config changed. */
+void rcon_host_reload();
 
 #endif // _RCON_HOST_H
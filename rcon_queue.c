@@ -0,0 +1,379 @@
+#include "rcon_queue.h"
+#include "rcon_host.h"
+#include "rcon_sched.h"
+#include "console.h"
+#include "plugin/plugin.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+struct queued {
+	struct queued *next;
+	/* Seconds since the epoch. */
+	int64_t enqueued;
+	char *plugin;
+	char *command;
+};
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Only the flusher removes from the head. */
+static struct queued *head = NULL;
+static struct queued *tail = NULL;
+static int size = 0;
+static uint64_t total_queued = 0;
+static uint64_t total_flushed = 0;
+static uint64_t total_dropped = 0;
+static uint64_t total_rejected = 0;
+
+static char *journal_path = NULL;
+static int journal_fd = -1;
+
+static pthread_cond_t flush_cond;
+static bool flush_cond_init = false;
+static bool flush_kicked = false;
+static bool flush_quit = false;
+static bool flush_thread_init = false;
+static pthread_t flush_thread;
+
+static void queued_free(struct queued *item)
+{
+	free(item->plugin);
+	free(item->command);
+	free(item);
+}
+
+/* Caller holds queue_mutex. */
+static int queue_append(int64_t enqueued, const char *plugin_id, const char *command)
+{
+	struct queued *item = calloc(1, sizeof(struct queued));
+	if(item == NULL) return errno;
+	item->enqueued = enqueued;
+	item->plugin = strdup(plugin_id);
+	item->command = strdup(command);
+	if(item->plugin == NULL || item->command == NULL)
+	{
+		queued_free(item);
+		return ENOMEM;
+	}
+	if(tail == NULL) head = item;
+	else tail->next = item;
+	tail = item;
+	size ++;
+	return 0;
+}
+
+static int journal_write(int fd, const struct queued *item)
+{
+	if(dprintf(fd, "%lld\t%s\t%s\n", (long long)item->enqueued, item->plugin, item->command) < 0)
+		return errno;
+	return 0;
+}
+
+/* Replace the journal with the held commands. Caller holds queue_mutex. */
+static int journal_rewrite()
+{
+	int r = 0;
+	const size_t len = strlen(journal_path);
+	char *tmp = malloc(len + 5);
+	if(tmp == NULL) return errno;
+	memcpy(tmp, journal_path, len);
+	memcpy(&tmp[len], ".tmp", 5);
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	for(const struct queued *item = head; item != NULL && !r; item = item->next)
+		r = journal_write(fd, item);
+	if(!r && fsync(fd)) r = errno;
+	close(fd);
+	if(!r && rename(tmp, journal_path)) r = errno;
+	if(r) goto cleanup;
+	if(journal_fd != -1) close(journal_fd);
+	journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+	if(journal_fd == -1) r = errno;
+	goto cleanup;
+cleanup:
+	if(r) fprintf(stderr, _("Cannot write rcon queue journal %s: %d\n"), journal_path, r);
+	free(tmp);
+	return r;
+}
+
+static int journal_load()
+{
+	int r = 0;
+	FILE *file = fopen(journal_path, "r");
+	if(file == NULL)
+	{
+		if(errno == ENOENT) return 0;
+		r = errno;
+		fprintf(stderr, _("Cannot open %s: %d.\n"), journal_path, r);
+		return r;
+	}
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while((len = getline(&line, &cap, file)) != -1)
+	{
+		if(len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
+		char *plugin = strchr(line, '\t');
+		char *command = plugin == NULL ? NULL : strchr(plugin + 1, '\t');
+		if(command == NULL)
+		{
+			fprintf(stderr, _("Ignoring malformed rcon queue entry: %s\n"), line);
+			continue;
+		}
+		*plugin ++ = '\0';
+		*command ++ = '\0';
+		r = queue_append(strtoll(line, NULL, 10), plugin, command);
+		if(r) break;
+	}
+	free(line);
+	fclose(file);
+	if(size > 0) printf(_("Restored %d deferred rcon command(s).\n"), size);
+	return r;
+}
+
+static void flush()
+{
+	int sent = 0;
+	while(true)
+	{
+		pthread_mutex_lock(&queue_mutex);
+		struct queued *item = head;
+		const bool quit = flush_quit;
+		pthread_mutex_unlock(&queue_mutex);
+		if(item == NULL || quit) break;
+		int r = rcon_sched_acquire(NULL, RCON_SCHED_LANE_LOW, NULL);
+		const char *data;
+		size_t len;
+		struct timespec deadline;
+		rcon_host_deadline(&deadline, RCON_QUEUE_TIMEOUT);
+		if(!r && console_available()) r = console_send(item->command);
+		else if(!r) r = rcon_host_exec_view(item->command, &deadline, &data, &len);
+		const bool drop = r && !rcon_queue_retryable(r) && r != EPG_RCON_TIMEOUT;
+		if(r && !drop)
+		{
+			DEBUGF("rcon_queue.c#flush: Holding commands: %d.\n", r);
+			break;
+		}
+		if(drop)
+			fprintf(stderr, _("Dropping deferred command of %s: %d.\n"), item->plugin, r);
+		pthread_mutex_lock(&queue_mutex);
+		head = item->next;
+		if(head == NULL) tail = NULL;
+		size --;
+		if(drop) total_dropped ++;
+		else total_flushed ++;
+		pthread_mutex_unlock(&queue_mutex);
+		queued_free(item);
+		sent ++;
+	}
+	rcon_host_release();
+	if(sent)
+	{
+		DEBUGF("rcon_queue.c#flush: Flushed %d command(s).\n", sent);
+		pthread_mutex_lock(&queue_mutex);
+		if(journal_path != NULL) journal_rewrite();
+		pthread_mutex_unlock(&queue_mutex);
+	}
+}
+
+static void *flush_main(void *arg)
+{
+	thread_set_name("rcon-queue");
+	rcon_host_own();
+	pthread_mutex_lock(&queue_mutex);
+	while(!flush_quit)
+	{
+		if(head == NULL)
+		{
+			flush_kicked = false;
+			pthread_cond_wait(&flush_cond, &queue_mutex);
+			continue;
+		}
+		if(!flush_kicked)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += RCON_QUEUE_RETRY_MS / 1000;
+			deadline.tv_nsec += (RCON_QUEUE_RETRY_MS % 1000) * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec ++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			/* Woken up early: by a kick, or by quitting. */
+			if(pthread_cond_timedwait(&flush_cond, &queue_mutex, &deadline) != ETIMEDOUT) continue;
+		}
+		flush_kicked = false;
+		pthread_mutex_unlock(&queue_mutex);
+		flush();
+		pthread_mutex_lock(&queue_mutex);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return NULL;
+}
+
+bool rcon_queue_retryable(int r)
+{
+	switch(r)
+	{
+		case EX_UNAVAILABLE:
+		case EX_NOHOST:
+		case EX_IOERR:
+		case EX_NOPERM:
+		case EPG_RCON_DISABLED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+int rcon_queue_push(const char *plugin_id, const char *command)
+{
+	int r = 0;
+	pthread_mutex_lock(&queue_mutex);
+	if(size >= RCON_QUEUE_MAX)
+	{
+		total_rejected ++;
+		r = EX_TEMPFAIL;
+		goto cleanup;
+	}
+	r = queue_append(time(NULL), plugin_id, command);
+	if(r) goto cleanup;
+	total_queued ++;
+	/* Start the retry timer. */
+	if(size == 1 && flush_cond_init) pthread_cond_signal(&flush_cond);
+	if(journal_fd != -1)
+	{
+		r = journal_write(journal_fd, tail);
+		if(!r && fsync(journal_fd)) r = errno;
+		if(r)
+		{
+			fprintf(stderr, _("Cannot write rcon queue journal %s: %d\n"), journal_path, r);
+			/* Still held in memory. */
+			r = 0;
+		}
+	}
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&queue_mutex);
+	return r;
+}
+
+int rcon_queue_size()
+{
+	pthread_mutex_lock(&queue_mutex);
+	const int s = size;
+	pthread_mutex_unlock(&queue_mutex);
+	return s;
+}
+
+void rcon_queue_kick()
+{
+	pthread_mutex_lock(&queue_mutex);
+	flush_kicked = true;
+	if(flush_cond_init) pthread_cond_signal(&flush_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+int rcon_queue_init(const char *path)
+{
+	int r = 0;
+	if(path != NULL)
+	{
+		journal_path = strdup(path);
+		if(journal_path == NULL)
+		{
+			r = errno;
+			goto cleanup;
+		}
+		r = journal_load();
+		if(r) goto cleanup;
+		/* Drops malformed entries and opens the journal for appending. */
+		r = journal_rewrite();
+		if(r) goto cleanup;
+	}
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(!r) r = pthread_cond_init(&flush_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	flush_cond_init = true;
+	r = pthread_create(&flush_thread, NULL, &flush_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	flush_thread_init = true;
+cleanup:
+	if(r) rcon_queue_free();
+	return r;
+}
+
+void rcon_queue_free()
+{
+	if(flush_thread_init)
+	{
+		pthread_mutex_lock(&queue_mutex);
+		flush_quit = true;
+		pthread_cond_signal(&flush_cond);
+		pthread_mutex_unlock(&queue_mutex);
+		pthread_join(flush_thread, NULL);
+		flush_thread_init = false;
+	}
+	if(flush_cond_init)
+	{
+		pthread_cond_destroy(&flush_cond);
+		flush_cond_init = false;
+	}
+	pthread_mutex_lock(&queue_mutex);
+	/* The journal keeps what is still held. */
+	if(journal_fd != -1)
+	{
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	free(journal_path);
+	journal_path = NULL;
+	while(head != NULL)
+	{
+		struct queued *item = head;
+		head = item->next;
+		queued_free(item);
+	}
+	tail = NULL;
+	size = 0;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void rcon_queue_dump(int out)
+{
+	pthread_mutex_lock(&queue_mutex);
+	const int depth = size;
+	const int64_t oldest = head == NULL ? 0 : head->enqueued;
+	const uint64_t queued = total_queued, flushed = total_flushed, dropped = total_dropped, rejected = total_rejected;
+	pthread_mutex_unlock(&queue_mutex);
+	dprintf(out, _("Journal:\t%s\n"), journal_path == NULL ? _("(none)") : journal_path);
+	dprintf(out, _("Depth:\t%d / %d\n"), depth, RCON_QUEUE_MAX);
+	if(depth > 0)
+		dprintf(out, _("Oldest:\t%lld s\n"), (long long)(time(NULL) - oldest));
+	dprintf(out, _("Queued:\t%" PRIu64 "\nFlushed:\t%" PRIu64 "\nDropped:\t%" PRIu64 "\nRejected (full):\t%" PRIu64 "\n"), queued, flushed, dropped, rejected);
+}
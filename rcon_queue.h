@@ -0,0 +1,31 @@
+#ifndef _RCON_QUEUE_H
+#define _RCON_QUEUE_H
+
+#include <stdbool.h>
+
+/* Commands held at most. Further deferred commands fail with EX_TEMPFAIL. */
+#define RCON_QUEUE_MAX		4096
+/* Retry interval while commands are held and no server event arrives. */
+#define RCON_QUEUE_RETRY_MS	5000
+#define RCON_QUEUE_TIMEOUT	5000
+
+/*
+ * Outbound queue for deferrable commands while rcon is unreachable.
+ * With a journal path, held commands survive restarts. Delivery is at least once:
+ * a command may be sent again if the daemon dies while flushing.
+ */
+int rcon_queue_init(const char *journal_path);
+void rcon_queue_free();
+
+/* Append a command. Returns EX_TEMPFAIL if the queue is full. */
+int rcon_queue_push(const char *plugin_id, const char *command);
+/* While commands are held, new ones must queue behind them to keep the order. */
+int rcon_queue_size();
+/* Whether a failed command should be held: rcon is down rather than the command being bad. */
+bool rcon_queue_retryable(int r);
+/* Try to flush now, e.g. after the server started or rcon was re-enabled. */
+void rcon_queue_kick();
+
+void rcon_queue_dump(int out);
+
+#endif // _RCON_QUEUE_H
@@ -0,0 +1,294 @@
+#include "rcon_sched.h"
+#include "config.h"
+#include "plugin/plugin.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond;
+static bool sched_cond_init = false;
+
+/* Cached from the config, refreshed when its generation changes. */
+static struct rcon_sched_limits limits = { 0, 0, 0, 0 };
+static uint64_t limits_generation = 0;
+static struct rcon_sched_bucket global;
+
+/* Waiters which only wait for the global bucket, per lane. */
+static int eligible[RCON_SCHED_LANES] = { 0 };
+static int waiting[RCON_SCHED_LANES] = { 0 };
+
+struct lane_stats {
+	uint64_t count;
+	uint64_t delayed;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+static struct lane_stats stats[RCON_SCHED_LANES];
+
+static uint64_t ts_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (uint64_t)(b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+static bool ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void bucket_refill(struct rcon_sched_bucket *bucket, const struct timespec *now, double rate, double burst)
+{
+	if(rate <= 0) return;
+	if(burst < 1) burst = 1;
+	const double elapsed = ts_diff_ns(&bucket->last, now) / 1e9;
+	bucket->tokens += elapsed * rate;
+	if(bucket->tokens > burst) bucket->tokens = burst;
+	bucket->last = *now;
+}
+
+/* Nanoseconds until the bucket has a whole token. */
+static uint64_t bucket_eta(const struct rcon_sched_bucket *bucket, double rate)
+{
+	if(rate <= 0 || bucket->tokens >= 1) return 0;
+	return (uint64_t)((1 - bucket->tokens) / rate * 1e9) + 1;
+}
+
+static void bucket_reset(struct rcon_sched_bucket *bucket, double burst)
+{
+	bucket->tokens = burst < 1 ? 1 : burst;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+int rcon_sched_init()
+{
+	int r = 0;
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(r)
+	{
+		pthread_condattr_destroy(&attr);
+		goto cleanup;
+	}
+	r = pthread_cond_init(&sched_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	sched_cond_init = true;
+cleanup:
+	if(r) fprintf(stderr, _("Cannot setup rcon scheduler: %d\n"), r);
+	return r;
+}
+
+void rcon_sched_free()
+{
+	if(sched_cond_init)
+	{
+		pthread_cond_destroy(&sched_cond);
+		sched_cond_init = false;
+	}
+}
+
+static bool limits_equal(const struct rcon_sched_limits *a, const struct rcon_sched_limits *b)
+{
+	return a->rate == b->rate && a->burst == b->burst &&
+		a->plugin_rate == b->plugin_rate && a->plugin_burst == b->plugin_burst;
+}
+
+/* Caller holds sched_mutex. */
+static void limits_refresh()
+{
+	struct config *cfg = config_acquire();
+	if(cfg->generation != limits_generation)
+	{
+		limits_generation = cfg->generation;
+		/* Most publishes change something else: refilling then would release a whole burst. */
+		if(!limits_equal(&cfg->limits, &limits))
+		{
+			limits = cfg->limits;
+			bucket_reset(&global, limits.burst);
+		}
+	}
+	config_release(cfg);
+}
+
+void rcon_sched_limits_changed()
+{
+	pthread_mutex_lock(&sched_mutex);
+	limits_refresh();
+	if(sched_cond_init) pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_mutex);
+}
+
+struct rcon_sched_bucket *rcon_sched_bucket_new()
+{
+	struct rcon_sched_bucket *bucket = malloc(sizeof(struct rcon_sched_bucket));
+	if(bucket == NULL) return NULL;
+	pthread_mutex_lock(&sched_mutex);
+	limits_refresh();
+	bucket_reset(bucket, limits.plugin_burst);
+	pthread_mutex_unlock(&sched_mutex);
+	return bucket;
+}
+
+void rcon_sched_bucket_free(struct rcon_sched_bucket *bucket)
+{
+	free(bucket);
+}
+
+/* Retry interval of rcon_sched_try_acquire while only higher lanes hold it back. */
+#define RCON_SCHED_RETRY_NS	1000000ULL
+
+static bool lane_blocked(int lane)
+{
+	for(int i = 0; i < lane; i ++)
+		if(eligible[i]) return true;
+	return false;
+}
+
+int rcon_sched_acquire(struct rcon_sched_bucket *bucket, int lane, const struct timespec *deadline)
+{
+	int r = 0;
+	if(lane < 0 || lane >= RCON_SCHED_LANES) lane = RCON_SCHED_LANE_NORMAL;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&sched_mutex);
+	waiting[lane] ++;
+	bool is_eligible = false;
+	while(true)
+	{
+		limits_refresh();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		bucket_refill(&global, &now, limits.rate, limits.burst);
+		if(bucket != NULL) bucket_refill(bucket, &now, limits.plugin_rate, limits.plugin_burst);
+		const uint64_t plugin_eta = bucket == NULL ? 0 : bucket_eta(bucket, limits.plugin_rate);
+		if(plugin_eta == 0 && !is_eligible)
+		{
+			is_eligible = true;
+			eligible[lane] ++;
+		}
+		else if(plugin_eta != 0 && is_eligible)
+		{
+			is_eligible = false;
+			eligible[lane] --;
+		}
+		const uint64_t global_eta = bucket_eta(&global, limits.rate);
+		const bool blocked = lane_blocked(lane);
+		if(plugin_eta == 0 && global_eta == 0 && !blocked) break;
+		if(deadline != NULL && !ts_before(&now, deadline))
+		{
+			r = EPG_RCON_TIMEOUT;
+			break;
+		}
+		uint64_t eta = plugin_eta > global_eta ? plugin_eta : global_eta;
+		if(eta == 0 && deadline == NULL)
+		{
+			/* Only waiting for higher lanes, which broadcast once they are served. */
+			pthread_cond_wait(&sched_cond, &sched_mutex);
+			continue;
+		}
+		struct timespec wake = now;
+		wake.tv_sec += eta / 1000000000ULL;
+		wake.tv_nsec += eta % 1000000000ULL;
+		if(wake.tv_nsec >= 1000000000L)
+		{
+			wake.tv_sec ++;
+			wake.tv_nsec -= 1000000000L;
+		}
+		if(deadline != NULL && (eta == 0 || ts_before(deadline, &wake))) wake = *deadline;
+		r = pthread_cond_timedwait(&sched_cond, &sched_mutex, &wake);
+		if(r && r != ETIMEDOUT)
+		{
+			fprintf(stderr, _("pthread_cond_timedwait(): %d\n"), r);
+			break;
+		}
+		r = 0;
+	}
+	if(!r)
+	{
+		if(limits.rate > 0) global.tokens -= 1;
+		if(bucket != NULL && limits.plugin_rate > 0) bucket->tokens -= 1;
+	}
+	if(is_eligible) eligible[lane] --;
+	waiting[lane] --;
+	const uint64_t waited = ts_diff_ns(&start, &now);
+	stats[lane].count ++;
+	stats[lane].total_ns += waited;
+	if(waited > stats[lane].max_ns) stats[lane].max_ns = waited;
+	if(waited >= 1000000ULL) stats[lane].delayed ++;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_mutex);
+	if(waited >= 1000000ULL)
+		DEBUGF("rcon_sched.c#rcon_sched_acquire: Lane %d queued for %" PRIu64 " us.\n", lane, waited / 1000);
+	return r;
+}
+
+int rcon_sched_try_acquire(struct rcon_sched_bucket *bucket, int lane, const struct timespec *since,
+		uint64_t *eta_ns, bool *only_bucket)
+{
+	int r = 0;
+	if(lane < 0 || lane >= RCON_SCHED_LANES) lane = RCON_SCHED_LANE_NORMAL;
+	struct timespec now;
+	pthread_mutex_lock(&sched_mutex);
+	limits_refresh();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bucket_refill(&global, &now, limits.rate, limits.burst);
+	if(bucket != NULL) bucket_refill(bucket, &now, limits.plugin_rate, limits.plugin_burst);
+	const uint64_t plugin_eta = bucket == NULL ? 0 : bucket_eta(bucket, limits.plugin_rate);
+	const uint64_t global_eta = bucket_eta(&global, limits.rate);
+	/* Not counted as waiting: it does not hold lower lanes back. */
+	const bool blocked = lane_blocked(lane);
+	if(plugin_eta != 0 || global_eta != 0 || blocked)
+	{
+		const uint64_t eta = plugin_eta > global_eta ? plugin_eta : global_eta;
+		*eta_ns = eta == 0 ? RCON_SCHED_RETRY_NS : eta;
+		*only_bucket = global_eta == 0 && !blocked;
+		r = EAGAIN;
+		goto cleanup;
+	}
+	if(limits.rate > 0) global.tokens -= 1;
+	if(bucket != NULL && limits.plugin_rate > 0) bucket->tokens -= 1;
+	const uint64_t waited = ts_diff_ns(since, &now);
+	stats[lane].count ++;
+	stats[lane].total_ns += waited;
+	if(waited > stats[lane].max_ns) stats[lane].max_ns = waited;
+	if(waited >= 1000000ULL) stats[lane].delayed ++;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&sched_mutex);
+	return r;
+}
+
+void rcon_sched_dump(int out)
+{
+	static const char *lane_names[RCON_SCHED_LANES] = { "high", "normal", "low" };
+	pthread_mutex_lock(&sched_mutex);
+	limits_refresh();
+	const struct rcon_sched_limits l = limits;
+	struct lane_stats s[RCON_SCHED_LANES];
+	int w[RCON_SCHED_LANES];
+	for(int i = 0; i < RCON_SCHED_LANES; i ++)
+	{
+		s[i] = stats[i];
+		w[i] = waiting[i];
+	}
+	pthread_mutex_unlock(&sched_mutex);
+	dprintf(out, _("Global:\t%.2f/s, burst %.0f\n"), l.rate, l.burst);
+	dprintf(out, _("Plugin:\t%.2f/s, burst %.0f\n"), l.plugin_rate, l.plugin_burst);
+	dprintf(out, _("Lane\tCommands\tDelayed\tWaiting\tAvg wait (us)\tMax wait (us)\n"));
+	for(int i = 0; i < RCON_SCHED_LANES; i ++)
+	{
+		dprintf(out, "%s\t%" PRIu64 "\t%" PRIu64 "\t%d\t%" PRIu64 "\t%" PRIu64 "\n",
+				lane_names[i],
+				s[i].count,
+				s[i].delayed,
+				w[i],
+				s[i].count == 0 ? 0 : s[i].total_ns / s[i].count / 1000,
+				s[i].max_ns / 1000);
+	}
+}
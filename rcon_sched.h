@@ -0,0 +1,48 @@
+#ifndef _RCON_SCHED_H
+#define _RCON_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Priority lanes. Lower value wins. Mirrors EPG_RCON_PRIO_*. */
+#define RCON_SCHED_LANE_HIGH	0
+#define RCON_SCHED_LANE_NORMAL	1
+#define RCON_SCHED_LANE_LOW	2
+#define RCON_SCHED_LANES	3
+
+struct rcon_sched_bucket {
+	double tokens;
+	struct timespec last;
+};
+
+/* Part of the config. Rates are commands per second. A rate of 0 means unlimited. */
+struct rcon_sched_limits {
+	double rate;
+	double burst;
+	double plugin_rate;
+	double plugin_burst;
+};
+
+int rcon_sched_init();
+void rcon_sched_free();
+
+/* After publishing new limits: the waiting callers apply them now instead of at their old deadline. */
+void rcon_sched_limits_changed();
+
+struct rcon_sched_bucket *rcon_sched_bucket_new();
+void rcon_sched_bucket_free(struct rcon_sched_bucket *bucket);
+
+/* Block until both the global and the given bucket (may be NULL) have a token.
+ * Higher lanes are served first. The queueing delay is accounted per lane.
+ * Gives up with EPG_RCON_TIMEOUT, without taking a token, at deadline (CLOCK_MONOTONIC) unless it is NULL. */
+int rcon_sched_acquire(struct rcon_sched_bucket *bucket, int lane, const struct timespec *deadline);
+/* The same for a thread which cannot block, like the async reactor: takes the tokens right away or returns
+ * EAGAIN with the nanoseconds until trying again may succeed in eta_ns, and whether only the given bucket
+ * is short of a token in only_bucket. since is when the command was submitted, for the lane statistics. */
+int rcon_sched_try_acquire(struct rcon_sched_bucket *bucket, int lane, const struct timespec *since,
+		uint64_t *eta_ns, bool *only_bucket);
+
+void rcon_sched_dump(int out);
+
+#endif // _RCON_SCHED_H
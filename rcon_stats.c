@@ -0,0 +1,103 @@
+#include "rcon_stats.h"
+#include "plugin/plugin.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+struct rcon_stats *rcon_stats_new()
+{
+	struct rcon_stats *stats = calloc(1, sizeof(struct rcon_stats));
+	if(stats == NULL) return NULL;
+	if(pthread_mutex_init(&stats->mutex, NULL))
+	{
+		free(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+void rcon_stats_free(struct rcon_stats *stats)
+{
+	if(stats == NULL) return;
+	pthread_mutex_destroy(&stats->mutex);
+	free(stats);
+}
+
+void rcon_stats_reset(struct rcon_stats *stats)
+{
+	pthread_mutex_lock(&stats->mutex);
+	memset(&stats->c, 0, sizeof(struct rcon_counters));
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+void rcon_stats_sent(struct rcon_stats *stats, size_t bytes)
+{
+	pthread_mutex_lock(&stats->mutex);
+	stats->c.commands ++;
+	stats->c.bytes_out += bytes;
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+void rcon_stats_received(struct rcon_stats *stats, size_t bytes, uint64_t rtt_ns)
+{
+	pthread_mutex_lock(&stats->mutex);
+	stats->c.replies ++;
+	stats->c.bytes_in += bytes;
+	if(rtt_ns) hist_add(&stats->c.rtt, rtt_ns);
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+void rcon_stats_failed(struct rcon_stats *stats, int r)
+{
+	pthread_mutex_lock(&stats->mutex);
+	switch(r)
+	{
+		case EX_UNAVAILABLE:
+		case EX_NOHOST:
+			stats->c.connect_failures ++;
+			break;
+		case EX_NOPERM:
+			stats->c.auth_failures ++;
+			break;
+		case EPG_RCON_DISABLED:
+			stats->c.disabled ++;
+			break;
+		case EPG_RCON_TIMEOUT:
+			stats->c.timeouts ++;
+			break;
+		default:
+			stats->c.errors ++;
+			break;
+	}
+	pthread_mutex_unlock(&stats->mutex);
+}
+
+void rcon_stats_dump_header(int out)
+{
+	dprintf(out, _("Plugin\tCommands\tReplies\tBytes out\tBytes in\tp50 (us)\tp99 (us)\tMax (us)\tConnect fail\tAuth fail\tDisabled\tTimeout\tOther\n"));
+}
+
+void rcon_stats_dump(int out, const char *id, struct rcon_stats *stats)
+{
+	pthread_mutex_lock(&stats->mutex);
+	const struct rcon_counters s = stats->c;
+	pthread_mutex_unlock(&stats->mutex);
+	dprintf(out, "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+			id,
+			s.commands,
+			s.replies,
+			s.bytes_out,
+			s.bytes_in,
+			hist_percentile_us(&s.rtt, 0.5),
+			hist_percentile_us(&s.rtt, 0.99),
+			s.rtt.max_ns / 1000,
+			s.connect_failures,
+			s.auth_failures,
+			s.disabled,
+			s.timeouts,
+			s.errors);
+}
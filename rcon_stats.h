@@ -0,0 +1,44 @@
+#ifndef _RCON_STATS_H
+#define _RCON_STATS_H
+
+#include "hist.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct rcon_counters {
+	uint64_t commands;
+	uint64_t replies;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	/* Failures by cause. */
+	uint64_t connect_failures;
+	uint64_t auth_failures;
+	uint64_t disabled;
+	uint64_t timeouts;
+	uint64_t errors;
+	/* From sending a command to receiving its reply. */
+	struct hist rtt;
+};
+
+/* Rcon usage of one plugin. */
+struct rcon_stats {
+	pthread_mutex_t mutex;
+	struct rcon_counters c;
+};
+
+struct rcon_stats *rcon_stats_new();
+void rcon_stats_free(struct rcon_stats *stats);
+void rcon_stats_reset(struct rcon_stats *stats);
+
+void rcon_stats_sent(struct rcon_stats *stats, size_t bytes);
+/* rtt_ns is 0 if the matching command is unknown. */
+void rcon_stats_received(struct rcon_stats *stats, size_t bytes, uint64_t rtt_ns);
+/* Classify a failed rcon_host call by its return value. */
+void rcon_stats_failed(struct rcon_stats *stats, int r);
+
+void rcon_stats_dump_header(int out);
+void rcon_stats_dump(int out, const char *id, struct rcon_stats *stats);
+
+#endif // _RCON_STATS_H
@@ -1,7 +1,6 @@
 #include "../plugin/plugin.h"
 
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
 
 const uint32_t epg_version = 1;
@@ -28,18 +27,29 @@ int epg_unload(struct epg_handle *handle)
 	return 0;
 }
 
+static int query_daytime(struct epg_handle *handle, void *arg)
+{
+	int r = 0;
+	const char *out = NULL;
+	size_t len = 0;
+	r = handle->rcon_exec_view("time query daytime", 5000, &out, &len);
+	printf("[%s]: rcon_exec_view: %d. Length: %zu, out: '%s'.\n", handle->id, r, len, out);
+	handle->rcon_release();
+	return 0;
+}
+
 int epg_player_join(struct epg_handle *handle,
 		char *player)
 {
 	printf("[%s]: %s joined.\n", handle->id, player);
-	sleep(10);
-	int r = 0;
-	r = handle->rcon_send(11, "list");
-	printf("[%s]: rcon_send: %d\n", handle->id, r);
-	int id = -1;
-	char out[RCON_DATA_BUFFSIZE];
-	r = handle->rcon_recv(&id, out);
-	printf("[%s]: rcon_recv: %d. ID: %d, out: '%s'.\n", handle->id, r, id, out);
+	const struct epg_players *online = handle->players_acquire();
+	printf("[%s]: %zu player(s) online:", handle->id, online->count);
+	for(size_t i = 0; i < online->count; i ++)
+		printf(" %s", online->players[i].name);
+	printf(".\n");
+	handle->players_release(online);
+	const int r = handle->timer_add(10000, 0, &query_daytime, NULL, NULL);
+	printf("[%s]: timer_add: %d.\n", handle->id, r);
 	return 0;
 }
 
@@ -48,6 +58,10 @@ int epg_player_leave(struct epg_handle *handle,
 		char *reason)
 {
 	printf("[%s]: %s left: %s.\n", handle->id, player, reason);
+	char cmd[256];
+	snprintf(cmd, sizeof(cmd), "say Goodbye, %s.", player);
+	const int r = handle->rcon_defer(cmd);
+	printf("[%s]: rcon_defer: %d.\n", handle->id, r);
 	return 0;
 }
 
@@ -64,6 +78,14 @@ int epg_player_die(struct epg_handle *handle,
 		char *source)
 {
 	printf("[%s]: %s died because of %s.\n", handle->id, player, source);
+	const struct epg_players *online = handle->players_acquire();
+	const struct epg_player *p = handle->players_find(online, player);
+	if(p != NULL)
+	{
+		printf("[%s]: %s died %u time(s) since joining.\n", handle->id, player, p->deaths);
+		handle->score_set("session_deaths", player, (int)p->deaths);
+	}
+	handle->players_release(online);
 	return 0;
 }
 
@@ -0,0 +1,407 @@
+#include "scoreboard.h"
+#include "strmap.h"
+#include "rcon_host.h"
+#include "rcon_sched.h"
+#include "batch.h"
+#include "plugin/plugin.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+enum score_applied {
+	/* Never sent, or the server restarted since. */
+	SCORE_APPLIED_UNKNOWN,
+	SCORE_APPLIED_SET,
+	SCORE_APPLIED_RESET
+};
+
+struct score {
+	/* "<objective> <holder>" */
+	char *key;
+	char *objective;
+	char *holder;
+	/* Desired state. */
+	int value;
+	bool removed;
+	/* State on the server. */
+	enum score_applied applied;
+	int applied_value;
+	/* In the pending list. */
+	bool pending;
+	struct score *next_pending;
+};
+
+static pthread_mutex_t score_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct strmap scores;
+static bool scores_init = false;
+static struct score *pending_head = NULL;
+static struct score *pending_tail = NULL;
+static int pending_count = 0;
+
+static uint64_t total_sent = 0;
+static uint64_t total_suppressed = 0;
+static uint64_t total_failed = 0;
+
+static pthread_cond_t flush_cond;
+static bool flush_cond_init = false;
+static bool flush_quit = false;
+/* The last flush failed: wait longer before trying again. */
+static bool flush_backoff = false;
+static bool flush_thread_init = false;
+static pthread_t flush_thread;
+
+static void deadline_after(struct timespec *out, const int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, out);
+	out->tv_sec += ms / 1000;
+	out->tv_nsec += (ms % 1000) * 1000000L;
+	if(out->tv_nsec >= 1000000000L)
+	{
+		out->tv_sec ++;
+		out->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool valid_name(const char *name)
+{
+	if(name == NULL || name[0] == '\0') return false;
+	for(const char *c = name; *c; c ++)
+		if(*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') return false;
+	return true;
+}
+
+static void score_free(struct score *score)
+{
+	free(score->key);
+	free(score->objective);
+	free(score->holder);
+	free(score);
+}
+
+/* Caller holds score_mutex. */
+static struct score *score_get(const char *objective, const char *holder)
+{
+	const size_t objective_len = strlen(objective);
+	const size_t holder_len = strlen(holder);
+	char *key = malloc(objective_len + holder_len + 2);
+	if(key == NULL) return NULL;
+	memcpy(key, objective, objective_len);
+	key[objective_len] = ' ';
+	memcpy(&key[objective_len + 1], holder, holder_len + 1);
+	struct score *score = strmap_get(&scores, key);
+	if(score != NULL)
+	{
+		free(key);
+		return score;
+	}
+	score = calloc(1, sizeof(struct score));
+	if(score == NULL)
+	{
+		free(key);
+		return NULL;
+	}
+	score->key = key;
+	score->objective = strdup(objective);
+	score->holder = strdup(holder);
+	score->applied = SCORE_APPLIED_UNKNOWN;
+	if(score->objective == NULL || score->holder == NULL || strmap_put(&scores, score->key, score))
+	{
+		score_free(score);
+		return NULL;
+	}
+	return score;
+}
+
+/* Whether the desired state differs from the server. Caller holds score_mutex. */
+static bool score_changed(const struct score *score)
+{
+	if(score->removed) return score->applied != SCORE_APPLIED_RESET;
+	return score->applied != SCORE_APPLIED_SET || score->applied_value != score->value;
+}
+
+/* Caller holds score_mutex. */
+static void score_enqueue(struct score *score)
+{
+	if(score->pending) return;
+	score->pending = true;
+	score->next_pending = NULL;
+	if(pending_tail == NULL) pending_head = score;
+	else pending_tail->next_pending = score;
+	pending_tail = score;
+	pending_count ++;
+	if(pending_count == 1 && flush_cond_init) pthread_cond_signal(&flush_cond);
+}
+
+static int scoreboard_update(const char *objective, const char *holder, bool removed, int value)
+{
+	int r = 0;
+	if(!valid_name(objective) || !valid_name(holder)) return 64;
+	pthread_mutex_lock(&score_mutex);
+	struct score *score = score_get(objective, holder);
+	if(score == NULL)
+	{
+		r = errno ? errno : ENOMEM;
+		goto cleanup;
+	}
+	score->removed = removed;
+	score->value = value;
+	if(!score_changed(score))
+	{
+		total_suppressed ++;
+		goto cleanup;
+	}
+	score_enqueue(score);
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&score_mutex);
+	return r;
+}
+
+int scoreboard_set(const char *objective, const char *holder, int value)
+{
+	return scoreboard_update(objective, holder, false, value);
+}
+
+int scoreboard_reset(const char *objective, const char *holder)
+{
+	return scoreboard_update(objective, holder, true, 0);
+}
+
+void scoreboard_server_started()
+{
+	pthread_mutex_lock(&score_mutex);
+	if(scores_init)
+	{
+		size_t iter = 0;
+		void *value;
+		while(strmap_next(&scores, &iter, NULL, &value))
+		{
+			struct score *score = value;
+			score->applied = SCORE_APPLIED_UNKNOWN;
+			score_enqueue(score);
+		}
+	}
+	flush_backoff = false;
+	if(flush_cond_init) pthread_cond_signal(&flush_cond);
+	pthread_mutex_unlock(&score_mutex);
+}
+
+/* A pending entry as it is being sent. */
+struct score_change {
+	struct score *score;
+	bool changed;
+	bool removed;
+	int value;
+};
+
+/* Put count entries back in front of the pending list, keeping the order. Caller holds score_mutex. */
+static void requeue_locked(struct score *batch, const int count)
+{
+	struct score *last = batch;
+	for(int i = 1; i < count; i ++)
+		last = last->next_pending;
+	last->next_pending = pending_head;
+	if(pending_tail == NULL) pending_tail = last;
+	pending_head = batch;
+	pending_count += count;
+}
+
+/* Send the pending changes as one pipelined batch. Returns false if it failed and everything is still pending. */
+static bool flush()
+{
+	int r = 0;
+	pthread_mutex_lock(&score_mutex);
+	struct score *batch = pending_head;
+	const int count = pending_count;
+	pending_head = NULL;
+	pending_tail = NULL;
+	pending_count = 0;
+	pthread_mutex_unlock(&score_mutex);
+	if(batch == NULL) return true;
+	size_t sent = 0;
+	struct score_change *changes = calloc(count, sizeof(struct score_change));
+	char **cmds = calloc(count, sizeof(char *));
+	if(changes == NULL || cmds == NULL)
+	{
+		r = ENOMEM;
+		goto cleanup;
+	}
+	pthread_mutex_lock(&score_mutex);
+	struct score *score = batch;
+	for(int i = 0; i < count && !r; i ++, score = score->next_pending)
+	{
+		struct score_change *change = &changes[i];
+		change->score = score;
+		change->changed = score_changed(score);
+		change->removed = score->removed;
+		change->value = score->value;
+		if(!change->changed) continue;
+		char cmd[RCON_DATA_BUFFSIZE];
+		if(change->removed)
+			snprintf(cmd, sizeof(cmd), "scoreboard players reset %s %s", score->holder, score->objective);
+		else
+			snprintf(cmd, sizeof(cmd), "scoreboard players set %s %s %d", score->holder, score->objective, change->value);
+		cmds[sent] = strdup(cmd);
+		if(cmds[sent] == NULL) r = ENOMEM;
+		else sent ++;
+	}
+	pthread_mutex_unlock(&score_mutex);
+	if(r) goto cleanup;
+	if(sent)
+	{
+		/* One charge for the whole batch, which costs about one round trip. */
+		r = rcon_sched_acquire(NULL, RCON_SCHED_LANE_LOW, NULL);
+		struct timespec deadline;
+		rcon_host_deadline(&deadline, SCOREBOARD_TIMEOUT);
+		if(!r) r = batch_exec((const char *const *)cmds, sent, &deadline);
+		rcon_host_release();
+		if(r) goto cleanup;
+	}
+	pthread_mutex_lock(&score_mutex);
+	for(int i = 0; i < count; i ++)
+	{
+		score = changes[i].score;
+		score->pending = false;
+		if(changes[i].changed)
+		{
+			score->applied = changes[i].removed ? SCORE_APPLIED_RESET : SCORE_APPLIED_SET;
+			score->applied_value = changes[i].value;
+			total_sent ++;
+		}
+		if(score_changed(score))
+		{
+			/* Changed again while sending. */
+			score_enqueue(score);
+		}
+		else if(score->removed)
+		{
+			strmap_remove(&scores, score->key);
+			score_free(score);
+		}
+	}
+	pthread_mutex_unlock(&score_mutex);
+	if(sent) DEBUGF("scoreboard.c#flush: Sent %zu change(s).\n", sent);
+	goto cleanup;
+cleanup:
+	if(r)
+	{
+		DEBUGF("scoreboard.c#flush: Cannot apply scores: %d. Retrying later.\n", r);
+		/* Setting a score again is harmless: the whole batch goes back. */
+		pthread_mutex_lock(&score_mutex);
+		total_failed ++;
+		requeue_locked(batch, count);
+		pthread_mutex_unlock(&score_mutex);
+	}
+	if(cmds != NULL)
+	{
+		for(size_t i = 0; i < sent; i ++)
+			free(cmds[i]);
+	}
+	free(cmds);
+	free(changes);
+	return !r;
+}
+
+static void *flush_main(void *arg)
+{
+	thread_set_name("scoreboard");
+	rcon_host_own();
+	pthread_mutex_lock(&score_mutex);
+	while(!flush_quit)
+	{
+		if(pending_count == 0)
+		{
+			pthread_cond_wait(&flush_cond, &score_mutex);
+			continue;
+		}
+		/* Gather changes made together, or back off after a failure. */
+		struct timespec deadline;
+		deadline_after(&deadline, flush_backoff ? SCOREBOARD_RETRY_MS : SCOREBOARD_FLUSH_MS);
+		/* Woken up early: by the server starting, or by quitting. */
+		if(pthread_cond_timedwait(&flush_cond, &score_mutex, &deadline) != ETIMEDOUT) continue;
+		pthread_mutex_unlock(&score_mutex);
+		const bool ok = flush();
+		pthread_mutex_lock(&score_mutex);
+		flush_backoff = !ok;
+	}
+	pthread_mutex_unlock(&score_mutex);
+	return NULL;
+}
+
+int scoreboard_init()
+{
+	int r = 0;
+	r = strmap_init(&scores, 256);
+	if(r) goto cleanup;
+	scores_init = true;
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(!r) r = pthread_cond_init(&flush_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	flush_cond_init = true;
+	r = pthread_create(&flush_thread, NULL, &flush_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	flush_thread_init = true;
+cleanup:
+	if(r) scoreboard_free();
+	return r;
+}
+
+void scoreboard_free()
+{
+	if(flush_thread_init)
+	{
+		pthread_mutex_lock(&score_mutex);
+		flush_quit = true;
+		pthread_cond_signal(&flush_cond);
+		pthread_mutex_unlock(&score_mutex);
+		pthread_join(flush_thread, NULL);
+		flush_thread_init = false;
+	}
+	if(flush_cond_init)
+	{
+		pthread_cond_destroy(&flush_cond);
+		flush_cond_init = false;
+	}
+	pthread_mutex_lock(&score_mutex);
+	if(scores_init)
+	{
+		size_t iter = 0;
+		void *value;
+		while(strmap_next(&scores, &iter, NULL, &value))
+			score_free(value);
+		strmap_free(&scores);
+		scores_init = false;
+	}
+	pending_head = NULL;
+	pending_tail = NULL;
+	pending_count = 0;
+	pthread_mutex_unlock(&score_mutex);
+}
+
+void scoreboard_dump(int out)
+{
+	pthread_mutex_lock(&score_mutex);
+	const size_t entries = scores_init ? scores.size : 0;
+	const int pending = pending_count;
+	const uint64_t sent = total_sent, suppressed = total_suppressed, failed = total_failed;
+	pthread_mutex_unlock(&score_mutex);
+	dprintf(out, _("Entries:\t%zu\nPending:\t%d\nSent:\t%" PRIu64 "\nUnchanged (not sent):\t%" PRIu64 "\nFailed flushes:\t%" PRIu64 "\n"),
+			entries, pending, sent, suppressed, failed);
+}
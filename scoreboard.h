@@ -0,0 +1,25 @@
+#ifndef _SCOREBOARD_H
+#define _SCOREBOARD_H
+
+/* Changes arriving within this window are sent together. */
+#define SCOREBOARD_FLUSH_MS	100
+/* Retry interval after rcon failed. */
+#define SCOREBOARD_RETRY_MS	5000
+#define SCOREBOARD_TIMEOUT	5000
+
+/*
+ * Desired scoreboard state declared by plugins. The last applied state is kept,
+ * so only changed entries are sent. Everything is sent again after the server started.
+ */
+int scoreboard_init();
+void scoreboard_free();
+
+/* Returns 64 if the objective or holder is empty or contains whitespace. */
+int scoreboard_set(const char *objective, const char *holder, int value);
+int scoreboard_reset(const char *objective, const char *holder);
+
+void scoreboard_server_started();
+
+void scoreboard_dump(int out);
+
+#endif // _SCOREBOARD_H
@@ -0,0 +1,451 @@
+#include "session.h"
+#include "strmap.h"
+#include "config.h"
+#include "rcon_host.h"
+#include "rcon_sched.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+struct session_player {
+	char *name;
+	int64_t joined;
+	int64_t last_chat;
+	uint32_t deaths;
+};
+
+/* A published snapshot. pub must stay first: plugins only see it. */
+struct session_snapshot {
+	struct epg_players pub;
+	int refs;
+	struct epg_player items[];
+};
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct strmap players;
+static bool players_init = false;
+/* Bumped on every change, so a reconciliation can tell it raced with an event. */
+static uint64_t seq = 0;
+static struct session_snapshot *current = NULL;
+static bool dirty = true;
+
+static pthread_cond_t sync_cond;
+static bool sync_cond_init = false;
+static bool sync_requested = false;
+static bool sync_quit = false;
+static bool sync_thread_init = false;
+static pthread_t sync_thread;
+
+static void player_free(struct session_player *player)
+{
+	free(player->name);
+	free(player);
+}
+
+/* Caller holds session_mutex. */
+static struct session_player *player_add(const char *name)
+{
+	struct session_player *player = calloc(1, sizeof(struct session_player));
+	if(player == NULL) return NULL;
+	player->name = strdup(name);
+	if(player->name == NULL || strmap_put(&players, player->name, player))
+	{
+		player_free(player);
+		return NULL;
+	}
+	player->joined = time(NULL);
+	return player;
+}
+
+/* Caller holds session_mutex. */
+static void changed()
+{
+	seq ++;
+	dirty = true;
+}
+
+static void snapshot_unref(struct session_snapshot *snapshot)
+{
+	if(-- snapshot->refs == 0) free(snapshot);
+}
+
+void session_join(const char *player)
+{
+	pthread_mutex_lock(&session_mutex);
+	struct session_player *p = strmap_get(&players, player);
+	if(p != NULL)
+	{
+		/* Missed the leave message. */
+		p->joined = time(NULL);
+		p->last_chat = 0;
+		p->deaths = 0;
+	}
+	else if(player_add(player) == NULL)
+	{
+		fprintf(stderr, _("Cannot track player %s: %d.\n"), player, errno);
+	}
+	changed();
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void session_leave(const char *player)
+{
+	pthread_mutex_lock(&session_mutex);
+	struct session_player *p = strmap_remove(&players, player);
+	if(p != NULL)
+	{
+		player_free(p);
+		changed();
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void session_chat(const char *player)
+{
+	pthread_mutex_lock(&session_mutex);
+	struct session_player *p = strmap_get(&players, player);
+	if(p != NULL)
+	{
+		p->last_chat = time(NULL);
+		changed();
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void session_death(const char *player)
+{
+	pthread_mutex_lock(&session_mutex);
+	struct session_player *p = strmap_get(&players, player);
+	if(p != NULL)
+	{
+		p->deaths ++;
+		changed();
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/* Caller holds session_mutex. */
+static void players_clear()
+{
+	size_t iter = 0;
+	void *value;
+	while(strmap_next(&players, &iter, NULL, &value))
+		player_free(value);
+	strmap_clear(&players);
+}
+
+void session_server_stopping()
+{
+	pthread_mutex_lock(&session_mutex);
+	players_clear();
+	changed();
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void session_server_started()
+{
+	pthread_mutex_lock(&session_mutex);
+	sync_requested = true;
+	if(sync_cond_init) pthread_cond_signal(&sync_cond);
+	pthread_mutex_unlock(&session_mutex);
+}
+
+static int player_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct epg_player *)a)->name, ((const struct epg_player *)b)->name);
+}
+
+/* Caller holds session_mutex. */
+static struct session_snapshot *snapshot_build()
+{
+	size_t names = 0;
+	size_t iter = 0;
+	const char *key;
+	while(strmap_next(&players, &iter, &key, NULL))
+		names += strlen(key) + 1;
+	const size_t count = players.size;
+	/* Names are stored behind the items, so a snapshot is a single allocation. */
+	struct session_snapshot *snapshot = malloc(sizeof(struct session_snapshot) + count * sizeof(struct epg_player) + names);
+	if(snapshot == NULL) return NULL;
+	char *name = (char *)&snapshot->items[count];
+	size_t i = 0;
+	void *value;
+	iter = 0;
+	while(strmap_next(&players, &iter, NULL, &value))
+	{
+		const struct session_player *p = value;
+		const size_t len = strlen(p->name) + 1;
+		memcpy(name, p->name, len);
+		snapshot->items[i].name = name;
+		snapshot->items[i].joined = p->joined;
+		snapshot->items[i].last_chat = p->last_chat;
+		snapshot->items[i].deaths = p->deaths;
+		name += len;
+		i ++;
+	}
+	qsort(snapshot->items, count, sizeof(struct epg_player), &player_cmp);
+	snapshot->pub.count = count;
+	snapshot->pub.players = snapshot->items;
+	snapshot->refs = 1;
+	return snapshot;
+}
+
+const struct epg_players *session_acquire()
+{
+	static const struct epg_players empty = { 0, NULL };
+	pthread_mutex_lock(&session_mutex);
+	if(dirty || current == NULL)
+	{
+		struct session_snapshot *snapshot = snapshot_build();
+		if(snapshot != NULL)
+		{
+			if(current != NULL) snapshot_unref(current);
+			current = snapshot;
+			dirty = false;
+		}
+	}
+	struct session_snapshot *snapshot = current;
+	if(snapshot != NULL) snapshot->refs ++;
+	pthread_mutex_unlock(&session_mutex);
+	return snapshot == NULL ? &empty : &snapshot->pub;
+}
+
+void session_release(const struct epg_players *players)
+{
+	if(players == NULL || players->players == NULL) return;
+	pthread_mutex_lock(&session_mutex);
+	snapshot_unref((struct session_snapshot *)players);
+	pthread_mutex_unlock(&session_mutex);
+}
+
+const struct epg_player *session_find(const struct epg_players *players, const char *name)
+{
+	size_t lo = 0, hi = players->count;
+	while(lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(players->players[mid].name, name);
+		if(cmp == 0) return &players->players[mid];
+		if(cmp < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return NULL;
+}
+
+/* Names after the colon of "There are 1 of a max of 20 players online: a, b". */
+static int parse_list(char *reply, struct strmap *out)
+{
+	char *names = strchr(reply, ':');
+	if(names == NULL) return EINVAL;
+	names ++;
+	char *save = NULL;
+	for(char *name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+	{
+		while(*name == ' ') name ++;
+		size_t len = strlen(name);
+		while(len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\n')) name[-- len] = '\0';
+		if(len == 0) continue;
+		const int r = strmap_put(out, name, name);
+		if(r) return r;
+	}
+	return 0;
+}
+
+static void sync_once()
+{
+	int r = 0;
+	char *reply = NULL;
+	struct strmap online = { NULL, 0, 0, 0 };
+	pthread_mutex_lock(&session_mutex);
+	const uint64_t start_seq = seq;
+	pthread_mutex_unlock(&session_mutex);
+	r = rcon_sched_acquire(NULL, RCON_SCHED_LANE_LOW, NULL);
+	if(r) goto cleanup;
+	const char *data;
+	size_t len;
+	struct timespec deadline;
+	rcon_host_deadline(&deadline, SESSION_SYNC_TIMEOUT);
+	r = rcon_host_exec_view("list", &deadline, &data, &len);
+	if(!r) reply = strdup(data);
+	rcon_host_release();
+	if(r) goto cleanup;
+	if(reply == NULL)
+	{
+		r = errno;
+		goto cleanup;
+	}
+	r = strmap_init(&online, 16);
+	if(r) goto cleanup;
+	r = parse_list(reply, &online);
+	if(r) goto cleanup;
+
+	pthread_mutex_lock(&session_mutex);
+	if(seq != start_seq)
+	{
+		/* An event arrived while 'list' was in flight. Trust the events. */
+		pthread_mutex_unlock(&session_mutex);
+		DEBUG("session.c#sync_once: Raced with an event. Skipping.\n");
+		goto cleanup;
+	}
+	int added = 0, removed = 0;
+	size_t iter = 0;
+	const char *key;
+	void *value;
+	while(strmap_next(&players, &iter, &key, &value))
+	{
+		if(strmap_get(&online, key) != NULL) continue;
+		strmap_remove(&players, key);
+		player_free(value);
+		removed ++;
+	}
+	iter = 0;
+	while(strmap_next(&online, &iter, &key, NULL))
+	{
+		if(strmap_get(&players, key) != NULL) continue;
+		if(player_add(key) != NULL) added ++;
+	}
+	if(added || removed) changed();
+	pthread_mutex_unlock(&session_mutex);
+	if(added || removed)
+		DEBUGF("session.c#sync_once: Reconciled: %d added, %d removed.\n", added, removed);
+	goto cleanup;
+cleanup:
+	if(r && r != EPG_RCON_DISABLED)
+		DEBUGF("session.c#sync_once: Cannot reconcile: %d.\n", r);
+	if(online.entries != NULL) strmap_free(&online);
+	free(reply);
+}
+
+static void *sync_main(void *arg)
+{
+	thread_set_name("session-sync");
+	rcon_host_own();
+	pthread_mutex_lock(&session_mutex);
+	while(!sync_quit)
+	{
+		struct config *cfg = config_acquire();
+		const int interval = cfg->session_sync_interval;
+		config_release(cfg);
+		if(!sync_requested)
+		{
+			if(interval <= 0)
+			{
+				pthread_cond_wait(&sync_cond, &session_mutex);
+			}
+			else
+			{
+				struct timespec deadline;
+				clock_gettime(CLOCK_MONOTONIC, &deadline);
+				deadline.tv_sec += interval / 1000;
+				deadline.tv_nsec += (interval % 1000) * 1000000L;
+				if(deadline.tv_nsec >= 1000000000L)
+				{
+					deadline.tv_sec ++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+				const int r = pthread_cond_timedwait(&sync_cond, &session_mutex, &deadline);
+				if(r == ETIMEDOUT) sync_requested = true;
+			}
+		}
+		if(sync_quit || !sync_requested) continue;
+		sync_requested = false;
+		pthread_mutex_unlock(&session_mutex);
+		sync_once();
+		pthread_mutex_lock(&session_mutex);
+	}
+	pthread_mutex_unlock(&session_mutex);
+	return NULL;
+}
+
+int session_init()
+{
+	int r = 0;
+	r = strmap_init(&players, 64);
+	if(r) goto cleanup;
+	players_init = true;
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(!r) r = pthread_cond_init(&sync_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	sync_cond_init = true;
+	r = pthread_create(&sync_thread, NULL, &sync_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	sync_thread_init = true;
+cleanup:
+	if(r) session_free();
+	return r;
+}
+
+void session_free()
+{
+	if(sync_thread_init)
+	{
+		pthread_mutex_lock(&session_mutex);
+		sync_quit = true;
+		pthread_cond_signal(&sync_cond);
+		pthread_mutex_unlock(&session_mutex);
+		pthread_join(sync_thread, NULL);
+		sync_thread_init = false;
+	}
+	if(sync_cond_init)
+	{
+		pthread_cond_destroy(&sync_cond);
+		sync_cond_init = false;
+	}
+	pthread_mutex_lock(&session_mutex);
+	if(players_init)
+	{
+		players_clear();
+		strmap_free(&players);
+		players_init = false;
+	}
+	if(current != NULL)
+	{
+		snapshot_unref(current);
+		current = NULL;
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+static void format_time(char *buf, size_t size, int64_t t)
+{
+	if(t == 0)
+	{
+		snprintf(buf, size, "-");
+		return;
+	}
+	const time_t tt = t;
+	struct tm tm;
+	localtime_r(&tt, &tm);
+	strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+void session_dump(int out)
+{
+	const struct epg_players *snapshot = session_acquire();
+	dprintf(out, _("Player\tJoined\tLast chat\tDeaths\n"));
+	for(size_t i = 0; i < snapshot->count; i ++)
+	{
+		const struct epg_player *p = &snapshot->players[i];
+		char joined[32], last_chat[32];
+		format_time(joined, sizeof(joined), p->joined);
+		format_time(last_chat, sizeof(last_chat), p->last_chat);
+		dprintf(out, "%s\t%s\t%s\t%u\n", p->name, joined, last_chat, p->deaths);
+	}
+	session_release(snapshot);
+}
@@ -0,0 +1,31 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include "plugin/plugin.h"
+
+/* Wait at most this long for the reply of the reconciliation 'list'. */
+#define SESSION_SYNC_TIMEOUT	5000
+
+/*
+ * Online players, maintained from the console events and reconciled against
+ * 'list' every config session_sync_interval milliseconds.
+ */
+int session_init();
+void session_free();
+
+/* Updates from the console reader. */
+void session_join(const char *player);
+void session_leave(const char *player);
+void session_chat(const char *player);
+void session_death(const char *player);
+void session_server_stopping();
+void session_server_started();
+
+/* Immutable snapshots, see struct epg_players. */
+const struct epg_players *session_acquire();
+void session_release(const struct epg_players *players);
+const struct epg_player *session_find(const struct epg_players *players, const char *name);
+
+void session_dump(int out);
+
+#endif // _SESSION_H
@@ -0,0 +1,153 @@
+#include "strmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Marks a deleted slot so probing continues past it. */
+static const char tombstone[] = "";
+
+static unsigned int strmap_hash(const char *key)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char *)key; *c; c ++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int strmap_init(struct strmap *map, size_t cap)
+{
+	size_t size = 8;
+	while(size < cap * 2) size <<= 1;
+	map->entries = calloc(size, sizeof(struct strmap_entry));
+	if(map->entries == NULL) return errno;
+	map->cap = size;
+	map->size = 0;
+	map->used = 0;
+	return 0;
+}
+
+void strmap_free(struct strmap *map)
+{
+	free(map->entries);
+	map->entries = NULL;
+	map->cap = 0;
+	map->size = 0;
+	map->used = 0;
+}
+
+/* Slot holding key, or the slot to insert it at. */
+static struct strmap_entry *strmap_find(const struct strmap *map, const char *key, const unsigned int hash)
+{
+	const size_t mask = map->cap - 1;
+	struct strmap_entry *free_slot = NULL;
+	for(size_t i = hash & mask; ; i = (i + 1) & mask)
+	{
+		struct strmap_entry *entry = &map->entries[i];
+		if(entry->key == NULL)
+			return free_slot != NULL ? free_slot : entry;
+		if(entry->key == tombstone)
+		{
+			if(free_slot == NULL) free_slot = entry;
+			continue;
+		}
+		if(entry->hash == hash && !strcmp(entry->key, key))
+			return entry;
+	}
+}
+
+static int strmap_resize(struct strmap *map, size_t cap)
+{
+	struct strmap_entry *old = map->entries;
+	const size_t old_cap = map->cap;
+	map->entries = calloc(cap, sizeof(struct strmap_entry));
+	if(map->entries == NULL)
+	{
+		map->entries = old;
+		return errno;
+	}
+	map->cap = cap;
+	map->used = map->size;
+	for(size_t i = 0; i < old_cap; i ++)
+	{
+		if(old[i].key == NULL || old[i].key == tombstone) continue;
+		*strmap_find(map, old[i].key, old[i].hash) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+void *strmap_get(const struct strmap *map, const char *key)
+{
+	if(map->size == 0) return NULL;
+	const struct strmap_entry *entry = strmap_find(map, key, strmap_hash(key));
+	if(entry->key == NULL || entry->key == tombstone) return NULL;
+	return entry->value;
+}
+
+int strmap_put(struct strmap *map, const char *key, void *value)
+{
+	/* Keep at least a quarter of the slots empty so lookups terminate quickly. */
+	if((map->used + 1) * 4 > map->cap * 3)
+	{
+		/* Grow if it is really full, otherwise only drop the deleted slots. */
+		const int r = strmap_resize(map, (map->size + 1) * 2 > map->cap ? map->cap * 2 : map->cap);
+		if(r) return r;
+	}
+	const unsigned int hash = strmap_hash(key);
+	struct strmap_entry *entry = strmap_find(map, key, hash);
+	if(entry->key == NULL || entry->key == tombstone)
+	{
+		if(entry->key == NULL) map->used ++;
+		map->size ++;
+	}
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	return 0;
+}
+
+int strmap_reserve(struct strmap *map, size_t count)
+{
+	if((map->used + count) * 4 <= map->cap * 3) return 0;
+	size_t cap = map->cap;
+	while((map->size + count) * 4 > cap * 3) cap *= 2;
+	return strmap_resize(map, cap);
+}
+
+void *strmap_remove(struct strmap *map, const char *key)
+{
+	if(map->size == 0) return NULL;
+	struct strmap_entry *entry = strmap_find(map, key, strmap_hash(key));
+	if(entry->key == NULL || entry->key == tombstone) return NULL;
+	void *value = entry->value;
+	entry->key = tombstone;
+	entry->value = NULL;
+	map->size --;
+	return value;
+}
+
+void strmap_clear(struct strmap *map)
+{
+	memset(map->entries, 0, map->cap * sizeof(struct strmap_entry));
+	map->size = 0;
+	map->used = 0;
+}
+
+bool strmap_next(const struct strmap *map, size_t *iter, const char **key, void **value)
+{
+	for(; *iter < map->cap; (*iter) ++)
+	{
+		const struct strmap_entry *entry = &map->entries[*iter];
+		if(entry->key == NULL || entry->key == tombstone) continue;
+		if(key != NULL) *key = entry->key;
+		if(value != NULL) *value = entry->value;
+		(*iter) ++;
+		return true;
+	}
+	return false;
+}
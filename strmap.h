@@ -0,0 +1,44 @@
+#ifndef _STRMAP_H
+#define _STRMAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Open addressing hash map from NULL terminated strings to pointers.
+ * Keys are not copied: a key must stay valid while it is in the map.
+ * Not synchronized.
+ */
+
+struct strmap_entry {
+	const char *key;
+	void *value;
+	unsigned int hash;
+};
+
+struct strmap {
+	struct strmap_entry *entries;
+	/* Power of two. */
+	size_t cap;
+	size_t size;
+	/* Live and deleted slots. */
+	size_t used;
+};
+
+int strmap_init(struct strmap *map, size_t cap);
+void strmap_free(struct strmap *map);
+
+void *strmap_get(const struct strmap *map, const char *key);
+/* Insert or replace. */
+int strmap_put(struct strmap *map, const char *key, void *value);
+/* Make room for count more keys: that many puts cannot fail. */
+int strmap_reserve(struct strmap *map, size_t count);
+/* Returns the removed value or NULL. */
+void *strmap_remove(struct strmap *map, const char *key);
+void strmap_clear(struct strmap *map);
+
+/* Iterate with *iter starting at 0. Returns false at the end.
+ * Removing the returned entry is allowed, other changes are not. */
+bool strmap_next(const struct strmap *map, size_t *iter, const char **key, void **value);
+
+#endif // _STRMAP_H
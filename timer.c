@@ -0,0 +1,424 @@
+#include "timer.h"
+#include "strmap.h"
+#include "hist.h"
+#include "threads_util.h"
+#include "common.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TIMER_SLOTS	(1 << TIMER_LEVEL_BITS)
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+
+struct timer {
+	uint64_t id;
+	/* id in hex, the key in the index. */
+	char key[17];
+	uint64_t owner;
+	/* Ticks. */
+	uint64_t expires;
+	uint64_t interval;
+	void (*call)(void *, uint64_t);
+	void *arg;
+	void (*arg_free)(void *);
+	struct plugin_queue *queue;
+	bool in_wheel;
+	bool indexed;
+	bool cancelled;
+	/* The wheel and every scheduled callback hold a reference. */
+	int refs;
+	int running;
+	struct timer *prev;
+	struct timer *next;
+};
+
+/* A scheduled callback. */
+struct timer_fire {
+	struct timer *timer;
+	uint64_t due_ns;
+};
+
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* A callback finished. */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tick_cond;
+static bool tick_cond_init = false;
+static bool timer_quit = false;
+static bool timer_thread_init = false;
+static pthread_t timer_thread;
+static threadpool pool = NULL;
+
+static struct timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+/* The last tick processed. */
+static uint64_t current_tick = 0;
+static uint64_t start_ns = 0;
+/* Timers in the wheel. */
+static size_t active = 0;
+static struct strmap timer_index;
+static bool index_init = false;
+static uint64_t next_id = 1;
+
+static uint64_t total_added = 0;
+static uint64_t total_fired = 0;
+static uint64_t total_cancelled = 0;
+/* How late callbacks started. */
+static struct hist lateness;
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t now_tick()
+{
+	return (now_ns() - start_ns) / (TIMER_TICK_MS * 1000000ULL);
+}
+
+/* Caller holds timer_mutex, for all of the following. */
+static void wheel_link(struct timer *timer, uint64_t min_tick)
+{
+	if(timer->expires < min_tick) timer->expires = min_tick;
+	uint64_t expires = timer->expires;
+	const uint64_t delta = expires - current_tick;
+	int level = 0;
+	while(level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1))))
+		level ++;
+	/* Beyond the wheel: parked in the last slot in reach, then cascaded again. */
+	const uint64_t reach = 1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS);
+	if(delta >= reach) expires = current_tick + reach - 1;
+	struct timer **slot = &wheel[level][(expires >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK];
+	timer->prev = NULL;
+	timer->next = *slot;
+	if(*slot != NULL) (*slot)->prev = timer;
+	*slot = timer;
+	timer->in_wheel = true;
+}
+
+static void wheel_unlink(struct timer *timer, struct timer **slot)
+{
+	if(timer->prev != NULL) timer->prev->next = timer->next;
+	else *slot = timer->next;
+	if(timer->next != NULL) timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->in_wheel = false;
+}
+
+/* The slot holding timer, which is in the wheel. */
+static struct timer **slot_of(struct timer *timer)
+{
+	for(int level = 0; level < TIMER_LEVELS; level ++)
+		for(int i = 0; i < TIMER_SLOTS; i ++)
+			if(wheel[level][i] == timer) return &wheel[level][i];
+	return NULL;
+}
+
+static void release(struct timer *timer)
+{
+	if(-- timer->refs > 0) return;
+	if(timer->indexed) strmap_remove(&timer_index, timer->key);
+	if(timer->arg_free != NULL) timer->arg_free(timer->arg);
+	free(timer);
+}
+
+static void cancel(struct timer *timer)
+{
+	timer->cancelled = true;
+	total_cancelled ++;
+	if(timer->indexed)
+	{
+		strmap_remove(&timer_index, timer->key);
+		timer->indexed = false;
+	}
+	if(timer->in_wheel)
+	{
+		/* Only the head of a slot has no previous timer. */
+		wheel_unlink(timer, timer->prev == NULL ? slot_of(timer) : NULL);
+		active --;
+		release(timer);
+	}
+}
+
+static void timer_job(void *arg)
+{
+	struct timer_fire *fire = arg;
+	struct timer *timer = fire->timer;
+	pthread_mutex_lock(&timer_mutex);
+	const bool run = !timer->cancelled;
+	if(run)
+	{
+		timer->running ++;
+		total_fired ++;
+		const uint64_t now = now_ns();
+		hist_add(&lateness, now > fire->due_ns ? now - fire->due_ns : 0);
+	}
+	pthread_mutex_unlock(&timer_mutex);
+	if(run) timer->call(timer->arg, fire->due_ns);
+	pthread_mutex_lock(&timer_mutex);
+	if(run)
+	{
+		timer->running --;
+		pthread_cond_broadcast(&done_cond);
+	}
+	release(timer);
+	pthread_mutex_unlock(&timer_mutex);
+	free(fire);
+}
+
+static void fire(struct timer *timer)
+{
+	struct timer_fire *job = malloc(sizeof(struct timer_fire));
+	if(job == NULL)
+	{
+		DEBUGF("timer.c#fire: Cannot allocate memory, skipping timer %" PRIu64 ".\n", timer->id);
+	}
+	else
+	{
+		job->timer = timer;
+		job->due_ns = start_ns + timer->expires * TIMER_TICK_MS * 1000000ULL;
+		timer->refs ++;
+		if(timer->queue != NULL)
+			plugin_queue_push(timer->queue, pool, &timer_job, job);
+		else
+			thpool_add_work(pool, &timer_job, job);
+	}
+	if(timer->interval == 0)
+	{
+		active --;
+		release(timer);
+		return;
+	}
+	/* Missed periods are skipped rather than run in a burst. */
+	timer->expires += timer->interval;
+	wheel_link(timer, current_tick + 1);
+}
+
+static void advance()
+{
+	current_tick ++;
+	/* Move the timers of the next slot of a level down when the level below wraps around. */
+	for(int level = 1; level < TIMER_LEVELS; level ++)
+	{
+		if(current_tick & ((1ULL << (TIMER_LEVEL_BITS * level)) - 1)) break;
+		struct timer **slot = &wheel[level][(current_tick >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK];
+		struct timer *timer = *slot;
+		*slot = NULL;
+		while(timer != NULL)
+		{
+			struct timer *next = timer->next;
+			wheel_link(timer, current_tick);
+			timer = next;
+		}
+	}
+	struct timer **slot = &wheel[0][current_tick & TIMER_MASK];
+	struct timer *timer = *slot;
+	*slot = NULL;
+	while(timer != NULL)
+	{
+		struct timer *next = timer->next;
+		timer->in_wheel = false;
+		timer->prev = NULL;
+		timer->next = NULL;
+		if(timer->expires <= current_tick) fire(timer);
+		else wheel_link(timer, current_tick + 1);
+		timer = next;
+	}
+}
+
+static void *timer_main(void *arg)
+{
+	thread_set_name("timer");
+	pthread_mutex_lock(&timer_mutex);
+	while(!timer_quit)
+	{
+		if(active == 0)
+		{
+			pthread_cond_wait(&tick_cond, &timer_mutex);
+			continue;
+		}
+		const uint64_t target = now_tick();
+		while(current_tick < target && active > 0)
+			advance();
+		const uint64_t next_ns = start_ns + (current_tick + 1) * TIMER_TICK_MS * 1000000ULL;
+		struct timespec deadline;
+		deadline.tv_sec = next_ns / 1000000000;
+		deadline.tv_nsec = next_ns % 1000000000;
+		pthread_cond_timedwait(&tick_cond, &timer_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&timer_mutex);
+	return NULL;
+}
+
+int timer_init(threadpool thpool)
+{
+	int r = 0;
+	pool = thpool;
+	start_ns = now_ns();
+	current_tick = 0;
+	hist_reset(&lateness);
+	r = strmap_init(&timer_index, 64);
+	if(r) goto cleanup;
+	index_init = true;
+	pthread_condattr_t attr;
+	r = pthread_condattr_init(&attr);
+	if(r) goto cleanup;
+	r = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if(!r) r = pthread_cond_init(&tick_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(r) goto cleanup;
+	tick_cond_init = true;
+	r = pthread_create(&timer_thread, NULL, &timer_main, NULL);
+	if(r)
+	{
+		fprintf(stderr, _("Cannot setup thread: %d\n"), r);
+		goto cleanup;
+	}
+	timer_thread_init = true;
+cleanup:
+	if(r) timer_free();
+	return r;
+}
+
+void timer_free()
+{
+	if(timer_thread_init)
+	{
+		pthread_mutex_lock(&timer_mutex);
+		timer_quit = true;
+		pthread_cond_signal(&tick_cond);
+		pthread_mutex_unlock(&timer_mutex);
+		pthread_join(timer_thread, NULL);
+		timer_thread_init = false;
+	}
+	if(tick_cond_init)
+	{
+		pthread_cond_destroy(&tick_cond);
+		tick_cond_init = false;
+	}
+	pthread_mutex_lock(&timer_mutex);
+	if(index_init)
+	{
+		size_t iter = 0;
+		void *value;
+		while(strmap_next(&timer_index, &iter, NULL, &value))
+			cancel(value);
+		strmap_free(&timer_index);
+		index_init = false;
+	}
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+int timer_add(uint64_t owner, uint32_t delay_ms, uint32_t interval_ms, void (*call)(void *, uint64_t), void *arg,
+		void (*arg_free)(void *), struct plugin_queue *queue, uint64_t *id)
+{
+	int r = 0;
+	struct timer *timer = calloc(1, sizeof(struct timer));
+	if(timer == NULL) return errno;
+	pthread_mutex_lock(&timer_mutex);
+	if(!timer_thread_init)
+	{
+		r = ECANCELED;
+		goto cleanup;
+	}
+	/* The wheel is empty: skip the idle ticks. */
+	if(active == 0) current_tick = now_tick();
+	timer->id = next_id ++;
+	snprintf(timer->key, sizeof(timer->key), "%" PRIx64, timer->id);
+	timer->owner = owner;
+	timer->expires = now_tick() + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	timer->interval = interval_ms == 0 ? 0 : (interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	timer->call = call;
+	timer->arg = arg;
+	timer->arg_free = arg_free;
+	timer->queue = queue;
+	r = strmap_put(&timer_index, timer->key, timer);
+	if(r) goto cleanup;
+	timer->indexed = true;
+	timer->refs = 1;
+	wheel_link(timer, current_tick + 1);
+	if(active ++ == 0) pthread_cond_signal(&tick_cond);
+	total_added ++;
+	if(id != NULL) *id = timer->id;
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&timer_mutex);
+	if(r) free(timer);
+	return r;
+}
+
+int timer_cancel(uint64_t owner, uint64_t id)
+{
+	int r = 0;
+	char key[17];
+	snprintf(key, sizeof(key), "%" PRIx64, id);
+	pthread_mutex_lock(&timer_mutex);
+	struct timer *timer = index_init ? strmap_get(&timer_index, key) : NULL;
+	if(timer == NULL || timer->owner != owner)
+	{
+		r = ENOENT;
+		goto cleanup;
+	}
+	cancel(timer);
+	goto cleanup;
+cleanup:
+	pthread_mutex_unlock(&timer_mutex);
+	return r;
+}
+
+void timer_cancel_owner(uint64_t owner)
+{
+	pthread_mutex_lock(&timer_mutex);
+	if(!index_init)
+	{
+		pthread_mutex_unlock(&timer_mutex);
+		return;
+	}
+	/* Cancelled timers leave the index: keep them in a list, with a reference, to wait for them. */
+	struct timer *cancelled = NULL;
+	size_t iter = 0;
+	void *value;
+	while(strmap_next(&timer_index, &iter, NULL, &value))
+	{
+		struct timer *timer = value;
+		if(timer->owner != owner) continue;
+		timer->refs ++;
+		cancel(timer);
+		timer->next = cancelled;
+		cancelled = timer;
+	}
+	while(cancelled != NULL)
+	{
+		struct timer *timer = cancelled;
+		if(timer->running > 0)
+		{
+			pthread_cond_wait(&done_cond, &timer_mutex);
+			continue;
+		}
+		cancelled = timer->next;
+		timer->next = NULL;
+		release(timer);
+	}
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+void timer_dump(int out)
+{
+	pthread_mutex_lock(&timer_mutex);
+	const size_t timers = active;
+	const uint64_t added = total_added, fired = total_fired, cancelled = total_cancelled;
+	const struct hist late = lateness;
+	pthread_mutex_unlock(&timer_mutex);
+	dprintf(out, _("Timers:\t%zu\nAdded:\t%" PRIu64 "\nCallbacks:\t%" PRIu64 "\nCancelled:\t%" PRIu64 "\n"), timers, added, fired, cancelled);
+	dprintf(out, _("Lateness (us):\tp50 %" PRIu64 "\tp99 %" PRIu64 "\tmax %" PRIu64 "\n"),
+			hist_percentile_us(&late, 0.5),
+			hist_percentile_us(&late, 0.99),
+			late.max_ns / 1000);
+}
@@ -0,0 +1,35 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "thpool.h"
+#include "plugin_queue.h"
+
+#include <stdint.h>
+
+/* Resolution of the timers. */
+#define TIMER_TICK_MS	10
+/* The wheel has TIMER_LEVELS levels of 2^TIMER_LEVEL_BITS slots: 10 ms, 640 ms, 41 s, 44 min per slot. */
+#define TIMER_LEVEL_BITS	6
+#define TIMER_LEVELS	4
+
+/*
+ * Hierarchical timer wheel. Adding and cancelling are O(1). A thread ticks while there are timers and
+ * schedules the due callbacks on the thread pool, or on the queue given with the timer.
+ */
+int timer_init(threadpool thpool);
+/* Cancels every timer. Callbacks already scheduled are skipped. */
+void timer_free();
+
+/* Call call(arg, due) after delay_ms, then every interval_ms unless it is 0. due is when the call was
+ * due, in CLOCK_MONOTONIC nanoseconds. arg_free(arg) is called once the timer is gone. owner
+ * identifies who may cancel it. */
+int timer_add(uint64_t owner, uint32_t delay_ms, uint32_t interval_ms, void (*call)(void *, uint64_t), void *arg,
+		void (*arg_free)(void *), struct plugin_queue *queue, uint64_t *id);
+/* A callback already running finishes. Returns ENOENT if there is no such timer of owner. */
+int timer_cancel(uint64_t owner, uint64_t id);
+/* Cancel the timers of owner and wait for their running callbacks. Not from one of these callbacks. */
+void timer_cancel_owner(uint64_t owner);
+
+void timer_dump(int out);
+
+#endif // _TIMER_H